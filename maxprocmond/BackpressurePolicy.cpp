@@ -0,0 +1,137 @@
+#include <functional>
+#include <sstream>
+
+#include "BackpressurePolicy.h"
+
+typedef EndpointSecurity::EventId EventId;
+
+BackpressurePolicy::Config::Config()
+    : shed_low_at( 50 ), shed_normal_at( 90 ), sample( 0 ), coalesce( false ),
+      low { EventId::Stat, EventId::Lookup, EventId::Readdir, EventId::Access }
+{
+}
+
+BackpressurePolicy::BackpressurePolicy( const Config& config )
+    : config( config ), sampleCounter( 0 )
+{
+    for ( unsigned int i = 0; i < EVENTS; i++ )
+    {
+        lowEvents[i] = false;
+        criticalEvent[i] = false;
+        lastKey[i] = 0;
+        shedCount[i] = 0;
+        coalescedCount[i] = 0;
+        overflowCount[i] = 0;
+    }
+
+    for ( EventId id : config.low )
+        lowEvents[ (unsigned int) id ] = true;
+
+    for ( EventId id : criticalEvents() )
+        criticalEvent[ (unsigned int) id ] = true;
+}
+
+const std::vector< EventId >& BackpressurePolicy::criticalEvents()
+{
+    static const std::vector< EventId > events { EventId::Exec, EventId::Fork, EventId::Exit };
+    return events;
+}
+
+BackpressurePolicy::Priority BackpressurePolicy::priority( const EndpointSecurity::Event& event ) const
+{
+    if ( event.is_authentication || criticalEvent[ (unsigned int) event.event_id ] )
+        return Critical;
+
+    return lowEvents[ (unsigned int) event.event_id ] ? Low : Normal;
+}
+
+BackpressurePolicy::Decision BackpressurePolicy::decide( const EndpointSecurity::Event& event, unsigned int pressure )
+{
+    Priority prio = priority( event );
+    unsigned int id = (unsigned int) event.event_id;
+
+    if ( prio == Critical )
+        return Admit;
+
+    // Under any pressure the repeats go first: the same process doing the same thing to the same file.
+    // Only an admitted event becomes the last one, so the repeats of a shed event are still sampled.
+    uint64_t key = 0;
+
+    if ( config.coalesce )
+    {
+        key = std::hash< std::string_view >()( event.filename ) ^ ( (uint64_t) event.process_pid << 32 );
+
+        if ( pressure >= config.shed_low_at && lastKey[ id ].load( std::memory_order_relaxed ) == key )
+        {
+            coalescedCount[ id ].fetch_add( 1, std::memory_order_relaxed );
+            return Coalesced;
+        }
+    }
+
+    if ( pressure < config.shed_low_at
+         || ( prio == Normal && pressure < config.shed_normal_at )
+         || ( config.sample > 0 && sampleCounter.fetch_add( 1, std::memory_order_relaxed ) % config.sample == config.sample - 1 ) )
+    {
+        if ( config.coalesce )
+            lastKey[ id ].store( key, std::memory_order_relaxed );
+
+        return Admit;
+    }
+
+    shedCount[ id ].fetch_add( 1, std::memory_order_relaxed );
+    return Shed;
+}
+
+void BackpressurePolicy::overflowed( EndpointSecurity::EventId id )
+{
+    overflowCount[ (unsigned int) id ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+uint64_t BackpressurePolicy::shed( EndpointSecurity::EventId id ) const
+{
+    return shedCount[ (unsigned int) id ].load( std::memory_order_relaxed );
+}
+
+uint64_t BackpressurePolicy::coalesced( EndpointSecurity::EventId id ) const
+{
+    return coalescedCount[ (unsigned int) id ].load( std::memory_order_relaxed );
+}
+
+uint64_t BackpressurePolicy::overflows( EndpointSecurity::EventId id ) const
+{
+    return overflowCount[ (unsigned int) id ].load( std::memory_order_relaxed );
+}
+
+std::string BackpressurePolicy::json( const std::vector< BackpressurePolicy * >& policies, const std::vector< EndpointSecurity * >& clients )
+{
+    std::ostringstream out;
+    bool first = true;
+
+    out << "{";
+
+    for ( unsigned int i = 0; i < EVENTS; i++ )
+    {
+        uint64_t shed = 0, coalesced = 0, overflows = 0, noSlot = 0;
+
+        for ( BackpressurePolicy * policy : policies )
+        {
+            shed += policy->shed( (EventId) i );
+            coalesced += policy->coalesced( (EventId) i );
+            overflows += policy->overflows( (EventId) i );
+        }
+
+        for ( EndpointSecurity * client : clients )
+            noSlot += client->slotDrops( (EventId) i );
+
+        if ( shed == 0 && coalesced == 0 && overflows == 0 && noSlot == 0 )
+            continue;
+
+        const char * name = EndpointSecurity::eventName( (EventId) i );
+        out << ( first ? "" : "," ) << "\"" << ( name ? name : "unknown" ) << "\":{\"shed\":" << shed
+            << ",\"coalesced\":" << coalesced << ",\"overflow\":" << overflows << ",\"no_slot\":" << noSlot << "}";
+        first = false;
+    }
+
+    out << "}";
+    return out.str();
+}
@@ -0,0 +1,92 @@
+#ifndef BACKPRESSUREPOLICY_H
+#define BACKPRESSUREPOLICY_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "EndpointSecurity.h"
+
+//
+// Decides which events are passed on to the sinks when the daemon falls behind. The pressure is how full the client's
+// queue or event pool is, in percent. The auth events and exec, fork and exit are never shed. The low priority events
+// (by default stat, lookup, readdir and access) are shed first, the other ones only when the pressure gets high.
+// Under pressure the shed events could be sampled instead, and the repeats of the same event coalesced.
+// Every event which is not passed on is counted by its type, as are the admitted ones lost to the full writer queue.
+//
+// Each client has its own policy. With the decode workers decide() is called from several threads; the sampling and
+// the coalescing are then approximate. The counts could be read from any thread.
+//
+class BackpressurePolicy
+{
+    public:
+        enum Priority
+        {
+            Critical,   // never shed
+            Normal,
+            Low
+        };
+
+        enum Decision
+        {
+            Admit,
+            Shed,
+            Coalesced   // the same event as the last admitted one of its type
+        };
+
+        struct Config
+        {
+            Config();
+
+            // The pressure in percent at which the low and the normal priority events are shed
+            unsigned int    shed_low_at;
+            unsigned int    shed_normal_at;
+
+            // When above zero, one of that many events which would be shed is admitted instead
+            unsigned int    sample;
+
+            // Whether the repeats of the last admitted event of the type are dropped under pressure
+            bool            coalesce;
+
+            std::vector< EndpointSecurity::EventId > low;
+        };
+
+        static const unsigned int EVENTS = (unsigned int) EndpointSecurity::EventId::Count;
+
+        explicit BackpressurePolicy( const Config& config );
+
+        // The notify events which are never shed, besides the auth events: exec, fork and exit.
+        // The clients should make them wait for an event slot too, see EndpointSecurity::setCriticalEvents().
+        static const std::vector< EndpointSecurity::EventId >& criticalEvents();
+
+        Priority    priority( const EndpointSecurity::Event& event ) const;
+
+        // Called for every event, on the client thread. Counts the event if it is not admitted.
+        Decision    decide( const EndpointSecurity::Event& event, unsigned int pressure );
+
+        // Counts an admitted event which the writer queue had no room for
+        void        overflowed( EndpointSecurity::EventId id );
+
+        uint64_t    shed( EndpointSecurity::EventId id ) const;
+        uint64_t    coalesced( EndpointSecurity::EventId id ) const;
+        uint64_t    overflows( EndpointSecurity::EventId id ) const;
+
+        // Adds up the losses of the policies, and the events the clients dropped for no event slot, into JSON:
+        // {"<event>":{"shed":n,"coalesced":n,"overflow":n,"no_slot":n},...}, only the types with losses
+        static std::string json( const std::vector< BackpressurePolicy * >& policies, const std::vector< EndpointSecurity * >& clients );
+
+    private:
+        Config      config;
+        bool        lowEvents[ EVENTS ];
+        bool        criticalEvent[ EVENTS ];
+
+        // Counts the shed events for the sampling, and the last admitted event of each type for the coalescing
+        std::atomic< unsigned int > sampleCounter;
+        std::atomic< uint64_t > lastKey[ EVENTS ];
+
+        std::atomic< uint64_t > shedCount[ EVENTS ];
+        std::atomic< uint64_t > coalescedCount[ EVENTS ];
+        std::atomic< uint64_t > overflowCount[ EVENTS ];
+};
+
+#endif // BACKPRESSUREPOLICY_H
@@ -23,14 +23,113 @@
 //SOFTWARE.
 
 #include <unistd.h>
-#include <regex>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <bsm/libbsm.h>
 #include <sys/wait.h>
 #include <sys/attr.h>
+#include <mach/mach_time.h>
 
 #include "EndpointSecurity.h"
+#include "LatencyHistograms.h"
+#include "WorkStealingPool.h"
 #include "flags.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//
+// Fixed number of Event slots. The strings and containers of a slot keep their capacity when it is reused.
+// Slots are acquired by on_event() and released either right after the report function returns, or from any thread
+// by the EventHandle which took the event. The free slots are a stack, so the recently used slot is reused first.
+//
+class EventPool
+{
+    public:
+        EventPool( unsigned int capacity )
+            : slots( capacity ), exhausted( 0 )
+        {
+            freeSlots.reserve( capacity );
+            
+            for ( unsigned int i = capacity; i > 0; i-- )
+                freeSlots.push_back( i - 1 );
+        }
+        
+        // Returns false, and counts it, if all slots are in use. With wait set, waits for a slot to be released instead.
+        bool acquire( unsigned int& slot, bool wait = false )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            
+            if ( wait )
+                released.wait( lock, [this]{ return !freeSlots.empty(); } );
+            
+            if ( freeSlots.empty() )
+            {
+                exhausted++;
+                return false;
+            }
+            
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            return true;
+        }
+        
+        void release( unsigned int slot )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            freeSlots.push_back( slot );
+            released.notify_one();
+        }
+        
+        unsigned int inUse()
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            return slots.size() - freeSlots.size();
+        }
+        
+        std::vector< EndpointSecurity::Event >  slots;
+        std::atomic< uint64_t >                 exhausted;
+        
+    private:
+        std::mutex                  mutex;
+        std::condition_variable     released;
+        std::vector< unsigned int > freeSlots;
+};
+
+
+// Retains the messages with es_retain_message(), available since macOS 11
+class EsMessageRetainer : public MessageRetainer
+{
+    public:
+        const es_message_t * retain( const es_message_t * message ) override
+        {
+            es_retain_message( message );
+            return message;
+        }
+        
+        void release( const es_message_t * message ) override
+        {
+            es_release_message( message );
+        }
+};
+
+// A retained message waiting for a decode worker, with what on_message() learned about it
+struct DecodeItem
+{
+    const es_message_t *    message = nullptr;
+    uint64_t                received = 0;
+    int64_t                 slack = 0;
+};
+
+// The decoder the current decode worker thread runs, so takeEvent() could be called on the client as usual
+static thread_local EndpointSecurity * currentDecoder = nullptr;
+
 
 class EndpointSecurityImpl
 {
@@ -38,172 +137,748 @@ class EndpointSecurityImpl
         // the Apple client
         es_client_t *client;
         
+        // The client which the decoders mute through, as they have none of their own: its owner, or this one.
+        // clientMutex guards the client against destroy() while a decode worker mutes.
+        EndpointSecurityImpl *  owner;
+        std::mutex              clientMutex;
+        
+        void muteProcess( const audit_token_t * token )
+        {
+            EndpointSecurityImpl * impl = owner ? owner : this;
+            std::lock_guard< std::mutex > lock( impl->clientMutex );
+            
+            if ( impl->client )
+                es_mute_process( impl->client, token );
+        }
+        
         // Callback function pointer
         std::function<int(const EndpointSecurity::Event&)> reportfunc;
         
-        // The event which we reuse between messages.
-        EndpointSecurity::Event event;
+        // The batch report function, which for the per-event report function is an adapter calling it for each event.
+        // The events collected for it hold their slots; batchTaken tells which ones the per-event function took.
+        // The flusher thread reports the batch when the oldest event waited batchDelay. All guarded by batchMutex.
+        EndpointSecurity::BatchReportFunc   batchfunc;
+        size_t                              batchMax;
+        std::chrono::milliseconds           batchDelay;
+        std::vector< const EndpointSecurity::Event * > batchEvents;
+        std::vector< unsigned int >         batchSlots;
+        std::vector< bool >                 batchTaken;
+        std::chrono::steady_clock::time_point batchStart;
+        std::mutex                          batchMutex;
+        std::condition_variable             flusherWakeup;
+        std::thread                         flusher;
+        bool                                flusherStop;
+        
+        // Adds the current event to the batch, which owns its slot from now on, and reports the batch if it is full
+        void queueEvent()
+        {
+            std::lock_guard< std::mutex > lock( batchMutex );
+            
+            if ( batchEvents.empty() && flusher.joinable() )
+            {
+                batchStart = std::chrono::steady_clock::now();
+                flusherWakeup.notify_one();
+            }
+            
+            batchEvents.push_back( event );
+            batchSlots.push_back( eventSlot );
+            eventTaken = true;
+            
+            if ( batchEvents.size() >= batchMax )
+                flushBatch();
+        }
+        
+        // Reports the collected events and releases their slots. batchMutex must be held.
+        void flushBatch()
+        {
+            if ( batchEvents.empty() )
+                return;
+            
+            // The slots go back even if the report function throws
+            struct BatchGuard
+            {
+                EndpointSecurityImpl * impl;
+                
+                ~BatchGuard()
+                {
+                    for ( size_t i = 0; i < impl->batchSlots.size(); i++ )
+                    {
+                        if ( !impl->batchTaken[i] )
+                            impl->pool->release( impl->batchSlots[i] );
+                    }
+                    
+                    impl->batchEvents.clear();
+                    impl->batchSlots.clear();
+                }
+            } guard { this };
+            
+            batchTaken.assign( batchEvents.size(), false );
+            batchfunc( EndpointSecurity::EventBatch( batchEvents.data(), batchEvents.size() ) );
+        }
+        
+        // Stops the flusher thread and reports what is left
+        void stopBatching()
+        {
+            if ( flusher.joinable() )
+            {
+                {
+                    std::lock_guard< std::mutex > lock( batchMutex );
+                    flusherStop = true;
+                    flusherWakeup.notify_one();
+                }
+                
+                flusher.join();
+            }
+            
+            std::lock_guard< std::mutex > lock( batchMutex );
+            flushBatch();
+        }
+        
+        // The event slots, and the slot on_event() is filling. If the report function took the event, on_event() does not release it.
+        EventPool *     pool;
+        EndpointSecurity::Event * event;
+        unsigned int    eventSlot;
+        
+        // The event types which wait for a slot rather than being dropped, besides the auth events,
+        // and the events of each type dropped for no free slot
+        bool                    waitForSlot[ (unsigned int) EndpointSecurity::EventId::Count ];
+        std::atomic< uint64_t > slotDrops[ (unsigned int) EndpointSecurity::EventId::Count ];
+        bool            eventTaken;
+        
+        // Whether the event strings point into the message instead of holding a copy
+        bool            viewMode;
+        
+        // The process information by pid and pidversion. Entries are removed on exit and exec, and the whole cache is
+        // dropped if it grows too large, which happens when the exit events are not subscribed.
+        std::unordered_map< uint64_t, std::shared_ptr< const EndpointSecurity::CachedProcess > > processCache;
+        static const size_t PROCESS_CACHE_MAX = 8192;
+        
+        // Whether ExecPayload::argv is filled, and the exec arguments reused between the events
+        bool            execArgv;
+        std::vector< std::string_view > execArgs;
+        
+        // The auth responses: mach_absolute_time() units, the slack of the message being handled, and the totals
+        mach_timebase_info_data_t   timebase;
+        int64_t                     responseSlack;
+        std::atomic< uint64_t >     authResponses;
+        std::atomic< uint64_t >     authMissed;
+        std::atomic< int64_t >      authMinSlack;
+        std::atomic< int64_t >      authTotalSlack;
+        
+        // mach_absolute_time() when on_message() received the message being handled, 0 outside of on_message()
+        uint64_t                    receivedTime;
+        
+        // The decode workers, each with its own decoder: a detached EndpointSecurity with its own slots and process cache
+        unsigned int                decodeWorkers;
+        MessageRetainer *           retainer;
+        std::vector< EndpointSecurity * > decoders;
+        WorkStealingPool< DecodeItem > * decodePool;
+        
+        // Returns the nanoseconds left until the deadline at the response time, negative if it was missed, and counts it
+        int64_t recordSlack( uint64_t deadline, uint64_t now )
+        {
+            int64_t ticks = deadline >= now ? (int64_t) (deadline - now) : -(int64_t) (now - deadline);
+            int64_t slack = ticks * (int64_t) timebase.numer / (int64_t) timebase.denom;
+            
+            authResponses++;
+            authTotalSlack += slack;
+            
+            if ( slack < 0 )
+                authMissed++;
+            
+            int64_t min = authMinSlack;
+            
+            while ( slack < min && !authMinSlack.compare_exchange_weak( min, slack ) )
+                ;
+            
+            return slack;
+        }
         
         // For selective tracking
         std::string     monitoredProcessPath;
         std::map< pid_t, int > monitoredProcesses;
         
-        // Create the string out of es_string_token_t
-        static inline std::string getEsStringToken( es_string_token_t src )
+        // Set the event string from es_string_token_t, either copying it or pointing into the message
+        inline void setEsStringToken( EndpointSecurity::EventString& dst, es_string_token_t src )
         {
-            if ( src.length > 0 )
-                return src.data;
+            if ( src.length == 0 )
+                dst.clear();
+            else if ( viewMode )
+                dst.point( src.data, src.length );
             else
-                return "";
+                dst.assign( src.data, src.length );
         }
 
-        // Create the string out of es_file_t
-        static inline std::string getEsFile( es_file_t * src )
+        // Set the event string from es_file_t path
+        inline void setEsFile( EndpointSecurity::EventString& dst, es_file_t * src )
         {
             if ( src )
-                return getEsStringToken( src->path );
+                setEsStringToken( dst, src->path );
             else
-                return "";
+                dst.clear();
         }
         
-        // Create the string out of time_t
-        static inline std::string timespecToString( time_t tval )
+        // Set the event string from the C string in the message, such as statfs names
+        inline void setCString( EndpointSecurity::EventString& dst, const char * src )
         {
-            // You can get nanosecond time too from tv_usec if needed
-            char outtime[ 256 ];
-            strftime( outtime, sizeof(outtime) - 1, "%Y-%m-%d %H:%M:%S", std::localtime(&tval) );
-            return outtime;
+            if ( viewMode )
+                dst.point( src, strlen( src ) );
+            else
+                dst.assign( src, strlen( src ) );
         }
         
-        // Dumps es_process_t
-        void getEsProcess( es_process_t * process, const std::string& prefix )
+        // Copy es_string_token_t into the string, for the values which are built from several tokens
+        static inline void assignEsStringToken( std::string& dst, es_string_token_t src )
         {
-            // If the process already exited, we won't have its info
-            if ( !process )
+            if ( src.length > 0 )
+                dst.assign( src.data, src.length );
+            else
+                dst.clear();
+        }
+        
+        // Longest formatted time, "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" and the terminating zero
+        static const size_t TIME_DESC_MAX = 32;
+        
+        // Formats time_t as the local time into the buffer, optionally appending the nanoseconds, and returns the length.
+        // localtime takes the global lock and reads the time zone, so each thread caches the formatted seconds.
+        // The cache has a few slots, as the event time and the process start time usually differ.
+        static size_t formatTime( char * buf, time_t tval, long nsec = -1 )
+        {
+            struct CachedSecond
             {
-                event.parameters[ prefix + "pid"] = "-1";
-                return;
+                time_t  second;
+                bool    valid;
+                char    text[20];   // "YYYY-MM-DD HH:MM:SS"
+            };
+            
+            static thread_local CachedSecond cache[8];
+            CachedSecond& slot = cache[ (size_t) tval % 8 ];
+            
+            if ( !slot.valid || slot.second != tval )
+            {
+                struct tm tmval;
+                
+                if ( !localtime_r( &tval, &tmval ) || strftime( slot.text, sizeof(slot.text), "%Y-%m-%d %H:%M:%S", &tmval ) != 19 )
+                {
+                    // Out of range for the format; do not cache it
+                    slot.valid = false;
+                    return snprintf( buf, TIME_DESC_MAX, "%lld", (long long) tval );
+                }
+                
+                slot.second = tval;
+                slot.valid = true;
+            }
+            
+            memcpy( buf, slot.text, 19 );
+            size_t len = 19;
+            
+            if ( nsec >= 0 )
+            {
+                // Fixed width, so the text sorts the same way as the time
+                buf[ len ] = '.';
+                
+                for ( int i = 9; i > 0; i-- )
+                {
+                    buf[ len + i ] = '0' + nsec % 10;
+                    nsec /= 10;
+                }
+                
+                len += 10;
             }
-            event.parameters[ prefix + "pid"] = std::to_string( audit_token_to_pid( process->audit_token ));
-            event.parameters[ prefix + "euid"] = std::to_string( audit_token_to_euid( process->audit_token ));
-            event.parameters[ prefix + "ruid"] = std::to_string( audit_token_to_ruid( process->audit_token ));
-            event.parameters[ prefix + "rgid"] = std::to_string(audit_token_to_rgid( process->audit_token ));
-            event.parameters[ prefix + "egid"] = std::to_string( audit_token_to_egid( process->audit_token ));
-            event.parameters[ prefix + "ppid"] = std::to_string( process->ppid );
-            event.parameters[ prefix + "oppid"] = std::to_string( process->original_ppid );
-            event.parameters[ prefix + "gid"] = std::to_string( process->group_id );
-            event.parameters[ prefix + "sid"] = std::to_string( process->session_id );
-            event.parameters[ prefix + "csflags"] = std::to_string( process->codesigning_flags );
-            event.parameters[ prefix + "csflags_desc"] = getBitmask( value_map_codesign, process->codesigning_flags );
-            event.parameters[ prefix + "is_platform_binary"] = process->is_platform_binary ? "true" : "false";
-            event.parameters[ prefix + "is_es_client"] = process->is_es_client ? "true" : "false";
-            event.parameters[ prefix + "signing_id"] = getEsStringToken( process->signing_id );
-            event.parameters[ prefix + "team_id"] = getEsStringToken( process->team_id );
-            event.parameters[ prefix + "executable"] = getEsFile( process->executable );
+            
+            buf[ len ] = '\0';
+            return len;
         }
         
-        // Dumps struct statfs
-        void getStatFs( const struct statfs *statfs )
+        // Same as above, returning the string
+        static inline std::string timeToString( time_t tval, long nsec = -1 )
         {
-            event.parameters[ "f_mntfromname"] = statfs->f_mntfromname;
-            event.parameters[ "f_mntonname"] = statfs->f_mntonname;
+            char outtime[ TIME_DESC_MAX ];
+            return std::string( outtime, formatTime( outtime, tval, nsec ) );
         }
         
-        // Converts bitmask to a human-readable value, i.e. 5 into "FREAD|O_NONBLOCK"
-        static std::string getBitmask( const std::map< unsigned int, const char *>& map, unsigned int value )
+        static inline uint64_t processKey( const audit_token_t& token )
         {
-            std::string res;
-            unsigned int origvalue = value;
+            return ((uint64_t) (uint32_t) audit_token_to_pidversion( token ) << 32) | (uint32_t) audit_token_to_pid( token );
+        }
+        
+        // Returns the cached information for the process, extracting it on the first event of the process
+        const std::shared_ptr< const EndpointSecurity::CachedProcess >& lookupProcess( const es_process_t * process )
+        {
+            uint64_t key = processKey( process->audit_token );
+            auto it = processCache.find( key );
+            
+            if ( it != processCache.end() )
+                return it->second;
             
-            for ( auto i : map )
+            if ( processCache.size() >= PROCESS_CACHE_MAX )
+                processCache.clear();
+            
+            auto entry = std::make_shared< EndpointSecurity::CachedProcess >();
+            assignEsStringToken( entry->signing_id, process->signing_id );
+            assignEsStringToken( entry->team_id, process->team_id );
+            
+            if ( process->executable )
+                assignEsStringToken( entry->executable, process->executable->path );
+            
+            entry->start_time = timeToString( process->start_time.tv_sec );
+            entry->csflags = process->codesigning_flags;
+            
+            return processCache.emplace( key, std::move( entry ) ).first->second;
+        }
+        
+        // Fills ProcessInfo from es_process_t
+        void getEsProcess( es_process_t * process, EndpointSecurity::ProcessInfo& info )
+        {
+            // If the process already exited, we won't have its info. The strings could still point into an earlier
+            // message of the reused slot, so they are cleared.
+            if ( !process )
             {
-                if ( value & i.first )
-                {
-                    value ^= i.first;
-                    
-                    if ( !res.empty() )
-                        res += "|";
-                    
-                    res += i.second;
-                }
+                info.pid = -1;
+                info.signing_id.clear();
+                info.team_id.clear();
+                info.executable.clear();
+                return;
             }
             
-            if ( value )
-                res += " [" + std::to_string(value) + "?] (";
-            else
-                res += " (";
-
-            res += std::to_string( origvalue ) + ")";
-            return res;
+            info.pid = audit_token_to_pid( process->audit_token );
+            info.euid = audit_token_to_euid( process->audit_token );
+            info.ruid = audit_token_to_ruid( process->audit_token );
+            info.rgid = audit_token_to_rgid( process->audit_token );
+            info.egid = audit_token_to_egid( process->audit_token );
+            info.ppid = process->ppid;
+            info.oppid = process->original_ppid;
+            info.gid = process->group_id;
+            info.sid = process->session_id;
+            info.csflags = process->codesigning_flags;
+            info.is_platform_binary = process->is_platform_binary;
+            info.is_es_client = process->is_es_client;
+            setEsStringToken( info.signing_id, process->signing_id );
+            setEsStringToken( info.team_id, process->team_id );
+            setEsFile( info.executable, process->executable );
         }
-
-        // Converts value to a human-readable value, i.e. 1 into "F_DUPFD"
-        static std::string getValue( const std::map< unsigned int, const char *>& map, unsigned int value )
+        
+        // Dumps ProcessInfo into the compatibility parameters
+        static void describeProcess( std::map<std::string, std::string>& params, const EndpointSecurity::ProcessInfo& info, const std::string& prefix )
+        {
+            if ( info.pid == -1 )
+            {
+                params[ prefix + "pid"] = "-1";
+                return;
+            }
+            
+            params[ prefix + "pid"] = std::to_string( info.pid );
+            params[ prefix + "euid"] = std::to_string( info.euid );
+            params[ prefix + "ruid"] = std::to_string( info.ruid );
+            params[ prefix + "rgid"] = std::to_string( info.rgid );
+            params[ prefix + "egid"] = std::to_string( info.egid );
+            params[ prefix + "ppid"] = std::to_string( info.ppid );
+            params[ prefix + "oppid"] = std::to_string( info.oppid );
+            params[ prefix + "gid"] = std::to_string( info.gid );
+            params[ prefix + "sid"] = std::to_string( info.sid );
+            params[ prefix + "csflags"] = std::to_string( info.csflags );
+            params[ prefix + "csflags_desc"] = info.csflags_desc();
+            params[ prefix + "is_platform_binary"] = info.is_platform_binary ? "true" : "false";
+            params[ prefix + "is_es_client"] = info.is_es_client ? "true" : "false";
+            params[ prefix + "signing_id"] = info.signing_id;
+            params[ prefix + "team_id"] = info.team_id;
+            params[ prefix + "executable"] = info.executable;
+        }
+        
+        // Counts the formatted descriptions, see EndpointSecurity::formattedDescriptions()
+        static std::atomic< uint64_t > formattedDescriptions;
+        
+        // Dumps struct attrlist into the compatibility parameters
+        static void describeAttrlist( std::map<std::string, std::string>& params, const struct attrlist& attrlist )
         {
-            std::string res;
+            if ( attrlist.commonattr )
+                params["commonattr"] = getBitmask( value_map_attr_common, attrlist.commonattr );
             
-            auto i = map.find( value );
+            if ( attrlist.volattr )
+                params["volattr"] = getBitmask( value_map_attr_volume, attrlist.volattr );
             
-            if ( i != map.end() )
-                res = i->second;
-            else
-                res = "[?]";
+            if ( attrlist.dirattr )
+                params["dirattr"] = getBitmask( value_map_attr_dir, attrlist.dirattr );
             
-            res += " (" + std::to_string( value ) + ")";
-            return res;
+            if ( attrlist.fileattr )
+                params["fileattr"] = getBitmask( value_map_attr_file, attrlist.fileattr );
+            
+            if ( attrlist.forkattr )
+                params["forkattr"] = getBitmask( value_map_attr_fork, attrlist.forkattr );
+        }
+        
+        // Converts bitmask to a human-readable value, i.e. 5 into "FREAD|O_NONBLOCK (5)"
+        static std::string getBitmask( const BitNames& map, unsigned int value )
+        {
+            formattedDescriptions++;
+            
+            char buf[ FLAG_DESC_MAX ];
+            return std::string( buf, formatBitmask( buf, sizeof(buf), map, value ) );
+        }
+
+        // Converts value to a human-readable value, i.e. 1 into "F_DUPFD (1)"
+        static std::string getValue( const ValueNames& map, unsigned int value )
+        {
+            formattedDescriptions++;
+            
+            char buf[ FLAG_DESC_MAX ];
+            return std::string( buf, formatValue( buf, sizeof(buf), map, value ) );
         }
         
 };
 
+std::atomic< uint64_t > EndpointSecurityImpl::formattedDescriptions;
+
 
 EndpointSecurity::EndpointSecurity()
 {
     pimpl = new EndpointSecurityImpl();
     pimpl->client = nullptr;
+    pimpl->owner = nullptr;
     pimpl->reportfunc = nullptr;
+    pimpl->batchfunc = nullptr;
+    pimpl->batchMax = 1;
+    pimpl->batchDelay = std::chrono::milliseconds( 0 );
+    pimpl->flusherStop = false;
+    pimpl->viewMode = false;
+    pimpl->execArgv = false;
+    pimpl->pool = new EventPool( 64 );
+    pimpl->event = nullptr;
+    pimpl->eventTaken = false;
+    
+    for ( unsigned int i = 0; i < (unsigned int) EventId::Count; i++ )
+    {
+        pimpl->waitForSlot[i] = false;
+        pimpl->slotDrops[i] = 0;
+    }
+    
+    pimpl->responseSlack = 0;
+    pimpl->receivedTime = 0;
+    pimpl->decodeWorkers = 0;
+    pimpl->retainer = nullptr;
+    pimpl->decodePool = nullptr;
+    pimpl->authResponses = 0;
+    pimpl->authMissed = 0;
+    pimpl->authMinSlack = INT64_MAX;
+    pimpl->authTotalSlack = 0;
+    mach_timebase_info( &pimpl->timebase );
 }
 
 EndpointSecurity::~EndpointSecurity()
 {
     // Do not call destroy() because it can throw an exception. Here we ignore the return erros since there's nothing we can do.
     if ( pimpl->client )
-        es_delete_client( pimpl->client );
-            
+    {
+        es_client_t * client = pimpl->client;
+        
+        {
+            std::lock_guard< std::mutex > lock( pimpl->clientMutex );
+            pimpl->client = nullptr;
+        }
+        
+        es_delete_client( client );
+    }
+    
+    // Decodes the queued messages first, as they use the decoders
+    delete pimpl->decodePool;
+    
+    for ( EndpointSecurity * decoder : pimpl->decoders )
+        delete decoder;
+    
+    // The remaining events are still reported; the report function must not throw out of here
+    try
+    {
+        pimpl->stopBatching();
+    }
+    catch ( ... )
+    {
+    }
+    
+    delete pimpl->pool;
     delete pimpl;
 }
 
+void EndpointSecurity::setViewMode( bool enabled )
+{
+    pimpl->viewMode = enabled;
+}
+
+void EndpointSecurity::setExecArgv( bool enabled )
+{
+    pimpl->execArgv = enabled;
+}
+
+void EndpointSecurity::encodeArgs( std::string& dst, const std::string_view * args, size_t count )
+{
+    // Two quotes per argument, separators between them, and one more character per quote inside
+    size_t length = count > 0 ? count * 3 - 1 : 0;
+    
+    for ( size_t i = 0; i < count; i++ )
+        length += args[i].length() + std::count( args[i].begin(), args[i].end(), '"' );
+    
+    dst.resize( length );
+    char * out = &dst[0];
+    
+    for ( size_t i = 0; i < count; i++ )
+    {
+        if ( i > 0 )
+            *out++ = ' ';
+        
+        *out++ = '"';
+        
+        const char * data = args[i].data();
+        const char * end = data + args[i].length();
+        
+        while ( data < end )
+        {
+            const char * quote = (const char *) memchr( data, '"', end - data );
+            const char * chunkend = quote ? quote : end;
+            
+            memcpy( out, data, chunkend - data );
+            out += chunkend - data;
+            data = chunkend;
+            
+            if ( quote )
+            {
+                *out++ = '\\';
+                *out++ = '"';
+                data++;
+            }
+        }
+        
+        *out++ = '"';
+    }
+}
+
+void EndpointSecurity::setCriticalEvents( const std::vector< EventId >& ids )
+{
+    for ( bool& wait : pimpl->waitForSlot )
+        wait = false;
+    
+    for ( EventId id : ids )
+        pimpl->waitForSlot[ (unsigned int) id ] = true;
+}
+
+void EndpointSecurity::setPoolSize( unsigned int slots )
+{
+    if ( pimpl->client || pimpl->batchfunc )
+        throw EndpointSecurityException( 0, "You must call setPoolSize() before you call create()" );
+    
+    if ( slots == 0 )
+        throw EndpointSecurityException( 0, "The pool needs at least one slot" );
+    
+    delete pimpl->pool;
+    pimpl->pool = new EventPool( slots );
+}
+
+uint64_t EndpointSecurity::slotDrops( EventId id ) const
+{
+    uint64_t drops = pimpl->slotDrops[ (unsigned int) id ].load( std::memory_order_relaxed );
+    
+    for ( EndpointSecurity * decoder : pimpl->decoders )
+        drops += decoder->slotDrops( id );
+    
+    return drops;
+}
+
+void EndpointSecurity::setDecodeWorkers( unsigned int workers, MessageRetainer * retainer )
+{
+    if ( pimpl->client || pimpl->batchfunc )
+        throw EndpointSecurityException( 0, "You must call setDecodeWorkers() before you call create()" );
+    
+    static EsMessageRetainer esRetainer;
+    
+    pimpl->decodeWorkers = workers;
+    pimpl->retainer = retainer ? retainer : &esRetainer;
+}
+
+void EndpointSecurity::startReporting( std::function<int(const EndpointSecurity::Event&)> reportfunc, BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs )
+{
+    if ( !batchfunc )
+    {
+        // The per-event report function is called for each event of the batch, and could take it
+        pimpl->reportfunc = reportfunc;
+        pimpl->batchfunc = [this]( const EventBatch& batch )
+        {
+            for ( size_t i = 0; i < batch.size(); i++ )
+            {
+                pimpl->eventSlot = pimpl->batchSlots[i];
+                pimpl->event = &pimpl->pool->slots[ pimpl->eventSlot ];
+                pimpl->eventTaken = false;
+                pimpl->reportfunc( *pimpl->event );
+                pimpl->batchTaken[i] = pimpl->eventTaken;
+            }
+            
+            // The batch has taken care of the current event's slot
+            pimpl->eventTaken = true;
+        };
+        
+        return;
+    }
+    
+    // The events in the view mode point into the message, which is gone when the next one comes
+    if ( pimpl->viewMode && maxEvents > 1 )
+        throw EndpointSecurityException( 0, "The view mode could not be used with the batches of more than one event" );
+    
+    pimpl->batchfunc = batchfunc;
+    // The batch holds the slots of its events, so it is reported before it takes all of them
+    pimpl->batchMax = std::min< size_t >( std::max< size_t >( maxEvents, 1 ), pimpl->pool->slots.size() );
+    pimpl->batchDelay = std::chrono::milliseconds( maxDelayMs );
+    pimpl->batchEvents.reserve( pimpl->batchMax );
+    pimpl->batchSlots.reserve( pimpl->batchMax );
+    
+    if ( maxDelayMs == 0 || pimpl->batchMax == 1 )
+        return;
+    
+    pimpl->flusher = std::thread( [this]()
+    {
+        std::unique_lock< std::mutex > lock( pimpl->batchMutex );
+        
+        while ( !pimpl->flusherStop )
+        {
+            if ( pimpl->batchEvents.empty() )
+                pimpl->flusherWakeup.wait( lock );
+            else if ( std::chrono::steady_clock::now() >= pimpl->batchStart + pimpl->batchDelay )
+                pimpl->flushBatch();
+            else
+                pimpl->flusherWakeup.wait_until( lock, pimpl->batchStart + pimpl->batchDelay );
+        }
+    });
+}
+
+void EndpointSecurity::flush()
+{
+    for ( EndpointSecurity * decoder : pimpl->decoders )
+        decoder->flush();
+    
+    std::lock_guard< std::mutex > lock( pimpl->batchMutex );
+    pimpl->flushBatch();
+}
+
+void EndpointSecurity::startDecoders( std::function<int(const EndpointSecurity::Event&)> reportfunc, BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs )
+{
+    if ( pimpl->decodeWorkers == 0 )
+        return;
+    
+    if ( !pimpl->monitoredProcessPath.empty() )
+        throw EndpointSecurityException( 0, "monitorOnlyProcessPath() is not supported with the decode workers" );
+    
+    // The decoders get the settings of this client
+    for ( unsigned int i = 0; i < pimpl->decodeWorkers; i++ )
+    {
+        EndpointSecurity * decoder = new EndpointSecurity();
+        decoder->pimpl->owner = pimpl;
+        decoder->setViewMode( pimpl->viewMode );
+        decoder->setExecArgv( pimpl->execArgv );
+        decoder->setPoolSize( pimpl->pool->slots.size() );
+        
+        for ( unsigned int id = 0; id < (unsigned int) EventId::Count; id++ )
+            decoder->pimpl->waitForSlot[ id ] = pimpl->waitForSlot[ id ];
+        
+        if ( batchfunc )
+            decoder->createDetached( batchfunc, maxEvents, maxDelayMs );
+        else
+            decoder->createDetached( reportfunc );
+        
+        pimpl->decoders.push_back( decoder );
+    }
+    
+    pimpl->decodePool = new WorkStealingPool< DecodeItem >( pimpl->decodeWorkers, [this]( unsigned int worker, DecodeItem& item )
+    {
+        EndpointSecurity * decoder = pimpl->decoders[ worker ];
+        currentDecoder = decoder;
+        decoder->pimpl->receivedTime = item.received;
+        decoder->pimpl->responseSlack = item.slack;
+        
+        // There is nobody to report the error to on this thread; the message is lost as a dropped one would be
+        try
+        {
+            decoder->on_event( item.message );
+        }
+        catch ( EndpointSecurityException& )
+        {
+        }
+        
+        decoder->pimpl->receivedTime = 0;
+        decoder->pimpl->responseSlack = 0;
+        currentDecoder = nullptr;
+        pimpl->retainer->release( item.message );
+    });
+}
+
+EndpointSecurity::EventHandle EndpointSecurity::takeEvent()
+{
+    // Called from the report function on a decode worker
+    if ( !pimpl->decoders.empty() && currentDecoder )
+        return currentDecoder->takeEvent();
+    
+
+    if ( !pimpl->event || pimpl->eventTaken )
+        throw EndpointSecurityException( 0, "takeEvent() must be called once from the report function" );
+    
+    pimpl->eventTaken = true;
+    return EventHandle( pimpl->pool, pimpl->eventSlot, pimpl->event );
+}
+
+EndpointSecurity::PoolStats EndpointSecurity::poolStats() const
+{
+    PoolStats stats;
+    
+    if ( !pimpl->decoders.empty() )
+    {
+        stats = {};
+        
+        for ( EndpointSecurity * decoder : pimpl->decoders )
+        {
+            PoolStats decoderStats = decoder->poolStats();
+            stats.capacity += decoderStats.capacity;
+            stats.in_use += decoderStats.in_use;
+            stats.exhausted += decoderStats.exhausted;
+        }
+        
+        return stats;
+    }
+    
+    stats.capacity = pimpl->pool->slots.size();
+    stats.in_use = pimpl->pool->inUse();
+    stats.exhausted = pimpl->pool->exhausted;
+    return stats;
+}
+
+void EndpointSecurity::EventHandle::release()
+{
+    if ( pool )
+        pool->release( slot );
+    
+    pool = nullptr;
+    event = nullptr;
+}
+
 void EndpointSecurity::monitorOnlyProcessPath( const std::string& process )
 {
     pimpl->monitoredProcessPath = process;
 }
 
-// Creates the EndpointSecurity object. Besides implementing the callback in C++, it parses the error and converts it into the exception
 void EndpointSecurity::create( std::function<int(const EndpointSecurity::Event&)> reportfunc )
+{
+    // The reporting and the workers must be ready for the first message
+    createDetached( reportfunc );
+    connect();
+}
+
+void EndpointSecurity::create( BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs )
+{
+    createDetached( batchfunc, maxEvents, maxDelayMs );
+    connect();
+}
+
+// Creates the EndpointSecurity object. Besides implementing the callback in C++, it parses the error and converts it into the exception
+void EndpointSecurity::connect()
 {
     // Create the client
     es_new_client_result_t res = es_new_client( &pimpl->client, ^(es_client_t * client, const es_message_t * message)
                           {
-                              on_event( message );
-                              
-                              // Return the auth result if the event requires it
-                              if ( message->action_type == ES_ACTION_TYPE_AUTH )
-                              {
-                                  // This one requires es_respond_flags_result according to https://developer.apple.com/forums/thread/129112
-                                  if ( message->event_type == ES_EVENT_TYPE_AUTH_OPEN )
-                                  {
-                                    es_respond_result_t res = es_respond_flags_result( client, message, 0x7FFFFFFF, true );
-                                  
-                                    if ( res != 0 )
-                                        throw EndpointSecurityException( res, "Failed to respond to event: es_respond_auth_result() failed" );
-                                  }
-                                  else
-                                  {
-                                    es_respond_result_t res = es_respond_auth_result( client, message, ES_AUTH_RESULT_ALLOW, true );
-                                  
-                                    if ( res != 0 )
-                                        throw EndpointSecurityException( res, "Failed to respond to event: es_respond_auth_result() failed" );
-                                  }
-                              }
+                              on_message( client, message );
                           });
 
     switch (res)
@@ -232,19 +907,99 @@ void EndpointSecurity::create( std::function<int(const EndpointSecurity::Event&)
         default:
             throw EndpointSecurityException( res, "Unknown error" );
     }
+}
+
+void EndpointSecurity::on_message( es_client_t * client, const es_message_t * message )
+{
+    uint64_t received = mach_absolute_time();
+    EventId id = describeEvent( message->event_type ).id;
+    
+    // mach_time is on the same clock as mach_absolute_time(), unlike the wall clock time
+    LatencyHistograms::recordSince( LatencyHistograms::Delivery, id, message->mach_time, received );
+    
+    // The auth response goes first: the decision does not depend on the sinks, and the client is killed if it misses the deadline
+    if ( message->action_type == ES_ACTION_TYPE_AUTH )
+    {
+        es_respond_result_t res;
+        
+        // This one requires es_respond_flags_result according to https://developer.apple.com/forums/thread/129112
+        if ( message->event_type == ES_EVENT_TYPE_AUTH_OPEN )
+            res = es_respond_flags_result( client, message, 0x7FFFFFFF, true );
+        else
+            res = es_respond_auth_result( client, message, ES_AUTH_RESULT_ALLOW, true );
+        
+        uint64_t responded = mach_absolute_time();
+        pimpl->responseSlack = pimpl->recordSlack( message->deadline, responded );
+        LatencyHistograms::recordSince( LatencyHistograms::Response, id, received, responded );
+        
+        if ( res != 0 )
+            throw EndpointSecurityException( res, "Failed to respond to event: es_respond_auth_result() failed" );
+    }
     
-    pimpl->reportfunc = reportfunc;
+    // With the decode workers the message is decoded later; only our own process is handled here, to be muted
+    if ( pimpl->decodePool && audit_token_to_pid( message->process->audit_token ) != getpid() )
+    {
+        DecodeItem item;
+        item.message = pimpl->retainer->retain( message );
+        item.received = received;
+        item.slack = pimpl->responseSlack;
+        pimpl->responseSlack = 0;
+        
+        // Keyed by the thread, so the events of a thread are reported in the order they were delivered
+        pimpl->decodePool->push( message->thread ? message->thread->thread_id : message->global_seq_num, std::move( item ) );
+        return;
+    }
+    
+    // Now the event could be recorded
+    pimpl->receivedTime = received;
+    on_event( message );
+    pimpl->responseSlack = 0;
+    pimpl->receivedTime = 0;
+}
+
+EndpointSecurity::AuthStats EndpointSecurity::authStats() const
+{
+    AuthStats stats;
+    stats.responses = pimpl->authResponses;
+    stats.missed = pimpl->authMissed;
+    stats.min_slack_ns = pimpl->authMinSlack;
+    stats.total_slack_ns = pimpl->authTotalSlack;
+    return stats;
+}
+
+void EndpointSecurity::createDetached( std::function<int(const EndpointSecurity::Event&)> reportfunc )
+{
+    startDecoders( reportfunc, nullptr, 1, 0 );
+    startReporting( reportfunc, nullptr, 1, 0 );
+}
+
+void EndpointSecurity::createDetached( BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs )
+{
+    startDecoders( nullptr, batchfunc, maxEvents, maxDelayMs );
+    startReporting( nullptr, batchfunc, maxEvents, maxDelayMs );
 }
 
 void EndpointSecurity::destroy()
 {
     if ( pimpl->client )
     {
-        if ( es_delete_client( pimpl->client ) == ES_RETURN_ERROR )
-            throw EndpointSecurityException( ES_RETURN_ERROR, "Failed to destroy: ES_RETURN_ERROR" );
+        // The decode workers stop muting through it first; not held over es_delete_client(), which waits for on_message()
+        es_client_t * client = pimpl->client;
         
-        pimpl->client = nullptr;
+        {
+            std::lock_guard< std::mutex > lock( pimpl->clientMutex );
+            pimpl->client = nullptr;
+        }
+        
+        if ( es_delete_client( client ) == ES_RETURN_ERROR )
+            throw EndpointSecurityException( ES_RETURN_ERROR, "Failed to destroy: ES_RETURN_ERROR" );
     }
+    
+    // No more messages are coming; decode the queued ones and report the collected ones
+    if ( pimpl->decodePool )
+        pimpl->decodePool->stop();
+    
+    flush();
 }
 
 // Subscribe for the events. Can be called multiple times.
@@ -271,6 +1026,229 @@ void EndpointSecurity::unsubscribe( const std::vector< es_event_type_t >& events
         throw EndpointSecurityException( res, "Failed to unsubscribe: ES_RETURN_ERROR" );
 }
 
+namespace
+{
+    // One row of the event table: the notify and auth types share the name, the handler and the primary path
+    struct EventTableRow
+    {
+        const char *                name;
+        EndpointSecurity::EventId   id;
+        es_event_type_t             notify;
+        es_event_type_t             auth;   // ES_EVENT_TYPE_LAST if there is no auth event
+        void                        (*extract)( EndpointSecurity& es, const es_message_t * message );
+        const EndpointSecurity::EventString * (*primary_path)( const EndpointSecurity::Event& event );
+    };
+    
+    typedef std::array< EndpointSecurity::EventDescriptor, ES_EVENT_TYPE_LAST + 1 > EventTable;
+    
+    // Builds the table indexed by es_event_type_t. The unsupported types, and ES_EVENT_TYPE_LAST itself, have no name.
+    template< size_t N > constexpr EventTable makeEventTable( const EventTableRow (&rows)[N] )
+    {
+        EventTable table {};
+        
+        for ( const EventTableRow& row : rows )
+        {
+            table[ row.notify ] = { row.name, row.id, false, row.extract, row.primary_path };
+            
+            if ( row.auth != ES_EVENT_TYPE_LAST )
+                table[ row.auth ] = { row.name, row.id, true, row.extract, row.primary_path };
+        }
+        
+        return table;
+    }
+}
+
+const EndpointSecurity::EventDescriptor& EndpointSecurity::describeEvent( es_event_type_t type )
+{
+    // The path rules shared by the events with the same payload
+    constexpr auto fileTarget = []( const Event& e ) -> const EventString * { return &e.payload.file.target; };
+    constexpr auto extattrTarget = []( const Event& e ) -> const EventString * { return &e.payload.extattr.target; };
+    constexpr auto attrlistTarget = []( const Event& e ) -> const EventString * { return &e.payload.attrlist.target; };
+    
+    // The table is defined here, as the extractors call the protected handlers
+    static constexpr EventTable table = makeEventTable( {
+        { "access", EventId::Access, ES_EVENT_TYPE_NOTIFY_ACCESS, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_access( message->event.access.target, message->event.access.mode ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.access.target; } },
+        { "chdir", EventId::Chdir, ES_EVENT_TYPE_NOTIFY_CHDIR, ES_EVENT_TYPE_AUTH_CHDIR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_chdir( message->event.chdir.target ); },
+            fileTarget },
+        { "chroot", EventId::Chroot, ES_EVENT_TYPE_NOTIFY_CHROOT, ES_EVENT_TYPE_AUTH_CHROOT,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_chroot( message->event.chroot.target ); },
+            fileTarget },
+        { "clone", EventId::Clone, ES_EVENT_TYPE_NOTIFY_CLONE, ES_EVENT_TYPE_AUTH_CLONE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_clone( message->event.clone.source, message->event.clone.target_dir, message->event.clone.target_name ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.clone.target_name; } },
+        { "close", EventId::Close, ES_EVENT_TYPE_NOTIFY_CLOSE, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_close( message->event.close.target, message->event.close.modified ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.close.target; } },
+        { "create", EventId::Create, ES_EVENT_TYPE_NOTIFY_CREATE, ES_EVENT_TYPE_AUTH_CREATE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_create( &message->event.create ); },
+            []( const Event& e ) -> const EventString * { return e.payload.create.existing_file ? &e.payload.create.filename : &e.payload.create.target_name; } },
+        { "deleteextattr", EventId::Deleteextattr, ES_EVENT_TYPE_NOTIFY_DELETEEXTATTR, ES_EVENT_TYPE_AUTH_DELETEEXTATTR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_deleteextattr( message->event.deleteextattr.target, message->event.deleteextattr.extattr ); },
+            extattrTarget },
+        { "dup", EventId::Dup, ES_EVENT_TYPE_NOTIFY_DUP, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_dup( message->event.dup.target ); },
+            fileTarget },
+        { "exchangedata", EventId::Exchangedata, ES_EVENT_TYPE_NOTIFY_EXCHANGEDATA, ES_EVENT_TYPE_AUTH_EXCHANGEDATA,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_exchangedata( message->event.exchangedata.file1, message->event.exchangedata.file2 ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.exchangedata.file2; } },
+        { "exec", EventId::Exec, ES_EVENT_TYPE_NOTIFY_EXEC, ES_EVENT_TYPE_AUTH_EXEC,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_exec( &message->event.exec ); },
+            []( const Event& e ) -> const EventString * { return &e.process_team_id; } },
+        { "exit", EventId::Exit, ES_EVENT_TYPE_NOTIFY_EXIT, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_exit( audit_token_to_pid( message->process->audit_token ), message->event.exit.stat ); },
+            nullptr },
+        { "fcntl", EventId::Fcntl, ES_EVENT_TYPE_NOTIFY_FCNTL, ES_EVENT_TYPE_AUTH_FCNTL,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_fcntl( message->event.fcntl.target, message->event.fcntl.cmd ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.fcntl.target; } },
+        // https://developer.apple.com/documentation/endpointsecurity/es_event_type_t/es_event_type_notify_file_provider_materialize says:
+        // This identifier corresponds to the es_events_t union member file_provider_materialization - this is an error
+        // the actual name is file_provider_materialize
+        { "file_provider_materialize", EventId::FileProviderMaterialize, ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_MATERIALIZE, ES_EVENT_TYPE_AUTH_FILE_PROVIDER_MATERIALIZE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_file_provider_materialize( message->event.file_provider_materialize.instigator, message->event.file_provider_materialize.source, message->event.file_provider_materialize.target ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.file_provider_materialize.target; } },
+        { "file_provider_update", EventId::FileProviderUpdate, ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_UPDATE, ES_EVENT_TYPE_AUTH_FILE_PROVIDER_UPDATE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_file_provider_update( message->event.file_provider_update.source, message->event.file_provider_update.target_path ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.file_provider_update.target_path; } },
+        { "fork", EventId::Fork, ES_EVENT_TYPE_NOTIFY_FORK, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_fork( audit_token_to_pid( message->process->audit_token ), message->event.fork.child ); },
+            nullptr },
+        { "fsgetpath", EventId::Fsgetpath, ES_EVENT_TYPE_NOTIFY_FSGETPATH, ES_EVENT_TYPE_AUTH_FSGETPATH,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_fsgetpath( message->event.fsgetpath.target ); },
+            fileTarget },
+        { "getattrlist", EventId::Getattrlist, ES_EVENT_TYPE_NOTIFY_GETATTRLIST, ES_EVENT_TYPE_AUTH_GETATTRLIST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_getattrlist( message->event.getattrlist.target, message->event.getattrlist.attrlist ); },
+            attrlistTarget },
+        { "getextattr", EventId::Getextattr, ES_EVENT_TYPE_NOTIFY_GETEXTATTR, ES_EVENT_TYPE_AUTH_GETEXTATTR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_getextattr( message->event.getextattr.target, message->event.getextattr.extattr ); },
+            extattrTarget },
+        { "get_task", EventId::GetTask, ES_EVENT_TYPE_NOTIFY_GET_TASK, ES_EVENT_TYPE_AUTH_GET_TASK,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_get_task( message->event.get_task.target ); },
+            []( const Event& e ) -> const EventString * { return e.payload.get_task.target.pid != -1 ? &e.payload.get_task.target.executable : nullptr; } },
+        { "iokit_open", EventId::IokitOpen, ES_EVENT_TYPE_NOTIFY_IOKIT_OPEN, ES_EVENT_TYPE_AUTH_IOKIT_OPEN,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_iokit_open( message->event.iokit_open.user_client_class, message->event.iokit_open.user_client_type ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.iokit_open.user_client_class; } },
+        { "kextload", EventId::Kextload, ES_EVENT_TYPE_NOTIFY_KEXTLOAD, ES_EVENT_TYPE_AUTH_KEXTLOAD,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_kextload( message->event.kextload.identifier ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.kext.identifier; } },
+        { "kextunload", EventId::Kextunload, ES_EVENT_TYPE_NOTIFY_KEXTUNLOAD, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_kextunload( message->event.kextunload.identifier ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.kext.identifier; } },
+        { "link", EventId::Link, ES_EVENT_TYPE_NOTIFY_LINK, ES_EVENT_TYPE_AUTH_LINK,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_link( message->event.link.source, message->event.link.target_dir, message->event.link.target_filename ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.link.target_filename; } },
+        { "listextattr", EventId::Listextattr, ES_EVENT_TYPE_NOTIFY_LISTEXTATTR, ES_EVENT_TYPE_AUTH_LISTEXTATTR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_listextattr( message->event.listextattr.target ); },
+            fileTarget },
+        { "lookup", EventId::Lookup, ES_EVENT_TYPE_NOTIFY_LOOKUP, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_lookup( message->event.lookup.source_dir, message->event.lookup.relative_target ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.lookup.relative_target; } },
+        { "mmap", EventId::Mmap, ES_EVENT_TYPE_NOTIFY_MMAP, ES_EVENT_TYPE_AUTH_MMAP,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_mmap( message->event.mmap.source, message->event.mmap.file_pos, message->event.mmap.flags, message->event.mmap.max_protection, message->event.mmap.protection ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.mmap.source; } },
+        { "mount", EventId::Mount, ES_EVENT_TYPE_NOTIFY_MOUNT, ES_EVENT_TYPE_AUTH_MOUNT,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_mount( message->event.mount.statfs ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.mount.mntonname; } },
+        { "mprotect", EventId::Mprotect, ES_EVENT_TYPE_NOTIFY_MPROTECT, ES_EVENT_TYPE_AUTH_MPROTECT,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_mprotect( message->event.mprotect.address, message->event.mprotect.size, message->event.mprotect.protection ); },
+            nullptr },
+        { "open", EventId::Open, ES_EVENT_TYPE_NOTIFY_OPEN, ES_EVENT_TYPE_AUTH_OPEN,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_open( message->event.open.file, message->event.open.fflag ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.open.filename; } },
+        { "proc_check", EventId::ProcCheck, ES_EVENT_TYPE_NOTIFY_PROC_CHECK, ES_EVENT_TYPE_AUTH_PROC_CHECK,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_proc_check( message->event.proc_check.flavor, message->event.proc_check.target, message->event.proc_check.type ); },
+            nullptr },
+        { "pty_close", EventId::PtyClose, ES_EVENT_TYPE_NOTIFY_PTY_CLOSE, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_pty_close( message->event.pty_close.dev ); },
+            nullptr },
+        { "pty_grant", EventId::PtyGrant, ES_EVENT_TYPE_NOTIFY_PTY_GRANT, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_pty_grant( message->event.pty_grant.dev ); },
+            nullptr },
+        { "readdir", EventId::Readdir, ES_EVENT_TYPE_NOTIFY_READDIR, ES_EVENT_TYPE_AUTH_READDIR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_readdir( message->event.readdir.target ); },
+            fileTarget },
+        { "readlink", EventId::Readlink, ES_EVENT_TYPE_NOTIFY_READLINK, ES_EVENT_TYPE_AUTH_READLINK,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_readlink( message->event.readlink.source ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.readlink.source; } },
+        { "rename", EventId::Rename, ES_EVENT_TYPE_NOTIFY_RENAME, ES_EVENT_TYPE_AUTH_RENAME,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_rename( &message->event.rename ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.rename.filename; } },
+        { "setacl", EventId::Setacl, ES_EVENT_TYPE_NOTIFY_SETACL, ES_EVENT_TYPE_AUTH_SETACL,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setacl( message->event.setacl.target ); },
+            fileTarget },
+        { "setattrlist", EventId::Setattrlist, ES_EVENT_TYPE_NOTIFY_SETATTRLIST, ES_EVENT_TYPE_AUTH_SETATTRLIST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setattrlist( message->event.setattrlist.target, message->event.setattrlist.attrlist ); },
+            attrlistTarget },
+        { "setextattr", EventId::Setextattr, ES_EVENT_TYPE_NOTIFY_SETEXTATTR, ES_EVENT_TYPE_AUTH_SETEXTATTR,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setextattr( message->event.setextattr.target, message->event.setextattr.extattr ); },
+            extattrTarget },
+        { "setflags", EventId::Setflags, ES_EVENT_TYPE_NOTIFY_SETFLAGS, ES_EVENT_TYPE_AUTH_SETFLAGS,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setflags( message->event.setflags.target, message->event.setflags.flags ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.setflags.target; } },
+        { "setmode", EventId::Setmode, ES_EVENT_TYPE_NOTIFY_SETMODE, ES_EVENT_TYPE_AUTH_SETMODE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setmode( message->event.setmode.target, message->event.setmode.mode ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.setmode.target; } },
+        { "setowner", EventId::Setowner, ES_EVENT_TYPE_NOTIFY_SETOWNER, ES_EVENT_TYPE_AUTH_SETOWNER,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_setowner( message->event.setowner.target, message->event.setowner.uid, message->event.setowner.gid ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.setowner.target; } },
+        { "settime", EventId::Settime, ES_EVENT_TYPE_NOTIFY_SETTIME, ES_EVENT_TYPE_AUTH_SETTIME,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_settime( &message->event.settime ); },
+            nullptr },
+        { "signal", EventId::Signal, ES_EVENT_TYPE_NOTIFY_SIGNAL, ES_EVENT_TYPE_AUTH_SIGNAL,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_signal( message->event.signal.target, message->event.signal.sig ); },
+            nullptr },
+        { "stat", EventId::Stat, ES_EVENT_TYPE_NOTIFY_STAT, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_stat( message->event.stat.target ); },
+            fileTarget },
+        { "truncate", EventId::Truncate, ES_EVENT_TYPE_NOTIFY_TRUNCATE, ES_EVENT_TYPE_AUTH_TRUNCATE,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_truncate( message->event.truncate.target ); },
+            fileTarget },
+        { "uipc_bind", EventId::UipcBind, ES_EVENT_TYPE_NOTIFY_UIPC_BIND, ES_EVENT_TYPE_AUTH_UIPC_BIND,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_uipc_bind( message->event.uipc_bind.dir, message->event.uipc_bind.filename, message->event.uipc_bind.mode ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.uipc_bind.filename; } },
+        { "uipc_connect", EventId::UipcConnect, ES_EVENT_TYPE_NOTIFY_UIPC_CONNECT, ES_EVENT_TYPE_AUTH_UIPC_CONNECT,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_uipc_connect( message->event.uipc_connect.file, message->event.uipc_connect.domain, message->event.uipc_connect.type, message->event.uipc_connect.protocol ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.uipc_connect.file; } },
+        { "unlink", EventId::Unlink, ES_EVENT_TYPE_NOTIFY_UNLINK, ES_EVENT_TYPE_AUTH_UNLINK,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_unlink( message->event.unlink.target ); },
+            fileTarget },
+        { "unmount", EventId::Unmount, ES_EVENT_TYPE_NOTIFY_UNMOUNT, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_unmount( message->event.unmount.statfs ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.mount.mntonname; } },
+        { "utimes", EventId::Utimes, ES_EVENT_TYPE_NOTIFY_UTIMES, ES_EVENT_TYPE_AUTH_UTIMES,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_utimes( message->event.utimes.target, &message->event.utimes.mtime, &message->event.utimes.atime ); },
+            []( const Event& e ) -> const EventString * { return &e.payload.utimes.target; } },
+        { "write", EventId::Write, ES_EVENT_TYPE_NOTIFY_WRITE, ES_EVENT_TYPE_LAST,
+            []( EndpointSecurity& es, const es_message_t * message ) { es.on_write( message->event.write.target ); },
+            fileTarget },
+    } );
+    
+    return table[ (unsigned int) type < ES_EVENT_TYPE_LAST ? type : ES_EVENT_TYPE_LAST ];
+}
+
+const char * EndpointSecurity::eventName( EventId id )
+{
+    // Built once from the event table
+    static const std::array< const char *, (size_t) EventId::Count > names = []
+    {
+        std::array< const char *, (size_t) EventId::Count > names {};
+        
+        for ( unsigned int type = 0; type < ES_EVENT_TYPE_LAST; type++ )
+        {
+            const EventDescriptor& descriptor = describeEvent( (es_event_type_t) type );
+            
+            if ( descriptor.name )
+                names[ (size_t) descriptor.id ] = descriptor.name;
+        }
+        
+        return names;
+    }();
+    
+    return (size_t) id < names.size() ? names[ (size_t) id ] : nullptr;
+}
+
 void EndpointSecurity::on_event( const es_message_t * message )
 {
     // If this is our process, mute it immediately
@@ -281,391 +1259,191 @@ void EndpointSecurity::on_event( const es_message_t * message )
     // no way to obtain independently from a console-only app.
     if ( pid == getpid() )
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
     
+    // Take a free slot for the event. When the consumers hold all of them, the event is dropped and counted,
+    // unless it is one which must not be lost; then it waits for the consumers.
+    unsigned int slot;
+    unsigned int id = (unsigned int) describeEvent( message->event_type ).id;
+    
+    if ( !pimpl->pool->acquire( slot, message->action_type == ES_ACTION_TYPE_AUTH || pimpl->waitForSlot[ id ] ) )
+    {
+        pimpl->slotDrops[ id ].fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+    
+    pimpl->event = &pimpl->pool->slots[ slot ];
+    pimpl->eventSlot = slot;
+    pimpl->eventTaken = false;
+    
+    // Returns the slot on every way out of here, unless the report function took the event
+    struct SlotGuard
+    {
+        EndpointSecurityImpl * pimpl;
+        
+        ~SlotGuard()
+        {
+            if ( !pimpl->eventTaken )
+                pimpl->pool->release( pimpl->eventSlot );
+            
+            pimpl->event = nullptr;
+        }
+    } guard { pimpl };
+    
     // Fill up the event
-    pimpl->event.parameters.clear();
-    pimpl->event.filename = "";
-    pimpl->event.timestamp = EndpointSecurityImpl::timespecToString( message->time.tv_sec ) + "." + std::to_string( message->time.tv_nsec );
-    pimpl->event.time_s = message->time.tv_sec;
-    pimpl->event.time_ns = message->time.tv_nsec;
-    pimpl->event.is_authentication = (message->action_type == ES_ACTION_TYPE_AUTH);
+    pimpl->event->payload.type = Payload::None;
+    pimpl->event->filename.clear();
+    pimpl->event->time_s = message->time.tv_sec;
+    pimpl->event->time_ns = message->time.tv_nsec;
+    pimpl->event->is_authentication = (message->action_type == ES_ACTION_TYPE_AUTH);
+    pimpl->event->auth_slack_ns = pimpl->responseSlack;
+    pimpl->event->received_time = pimpl->receivedTime;
     
     // process info from BSM - there are some other params available which are missed here
-    pimpl->event.process_pid = pid;
-    pimpl->event.process_euid = audit_token_to_euid( message->process->audit_token );
-    pimpl->event.process_ruid = audit_token_to_ruid( message->process->audit_token );
-    pimpl->event.process_rgid = audit_token_to_rgid( message->process->audit_token );
-    pimpl->event.process_egid = audit_token_to_egid( message->process->audit_token );
-    pimpl->event.process_ppid = message->process->ppid;
-    pimpl->event.process_oppid = message->process->original_ppid;
-    pimpl->event.process_gid = message->process->group_id;
-    pimpl->event.process_sid = message->process->session_id;
-    pimpl->event.process_csflags = message->process->codesigning_flags;
-    pimpl->event.process_csflags_desc = EndpointSecurityImpl::getBitmask( value_map_codesign, message->process->codesigning_flags );
-    pimpl->event.process_is_platform_binary = message->process->is_platform_binary;
-    pimpl->event.process_is_es_client = message->process->is_es_client;
-    pimpl->event.process_thread_id = message->thread->thread_id;
-    pimpl->event.process_signing_id = EndpointSecurityImpl::getEsStringToken( message->process->signing_id );
-    pimpl->event.process_team_id = EndpointSecurityImpl::getEsStringToken( message->process->team_id );
-    pimpl->event.process_executable = EndpointSecurityImpl::getEsFile( message->process->executable );
-    pimpl->event.process_start_time = EndpointSecurityImpl::timespecToString( message->process->start_time.tv_sec );
+    pimpl->event->process_pid = pid;
+    pimpl->event->process_euid = audit_token_to_euid( message->process->audit_token );
+    pimpl->event->process_ruid = audit_token_to_ruid( message->process->audit_token );
+    pimpl->event->process_rgid = audit_token_to_rgid( message->process->audit_token );
+    pimpl->event->process_egid = audit_token_to_egid( message->process->audit_token );
+    pimpl->event->process_ppid = message->process->ppid;
+    pimpl->event->process_oppid = message->process->original_ppid;
+    pimpl->event->process_gid = message->process->group_id;
+    pimpl->event->process_sid = message->process->session_id;
+    pimpl->event->process_csflags = message->process->codesigning_flags;
+    pimpl->event->process_is_platform_binary = message->process->is_platform_binary;
+    pimpl->event->process_is_es_client = message->process->is_es_client;
+    pimpl->event->process_thread_id = message->thread->thread_id;
+    pimpl->event->process_start_time_s = message->process->start_time.tv_sec;
+    pimpl->event->process_cached = pimpl->lookupProcess( message->process );
+    pimpl->event->process_signing_id.point( pimpl->event->process_cached->signing_id.data(), pimpl->event->process_cached->signing_id.length() );
+    pimpl->event->process_team_id.point( pimpl->event->process_cached->team_id.data(), pimpl->event->process_cached->team_id.length() );
+    pimpl->event->process_executable.point( pimpl->event->process_cached->executable.data(), pimpl->event->process_cached->executable.length() );
     
     // Suppress lldb
-    if ( pimpl->event.process_executable == "/Applications/Xcode.app/Contents/Developer/usr/bin/lldb" )
+    if ( pimpl->event->process_executable == "/Applications/Xcode.app/Contents/Developer/usr/bin/lldb" )
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
-    if ( pimpl->event.process_executable == "/System/Library/Frameworks/CoreServices.framework/Versions/A/Frameworks/Metadata.framework/Versions/A/Support/mdbulkimport" )
+    if ( pimpl->event->process_executable == "/System/Library/Frameworks/CoreServices.framework/Versions/A/Frameworks/Metadata.framework/Versions/A/Support/mdbulkimport" )
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
-    if ( pimpl->event.process_executable == "/System/Library/Frameworks/CoreServices.framework/Versions/A/Frameworks/Metadata.framework/Versions/A/Support/mds" )
+    if ( pimpl->event->process_executable == "/System/Library/Frameworks/CoreServices.framework/Versions/A/Frameworks/Metadata.framework/Versions/A/Support/mds" )
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
     
-    if ( pimpl->event.process_executable == "/usr/sbin/bluetoothd")
+    if ( pimpl->event->process_executable == "/usr/sbin/bluetoothd")
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
     
-    if ( pimpl->event.process_executable == "/usr/libexec/airportd")
+    if ( pimpl->event->process_executable == "/usr/libexec/airportd")
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
     
-    if ( pimpl->event.process_executable == "/usr/libexec/lsd")
+    if ( pimpl->event->process_executable == "/usr/libexec/lsd")
     {
-        es_mute_process( pimpl->client, &message->process->audit_token );
+        pimpl->muteProcess( &message->process->audit_token );
         return; // FIXME auth
     }
     
    
     // And the event itself
-    switch ( message->event_type )
+    const EventDescriptor& descriptor = describeEvent( message->event_type );
+    
+    if ( !descriptor.extract )
+        throw EndpointSecurityException( 0, "on_event() received unhandled event" );
+    
+    pimpl->event->event = descriptor.name;
+    pimpl->event->event_id = descriptor.id;
+    descriptor.extract( *this, message );
+    
+    if ( descriptor.primary_path )
     {
-        case ES_EVENT_TYPE_NOTIFY_ACCESS:
-            on_access( message->event.access.target, message->event.access.mode);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_CHDIR:
-        case ES_EVENT_TYPE_NOTIFY_CHDIR:
-            on_chdir( message->event.chdir.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_CHROOT:
-        case ES_EVENT_TYPE_NOTIFY_CHROOT:
-            on_chroot( message->event.chroot.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_CLONE:
-        case ES_EVENT_TYPE_NOTIFY_CLONE:
-            on_clone( message->event.clone.source, message->event.clone.target_dir, message->event.clone.target_name);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_CLOSE:
-            on_close( message->event.close.target, message->event.close.modified);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_CREATE:
-        case ES_EVENT_TYPE_NOTIFY_CREATE:
-            on_create( &message->event.create );
-            break;
-
-        case ES_EVENT_TYPE_AUTH_DELETEEXTATTR:
-        case ES_EVENT_TYPE_NOTIFY_DELETEEXTATTR:
-            on_deleteextattr( message->event.deleteextattr.target, message->event.deleteextattr.extattr);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_DUP:
-            on_dup( message->event.dup.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_EXCHANGEDATA:
-        case ES_EVENT_TYPE_NOTIFY_EXCHANGEDATA:
-            on_exchangedata( message->event.exchangedata.file1, message->event.exchangedata.file2);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_EXEC:
-        case ES_EVENT_TYPE_NOTIFY_EXEC:
-            on_exec( &message->event.exec );
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_EXIT:
-            on_exit( pid, message->event.exit.stat);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_FCNTL:
-        case ES_EVENT_TYPE_NOTIFY_FCNTL:
-            on_fcntl( message->event.fcntl.target, message->event.fcntl.cmd);
-            break;
-
-        // https://developer.apple.com/documentation/endpointsecurity/es_event_type_t/es_event_type_notify_file_provider_materialize says:
-        // This identifier corresponds to the es_events_t union member file_provider_materialization - this is an error
-        // the actual name is file_provider_materialize
-        case ES_EVENT_TYPE_AUTH_FILE_PROVIDER_MATERIALIZE:
-        case ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_MATERIALIZE:
-            on_file_provider_materialize( message->event.file_provider_materialize.instigator, message->event.file_provider_materialize.source, message->event.file_provider_materialize.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_FILE_PROVIDER_UPDATE:
-        case ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_UPDATE:
-            on_file_provider_update( message->event.file_provider_update.source, message->event.file_provider_update.target_path);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_FORK:
-            on_fork( pid, message->event.fork.child);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_FSGETPATH:
-        case ES_EVENT_TYPE_NOTIFY_FSGETPATH:
-            on_fsgetpath( message->event.fsgetpath.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_GETATTRLIST:
-        case ES_EVENT_TYPE_NOTIFY_GETATTRLIST:
-            on_getattrlist( message->event.getattrlist.target, message->event.getattrlist.attrlist);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_GETEXTATTR:
-        case ES_EVENT_TYPE_NOTIFY_GETEXTATTR:
-            on_getextattr( message->event.getextattr.target, message->event.getextattr.extattr);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_GET_TASK:
-        case ES_EVENT_TYPE_NOTIFY_GET_TASK:
-            on_get_task( message->event.get_task.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_IOKIT_OPEN:
-        case ES_EVENT_TYPE_NOTIFY_IOKIT_OPEN:
-            on_iokit_open( message->event.iokit_open.user_client_class, message->event.iokit_open.user_client_type);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_KEXTLOAD:
-        case ES_EVENT_TYPE_NOTIFY_KEXTLOAD:
-            on_kextload( message->event.kextload.identifier);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_KEXTUNLOAD:
-            on_kextunload( message->event.kextunload.identifier);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_LINK:
-        case ES_EVENT_TYPE_NOTIFY_LINK:
-            on_link( message->event.link.source, message->event.link.target_dir, message->event.link.target_filename);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_LISTEXTATTR:
-        case ES_EVENT_TYPE_NOTIFY_LISTEXTATTR:
-            on_listextattr( message->event.listextattr.target);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_LOOKUP:
-            on_lookup( message->event.lookup.source_dir, message->event.lookup.relative_target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_MMAP:
-        case ES_EVENT_TYPE_NOTIFY_MMAP:
-            on_mmap( message->event.mmap.source, message->event.mmap.file_pos, message->event.mmap.flags, message->event.mmap.max_protection, message->event.mmap.protection);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_MOUNT:
-        case ES_EVENT_TYPE_NOTIFY_MOUNT:
-            on_mount( message->event.mount.statfs);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_MPROTECT:
-        case ES_EVENT_TYPE_NOTIFY_MPROTECT:
-            on_mprotect( message->event.mprotect.address, message->event.mprotect.size, message->event.mprotect.protection);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_OPEN:
-        case ES_EVENT_TYPE_NOTIFY_OPEN:
-            on_open( message->event.open.file, message->event.open.fflag);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_PROC_CHECK:
-        case ES_EVENT_TYPE_NOTIFY_PROC_CHECK:
-            on_proc_check( message->event.proc_check.flavor, message->event.proc_check.target, message->event.proc_check.type);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_PTY_CLOSE:
-            on_pty_close( message->event.pty_close.dev);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_PTY_GRANT:
-            on_pty_grant( message->event.pty_grant.dev);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_READDIR:
-        case ES_EVENT_TYPE_NOTIFY_READDIR:
-            on_readdir( message->event.readdir.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_READLINK:
-        case ES_EVENT_TYPE_NOTIFY_READLINK:
-            on_readlink( message->event.readlink.source);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_RENAME:
-        case ES_EVENT_TYPE_NOTIFY_RENAME:
-            on_rename( &message->event.rename );
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETACL:
-        case ES_EVENT_TYPE_NOTIFY_SETACL:
-            on_setacl( message->event.setacl.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETATTRLIST:
-        case ES_EVENT_TYPE_NOTIFY_SETATTRLIST:
-            on_setattrlist( message->event.setattrlist.target, message->event.setattrlist.attrlist);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETEXTATTR:
-        case ES_EVENT_TYPE_NOTIFY_SETEXTATTR:
-            on_setextattr( message->event.setextattr.target, message->event.setextattr.extattr);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETFLAGS:
-        case ES_EVENT_TYPE_NOTIFY_SETFLAGS:
-            on_setflags( message->event.setflags.target, message->event.setflags.flags);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETMODE:
-        case ES_EVENT_TYPE_NOTIFY_SETMODE:
-            on_setmode( message->event.setmode.target, message->event.setmode.mode);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETOWNER:
-        case ES_EVENT_TYPE_NOTIFY_SETOWNER:
-            on_setowner( message->event.setowner.target, message->event.setowner.uid, message->event.setowner.gid);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SETTIME:
-        case ES_EVENT_TYPE_NOTIFY_SETTIME:
-            on_settime( &message->event.settime );
-            break;
-
-        case ES_EVENT_TYPE_AUTH_SIGNAL:
-        case ES_EVENT_TYPE_NOTIFY_SIGNAL:
-            on_signal( message->event.signal.target, message->event.signal.sig);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_STAT:
-            on_stat( message->event.stat.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_TRUNCATE:
-        case ES_EVENT_TYPE_NOTIFY_TRUNCATE:
-            on_truncate( message->event.truncate.target);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_UIPC_BIND:
-        case ES_EVENT_TYPE_NOTIFY_UIPC_BIND:
-            on_uipc_bind( message->event.uipc_bind.dir, message->event.uipc_bind.filename, message->event.uipc_bind.mode);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_UIPC_CONNECT:
-        case ES_EVENT_TYPE_NOTIFY_UIPC_CONNECT:
-            on_uipc_connect( message->event.uipc_connect.file, message->event.uipc_connect.domain, message->event.uipc_connect.type, message->event.uipc_connect.protocol);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_UNLINK:
-        case ES_EVENT_TYPE_NOTIFY_UNLINK:
-            on_unlink( message->event.unlink.target);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_UNMOUNT:
-            on_unmount( message->event.unmount.statfs);
-            break;
-
-        case ES_EVENT_TYPE_AUTH_UTIMES:
-        case ES_EVENT_TYPE_NOTIFY_UTIMES:
-            on_utimes( message->event.utimes.target, &message->event.utimes.mtime, &message->event.utimes.atime);
-            break;
-
-        case ES_EVENT_TYPE_NOTIFY_WRITE:
-            on_write( message->event.write.target);
-            break;
-
-        default:
-            throw EndpointSecurityException( 0, "on_event() received unhandled event" );
-    };
+        const EventString * path = descriptor.primary_path( *pimpl->event );
+        
+        if ( path )
+            pimpl->event->filename = *path;
+    }
     
     // We have to execute the above code to fill up monitoredProcesses if needed, but now we can check those and suppress the unnecessary events
     // We cannot mute those processes because one of them would send exec() event when our process is started, and we won't see it. It is not possible
     // to mute all events except exec.
     if ( pimpl->monitoredProcessPath.empty() || pimpl->monitoredProcesses.find( pid ) != pimpl->monitoredProcesses.end() )
-        pimpl->reportfunc( pimpl->event );
+        pimpl->queueEvent();
+    
+    // The process is gone, or will have a new pidversion after exec. The event keeps its entry until the next one.
+    if ( message->event_type == ES_EVENT_TYPE_NOTIFY_EXIT || message->event_type == ES_EVENT_TYPE_NOTIFY_EXEC )
+        pimpl->processCache.erase( EndpointSecurityImpl::processKey( message->process->audit_token ) );
 }
 
 void EndpointSecurity::on_access ( es_file_t * target, int32_t mode )
 {
-    pimpl->event.event = "access";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["mode"] = std::to_string( mode );
-    pimpl->event.parameters["mode_desc"] = mode == 0 ? "F_OK (0)" : EndpointSecurityImpl::getBitmask( value_map_access, mode );
+    pimpl->event->payload.type = Payload::Access;
+    pimpl->setEsFile( pimpl->event->payload.access.target, target );
+    pimpl->event->payload.access.mode = mode;
 }
 
 
 void EndpointSecurity::on_chdir ( es_file_t * target )
 {
-    pimpl->event.event = "chdir";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_chroot ( es_file_t * target )
 {
-    pimpl->event.event = "chroot";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_clone ( es_file_t * source, es_file_t * target_dir, es_string_token_t target_name )
 {
-    pimpl->event.event = "clone";
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
-    pimpl->event.parameters["target_dir"] = EndpointSecurityImpl::getEsFile(target_dir);
-    pimpl->event.parameters["target_name"] = EndpointSecurityImpl::getEsStringToken(target_name);
-    pimpl->event.filename = pimpl->event.parameters["target_name"];
+    pimpl->event->payload.type = Payload::Clone;
+    pimpl->setEsFile( pimpl->event->payload.clone.source, source );
+    pimpl->setEsFile( pimpl->event->payload.clone.target_dir, target_dir );
+    pimpl->setEsStringToken( pimpl->event->payload.clone.target_name, target_name );
 }
 
 
 void EndpointSecurity::on_close ( es_file_t * target, bool modified )
 {
-    pimpl->event.event = "close";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.filename = pimpl->event.parameters["target"];
-    pimpl->event.parameters["modified"] = modified ? "true" : "false";
+    pimpl->event->payload.type = Payload::Close;
+    pimpl->setEsFile( pimpl->event->payload.close.target, target );
+    pimpl->event->payload.close.modified = modified;
 }
 
 
 void EndpointSecurity::on_create ( const es_event_create_t * event )
 {
-    pimpl->event.event = "create";
+    pimpl->event->payload.type = Payload::Create;
     
     if ( event->destination_type == ES_DESTINATION_TYPE_EXISTING_FILE )
     {
         // see man creat: the creat() function is the same as open(path, O_CREAT | O_TRUNC | O_WRONLY, mode);
-        on_open( event->destination.existing_file, 0x00000200 | 0x00000002 | 0x00000400 );
+        pimpl->event->payload.create.existing_file = true;
+        pimpl->setEsFile( pimpl->event->payload.create.filename, event->destination.existing_file );
+        pimpl->event->payload.create.target_dir.clear();
+        pimpl->event->payload.create.target_name.clear();
     }
     else if ( event->destination_type == ES_DESTINATION_TYPE_NEW_PATH )
     {
-        pimpl->event.parameters["target_dir"] = EndpointSecurityImpl::getEsFile( event->destination.new_path.dir );
-        pimpl->event.parameters["target_name"] = EndpointSecurityImpl::getEsStringToken( event->destination.new_path.filename );
-        pimpl->event.filename = pimpl->event.parameters["target_name"];
-        pimpl->event.parameters["mode"] = std::to_string( event->destination.new_path.mode );
+        pimpl->event->payload.create.existing_file = false;
+        pimpl->setEsFile( pimpl->event->payload.create.target_dir, event->destination.new_path.dir );
+        pimpl->setEsStringToken( pimpl->event->payload.create.target_name, event->destination.new_path.filename );
+        pimpl->event->payload.create.mode = event->destination.new_path.mode;
+        pimpl->event->payload.create.filename.clear();
     }
     else
         throw EndpointSecurityException( 0, "on_create() unknown destination" );
@@ -674,65 +1452,73 @@ void EndpointSecurity::on_create ( const es_event_create_t * event )
 
 void EndpointSecurity::on_deleteextattr ( es_file_t * target, es_string_token_t extattr )
 {
-    pimpl->event.event = "deleteextattr";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["extattr"] = EndpointSecurityImpl::getEsStringToken(extattr);
+    pimpl->event->payload.type = Payload::Extattr;
+    pimpl->setEsFile( pimpl->event->payload.extattr.target, target );
+    pimpl->setEsStringToken( pimpl->event->payload.extattr.extattr, extattr );
 }
 
 
 void EndpointSecurity::on_dup ( es_file_t * target )
 {
-    pimpl->event.event = "dup";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.filename = pimpl->event.parameters["target"];
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_exchangedata ( es_file_t * file1, es_file_t * file2 )
 {
-    pimpl->event.event = "exchangedata";
-    pimpl->event.parameters["file1"] = EndpointSecurityImpl::getEsFile(file1);
-    pimpl->event.parameters["file2"] = EndpointSecurityImpl::getEsFile(file2);
-    pimpl->event.filename = pimpl->event.parameters["file2"];
+    pimpl->event->payload.type = Payload::Exchangedata;
+    pimpl->setEsFile( pimpl->event->payload.exchangedata.file1, file1 );
+    pimpl->setEsFile( pimpl->event->payload.exchangedata.file2, file2 );
 }
 
 
 void EndpointSecurity::on_exec ( const es_event_exec_t * event )
 {
-    pimpl->event.event = "exec";
+    ExecPayload& exec = pimpl->event->payload.exec;
     
-    // Get the process info
-    pimpl->getEsProcess( event->target, "target_" );
-    pimpl->event.parameters["target_args"] = "";
+    pimpl->event->payload.type = Payload::Exec;
     
-    pimpl->event.filename = pimpl->event.process_team_id;
+    // Get the process info
+    pimpl->getEsProcess( event->target, exec.target );
     
     // Get the process args
     // You can also get the process environment, but this is rarely useful.
     // See https://developer.apple.com/documentation/endpointsecurity/3259703-es_exec_env and https://developer.apple.com/documentation/endpointsecurity/3259704-es_exec_env_count
     uint32_t argscount = es_exec_arg_count(event);
+    pimpl->execArgs.resize( argscount );
     
     for ( uint32_t i = 0; i < argscount; i++ )
     {
-        std::string arg = EndpointSecurityImpl::getEsStringToken( es_exec_arg( event, i ) );
-        
-        // Escape quotes in the args
-        arg = std::regex_replace(arg, std::regex("\""), "\\\"" );
-
-        if ( i > 0 )
-            pimpl->event.parameters["target_args"].append( " " );
+        es_string_token_t arg = es_exec_arg( event, i );
+        pimpl->execArgs[i] = std::string_view( arg.length > 0 ? arg.data : "", arg.length );
+    }
+    
+    encodeArgs( exec.args, pimpl->execArgs.data(), argscount );
+    
+    if ( pimpl->execArgv )
+    {
+        exec.argv.resize( argscount );
         
-        pimpl->event.parameters["target_args"] += "\"" + arg + "\"";
+        for ( uint32_t i = 0; i < argscount; i++ )
+        {
+            if ( pimpl->viewMode )
+                exec.argv[i].point( pimpl->execArgs[i].data(), pimpl->execArgs[i].length() );
+            else
+                exec.argv[i].assign( pimpl->execArgs[i].data(), pimpl->execArgs[i].length() );
+        }
     }
+    else
+        exec.argv.clear();
     
     // If this is the monitored process, remember it so we receive its events
     if ( !pimpl->monitoredProcessPath.empty() )
     {
-        if ( pimpl->event.parameters["target_executable"].length() >= pimpl->monitoredProcessPath.length()
-            && pimpl->event.parameters["target_executable"].substr( 0, pimpl->monitoredProcessPath.length() ) == pimpl->monitoredProcessPath )
+        if ( exec.target.executable.length() >= pimpl->monitoredProcessPath.length()
+            && exec.target.executable.view().compare( 0, pimpl->monitoredProcessPath.length(), pimpl->monitoredProcessPath ) == 0 )
         {
             // this is our process
-            pimpl->monitoredProcesses[ std::stoi( pimpl->event.parameters["target_pid"] ) ] = 1;
+            pimpl->monitoredProcesses[ exec.target.pid ] = 1;
         }
     }
 }
@@ -740,15 +1526,11 @@ void EndpointSecurity::on_exec ( const es_event_exec_t * event )
 
 void EndpointSecurity::on_exit ( pid_t pid, int stat )
 {
-    pimpl->event.event = "exit";
-    pimpl->event.parameters["stat"] = std::to_string(stat);
+    pimpl->event->payload.type = Payload::Exit;
+    pimpl->event->payload.exit.stat = stat;
     
-    // Parse the stat according to man 2 wait
-    if ( WIFEXITED(stat) )
-        pimpl->event.parameters["stat_desc"] = "normal exit with code " + std::to_string( WEXITSTATUS(stat) );
-    else if (WIFSIGNALED(stat))
-        pimpl->event.parameters["stat_desc"] = "killed by signal " + std::to_string( WTERMSIG(stat) ) + (WCOREDUMP(stat) ? " (coredump created)" : "" );
-    else
+    // Validate the stat according to man 2 wait
+    if ( !WIFEXITED(stat) && !WIFSIGNALED(stat) )
         throw EndpointSecurityException( 0, "Invalid exit" );
     
     // If this is our process, remove it from monitored pids (pid could be reused later)
@@ -761,231 +1543,208 @@ void EndpointSecurity::on_exit ( pid_t pid, int stat )
 
 void EndpointSecurity::on_fcntl ( es_file_t * target, int32_t cmd )
 {
-    pimpl->event.event = "fcntl";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["cmd"] = std::to_string(cmd);
-    pimpl->event.parameters["cmd_desc"] = EndpointSecurityImpl::getValue( value_map_fcntl, cmd );
+    pimpl->event->payload.type = Payload::Fcntl;
+    pimpl->setEsFile( pimpl->event->payload.fcntl.target, target );
+    pimpl->event->payload.fcntl.cmd = cmd;
 }
 
 
 void EndpointSecurity::on_file_provider_materialize ( es_process_t *instigator, es_file_t *source, es_file_t *target )
 {
-    pimpl->event.event = "file_provider_materialize";
-    pimpl->getEsProcess( instigator, "instigator_" );
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::FileProviderMaterialize;
+    pimpl->getEsProcess( instigator, pimpl->event->payload.file_provider_materialize.instigator );
+    pimpl->setEsFile( pimpl->event->payload.file_provider_materialize.source, source );
+    pimpl->setEsFile( pimpl->event->payload.file_provider_materialize.target, target );
 }
 
 
 void EndpointSecurity::on_file_provider_update ( es_file_t *source, es_string_token_t target_path )
 {
-    pimpl->event.event = "file_provider_update";
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
-    pimpl->event.parameters["target_path"] = EndpointSecurityImpl::getEsStringToken(target_path);
+    pimpl->event->payload.type = Payload::FileProviderUpdate;
+    pimpl->setEsFile( pimpl->event->payload.file_provider_update.source, source );
+    pimpl->setEsStringToken( pimpl->event->payload.file_provider_update.target_path, target_path );
 }
 
 
 void EndpointSecurity::on_fork ( pid_t pid, es_process_t *child )
 {
-    pimpl->event.event = "fork";
-    pimpl->getEsProcess( child, "child_" );
+    pimpl->event->payload.type = Payload::Fork;
+    pimpl->getEsProcess( child, pimpl->event->payload.fork.child );
     
     // If this is our process forking, add its child to monitoring pid too
     auto it = pimpl->monitoredProcesses.find( pid );
     
     if ( it != pimpl->monitoredProcesses.end() )
-        pimpl->monitoredProcesses[ std::stoi( pimpl->event.parameters["child_pid"] ) ] = 1;
+        pimpl->monitoredProcesses[ pimpl->event->payload.fork.child.pid ] = 1;
 }
 
 
 void EndpointSecurity::on_fsgetpath ( es_file_t *target )
 {
-    pimpl->event.event = "fsgetpath";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_getattrlist ( es_file_t *target, struct attrlist attrlist )
 {
-    pimpl->event.event = "getattrlist";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-
-    if ( attrlist.commonattr )
-        pimpl->event.parameters["commonattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_common, attrlist.commonattr );
-    
-    if ( attrlist.volattr )
-        pimpl->event.parameters["volattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_volume, attrlist.volattr );
-    
-    if ( attrlist.dirattr )
-        pimpl->event.parameters["dirattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_dir, attrlist.dirattr );
-    
-    if ( attrlist.fileattr )
-        pimpl->event.parameters["fileattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_file, attrlist.fileattr );
-    
-    if ( attrlist.forkattr )
-        pimpl->event.parameters["forkattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_fork, attrlist.forkattr );
+    pimpl->event->payload.type = Payload::Attrlist;
+    pimpl->setEsFile( pimpl->event->payload.attrlist.target, target );
+    pimpl->event->payload.attrlist.attrlist = attrlist;
 }
 
 
 void EndpointSecurity::on_getextattr ( es_file_t *target, es_string_token_t extattr )
 {
-    pimpl->event.event = "getextattr";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["extattr"] = EndpointSecurityImpl::getEsStringToken(extattr);
+    pimpl->event->payload.type = Payload::Extattr;
+    pimpl->setEsFile( pimpl->event->payload.extattr.target, target );
+    pimpl->setEsStringToken( pimpl->event->payload.extattr.extattr, extattr );
 }
 
 
 void EndpointSecurity::on_get_task ( es_process_t *target )
 {
-    pimpl->event.event = "get_task";
-    pimpl->getEsProcess( target, "target_" );
-    pimpl->event.filename = pimpl->event.parameters["target_executable"];
+    pimpl->event->payload.type = Payload::GetTask;
+    pimpl->getEsProcess( target, pimpl->event->payload.get_task.target );
+
 }
 
 
 void EndpointSecurity::on_iokit_open ( es_string_token_t user_client_class, uint32_t user_client_type )
 {
-    pimpl->event.event = "iokit_open";
-    pimpl->event.parameters["user_client_class"] = EndpointSecurityImpl::getEsStringToken(user_client_class);
-    pimpl->event.parameters["user_client_type"] = std::to_string(user_client_type);
-    pimpl->event.filename = pimpl->event.parameters["user_client_class"];
+    pimpl->event->payload.type = Payload::IokitOpen;
+    pimpl->setEsStringToken( pimpl->event->payload.iokit_open.user_client_class, user_client_class );
+    pimpl->event->payload.iokit_open.user_client_type = user_client_type;
 }
 
 
 void EndpointSecurity::on_kextload ( es_string_token_t identifier )
 {
-    pimpl->event.event = "kextload";
-    pimpl->event.parameters["identifier"] = EndpointSecurityImpl::getEsStringToken(identifier);
-    pimpl->event.filename = pimpl->event.parameters["identifier"];
+    pimpl->event->payload.type = Payload::Kext;
+    pimpl->setEsStringToken( pimpl->event->payload.kext.identifier, identifier );
 }
 
 
 void EndpointSecurity::on_kextunload ( es_string_token_t identifier )
 {
-    pimpl->event.event = "kextunload";
-    pimpl->event.parameters["identifier"] = EndpointSecurityImpl::getEsStringToken(identifier);
-    pimpl->event.filename = pimpl->event.parameters["identifier"];
+    pimpl->event->payload.type = Payload::Kext;
+    pimpl->setEsStringToken( pimpl->event->payload.kext.identifier, identifier );
 }
 
 
 void EndpointSecurity::on_link ( es_file_t *source, es_file_t *target_dir, es_string_token_t target_filename )
 {
-    pimpl->event.event = "link";
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
-    pimpl->event.parameters["target_dir"] = EndpointSecurityImpl::getEsFile(target_dir);
-    pimpl->event.parameters["target_filename"] = EndpointSecurityImpl::getEsStringToken(target_filename);
-    pimpl->event.filename = pimpl->event.parameters["identifier"];
+    pimpl->event->payload.type = Payload::Link;
+    pimpl->setEsFile( pimpl->event->payload.link.source, source );
+    pimpl->setEsFile( pimpl->event->payload.link.target_dir, target_dir );
+    pimpl->setEsStringToken( pimpl->event->payload.link.target_filename, target_filename );
 }
 
 
 void EndpointSecurity::on_listextattr ( es_file_t *target )
 {
-    pimpl->event.event = "listextattr";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_lookup ( es_file_t *source_dir, es_string_token_t relative_target )
 {
-    pimpl->event.event = "lookup";
-    pimpl->event.parameters["source_dir"] = EndpointSecurityImpl::getEsFile(source_dir);
-    pimpl->event.parameters["relative_target"] = EndpointSecurityImpl::getEsStringToken(relative_target);
+    pimpl->event->payload.type = Payload::Lookup;
+    pimpl->setEsFile( pimpl->event->payload.lookup.source_dir, source_dir );
+    pimpl->setEsStringToken( pimpl->event->payload.lookup.relative_target, relative_target );
 }
 
 
 void EndpointSecurity::on_mmap ( es_file_t *source, uint64_t file_pos, int32_t flags, int32_t max_protection, int32_t protection )
 {
-    pimpl->event.event = "mmap";
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
-    pimpl->event.parameters["file_pos"] = std::to_string(file_pos);
-    pimpl->event.parameters["flags"] = EndpointSecurityImpl::getBitmask( value_map_mmap_flags, flags );
-    pimpl->event.parameters["max_protection"] = max_protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot,  max_protection);
-    pimpl->event.parameters["protection"] = protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot,  protection);
+    pimpl->event->payload.type = Payload::Mmap;
+    pimpl->setEsFile( pimpl->event->payload.mmap.source, source );
+    pimpl->event->payload.mmap.file_pos = file_pos;
+    pimpl->event->payload.mmap.flags = flags;
+    pimpl->event->payload.mmap.max_protection = max_protection;
+    pimpl->event->payload.mmap.protection = protection;
 }
 
 
 void EndpointSecurity::on_mount ( struct statfs * statfs )
 {
-    pimpl->event.event = "mount";
-    pimpl->getStatFs( statfs );
-    pimpl->event.filename = statfs->f_mntonname;
+    pimpl->event->payload.type = Payload::Mount;
+    pimpl->setCString( pimpl->event->payload.mount.mntfromname, statfs->f_mntfromname );
+    pimpl->setCString( pimpl->event->payload.mount.mntonname, statfs->f_mntonname );
     
 }
 
 
 void EndpointSecurity::on_mprotect ( user_addr_t address, user_size_t size, int32_t protection )
 {
-    pimpl->event.event = "mprotect";
-    pimpl->event.parameters["address"] = std::to_string(address);
-    pimpl->event.parameters["size"] = std::to_string(size);
-    pimpl->event.parameters["protection"] = protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot,  protection);
+    pimpl->event->payload.type = Payload::Mprotect;
+    pimpl->event->payload.mprotect.address = address;
+    pimpl->event->payload.mprotect.size = size;
+    pimpl->event->payload.mprotect.protection = protection;
 }
 
 
 void EndpointSecurity::on_open ( es_file_t * file, int32_t fflag )
 {
-    pimpl->event.event = "open";
-    pimpl->event.parameters["filename"] = EndpointSecurityImpl::getEsFile(file);
-    pimpl->event.parameters["fflag"] = EndpointSecurityImpl::getBitmask( value_map_open, fflag );
-    pimpl->event.filename = pimpl->event.parameters["filename"];
+    pimpl->event->payload.type = Payload::Open;
+    pimpl->setEsFile( pimpl->event->payload.open.filename, file );
+    pimpl->event->payload.open.fflag = fflag;
 }
 
 
 void EndpointSecurity::on_proc_check ( int flavor, es_process_t * target, int type )
 {
-    pimpl->event.event = "proc_check";
-    pimpl->event.parameters["flavor"] = std::to_string(flavor);
-    
-    if ( target )
-        pimpl->getEsProcess( target, "target_" );
-    
-    pimpl->event.parameters["type"] = EndpointSecurityImpl::getValue( value_map_proc_check_type, type );
+    pimpl->event->payload.type = Payload::ProcCheck;
+    pimpl->event->payload.proc_check.flavor = flavor;
+    pimpl->getEsProcess( target, pimpl->event->payload.proc_check.target );
+    pimpl->event->payload.proc_check.type = type;
 }
 
 
 void EndpointSecurity::on_pty_close ( dev_t dev )
 {
-    pimpl->event.event = "pty_close";
-    pimpl->event.parameters["dev"] = std::to_string(dev);
+    pimpl->event->payload.type = Payload::Pty;
+    pimpl->event->payload.pty.dev = dev;
 }
 
 
 void EndpointSecurity::on_pty_grant ( dev_t dev )
 {
-    pimpl->event.event = "pty_grant";
-    pimpl->event.parameters["dev"] = std::to_string(dev);
+    pimpl->event->payload.type = Payload::Pty;
+    pimpl->event->payload.pty.dev = dev;
 }
 
 
 void EndpointSecurity::on_readdir ( es_file_t *target )
 {
-    pimpl->event.event = "readdir";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_readlink ( es_file_t *source )
 {
-    pimpl->event.event = "readlink";
-    pimpl->event.parameters["source"] = EndpointSecurityImpl::getEsFile(source);
+    pimpl->event->payload.type = Payload::Readlink;
+    pimpl->setEsFile( pimpl->event->payload.readlink.source, source );
 }
 
 
 void EndpointSecurity::on_rename ( const es_event_rename_t * event )
 {
-    pimpl->event.event = "rename";
+    pimpl->event->payload.type = Payload::Rename;
 
     if ( event->destination_type == ES_DESTINATION_TYPE_EXISTING_FILE )
     {
-        pimpl->event.parameters["existing_file"] = EndpointSecurityImpl::getEsFile( event->destination.existing_file );
-        pimpl->event.filename = pimpl->event.parameters["existing_file"];
-        
+        pimpl->event->payload.rename.existing_file = true;
+        pimpl->setEsFile( pimpl->event->payload.rename.filename, event->destination.existing_file );
+        pimpl->event->payload.rename.dir.clear();
     }
     else if ( event->destination_type == ES_DESTINATION_TYPE_NEW_PATH )
     {
-        pimpl->event.parameters["dir"] = EndpointSecurityImpl::getEsFile( event->destination.new_path.dir );
-        pimpl->event.parameters["filename"] = EndpointSecurityImpl::getEsStringToken( event->destination.new_path.filename );
-        pimpl->event.filename = pimpl->event.parameters["filename"];
+        pimpl->event->payload.rename.existing_file = false;
+        pimpl->setEsFile( pimpl->event->payload.rename.dir, event->destination.new_path.dir );
+        pimpl->setEsStringToken( pimpl->event->payload.rename.filename, event->destination.new_path.filename );
     }
     else
         throw EndpointSecurityException( 0, "on_rename() unknown destination" );
@@ -994,141 +1753,623 @@ void EndpointSecurity::on_rename ( const es_event_rename_t * event )
 
 void EndpointSecurity::on_setacl ( es_file_t *target )
 {
-    pimpl->event.event = "setacl";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_setattrlist ( es_file_t *target, struct attrlist attrlist )
 {
-    pimpl->event.event = "setattrlist";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-
-    if ( attrlist.commonattr )
-        pimpl->event.parameters["commonattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_common, attrlist.commonattr );
-    
-    if ( attrlist.volattr )
-        pimpl->event.parameters["volattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_volume, attrlist.volattr );
-    
-    if ( attrlist.dirattr )
-        pimpl->event.parameters["dirattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_dir, attrlist.dirattr );
-    
-    if ( attrlist.fileattr )
-        pimpl->event.parameters["fileattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_file, attrlist.fileattr );
-    
-    if ( attrlist.forkattr )
-        pimpl->event.parameters["forkattr"] = EndpointSecurityImpl::getBitmask( value_map_attr_fork, attrlist.forkattr );
+    pimpl->event->payload.type = Payload::Attrlist;
+    pimpl->setEsFile( pimpl->event->payload.attrlist.target, target );
+    pimpl->event->payload.attrlist.attrlist = attrlist;
 }
 
 
 void EndpointSecurity::on_setextattr ( es_file_t *target, es_string_token_t extattr )
 {
-    pimpl->event.event = "setextattr";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["extattr"] = EndpointSecurityImpl::getEsStringToken(extattr);
+    pimpl->event->payload.type = Payload::Extattr;
+    pimpl->setEsFile( pimpl->event->payload.extattr.target, target );
+    pimpl->setEsStringToken( pimpl->event->payload.extattr.extattr, extattr );
 }
 
 
 void EndpointSecurity::on_setflags ( es_file_t *target, uint32_t flags )
 {
-    pimpl->event.event = "setflags";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["flags"] = std::to_string(flags);
+    pimpl->event->payload.type = Payload::Setflags;
+    pimpl->setEsFile( pimpl->event->payload.setflags.target, target );
+    pimpl->event->payload.setflags.flags = flags;
 }
 
 
 void EndpointSecurity::on_setmode ( es_file_t *target, int32_t mode )
 {
-    pimpl->event.event = "setmode";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["mode"] = std::to_string(mode);
+    pimpl->event->payload.type = Payload::Setmode;
+    pimpl->setEsFile( pimpl->event->payload.setmode.target, target );
+    pimpl->event->payload.setmode.mode = mode;
 }
 
 
 void EndpointSecurity::on_setowner ( es_file_t *target, int32_t uid, int32_t gid )
 {
-    pimpl->event.event = "setowner";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["uid"] = std::to_string(uid);
-    pimpl->event.parameters["gid"] = std::to_string(gid);
+    pimpl->event->payload.type = Payload::Setowner;
+    pimpl->setEsFile( pimpl->event->payload.setowner.target, target );
+    pimpl->event->payload.setowner.uid = uid;
+    pimpl->event->payload.setowner.gid = gid;
 }
 
 
 void EndpointSecurity::on_settime ( const es_event_settime_t * event )
 {
-    pimpl->event.event = "settime";
 }
 
 
 void EndpointSecurity::on_signal ( es_process_t *target, uint32_t sig )
 {
-    pimpl->event.event = "signal";
-    pimpl->getEsProcess( target, "target_" );
-    pimpl->event.parameters["sig"] = std::to_string(sig);
+    pimpl->event->payload.type = Payload::Signal;
+    pimpl->getEsProcess( target, pimpl->event->payload.signal.target );
+    pimpl->event->payload.signal.sig = sig;
 }
 
 
 void EndpointSecurity::on_stat ( es_file_t *target )
 {
-    pimpl->event.event = "stat";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_truncate ( es_file_t *target )
 {
-    pimpl->event.event = "truncate";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.filename = pimpl->event.parameters["target"];
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_uipc_bind ( es_file_t *dir, es_string_token_t filename, uint32_t mode )
 {
-    pimpl->event.event = "uipc_bind";
-    pimpl->event.parameters["dir"] = EndpointSecurityImpl::getEsFile(dir);
-    pimpl->event.parameters["filename"] = EndpointSecurityImpl::getEsStringToken(filename);
-    pimpl->event.parameters["mode"] = std::to_string(mode);
+    pimpl->event->payload.type = Payload::UipcBind;
+    pimpl->setEsFile( pimpl->event->payload.uipc_bind.dir, dir );
+    pimpl->setEsStringToken( pimpl->event->payload.uipc_bind.filename, filename );
+    pimpl->event->payload.uipc_bind.mode = mode;
 }
 
 
 void EndpointSecurity::on_uipc_connect ( es_file_t *file, int domain, int type, int protocol )
 {
-    pimpl->event.event = "uipc_connect";
-    pimpl->event.parameters["file"] = EndpointSecurityImpl::getEsFile(file);
-    pimpl->event.parameters["domain"] = std::to_string(domain);
-    pimpl->event.parameters["type"] = std::to_string(type);
-    pimpl->event.parameters["protocol"] = std::to_string(protocol);
+    pimpl->event->payload.type = Payload::UipcConnect;
+    pimpl->setEsFile( pimpl->event->payload.uipc_connect.file, file );
+    pimpl->event->payload.uipc_connect.domain = domain;
+    pimpl->event->payload.uipc_connect.type = type;
+    pimpl->event->payload.uipc_connect.protocol = protocol;
 }
 
 
 void EndpointSecurity::on_unlink ( es_file_t *target )
 {
-    pimpl->event.event = "unlink";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
 }
 
 
 void EndpointSecurity::on_unmount ( struct statfs *statfs )
 {
-    pimpl->event.event = "unmount";
-    pimpl->getStatFs( statfs );
-    pimpl->event.filename = statfs->f_mntonname;
+    pimpl->event->payload.type = Payload::Mount;
+    pimpl->setCString( pimpl->event->payload.mount.mntfromname, statfs->f_mntfromname );
+    pimpl->setCString( pimpl->event->payload.mount.mntonname, statfs->f_mntonname );
 }
 
 
 void EndpointSecurity::on_utimes ( es_file_t *target, const struct timespec * mtime, const struct timespec * atime )
 {
-    pimpl->event.event = "utimes";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.parameters["mtime"] = EndpointSecurityImpl::timespecToString( mtime->tv_sec );
-    pimpl->event.parameters["atime"] = EndpointSecurityImpl::timespecToString( atime->tv_sec );
+    pimpl->event->payload.type = Payload::Utimes;
+    pimpl->setEsFile( pimpl->event->payload.utimes.target, target );
+    pimpl->event->payload.utimes.mtime = *mtime;
+    pimpl->event->payload.utimes.atime = *atime;
 }
 
 
 void EndpointSecurity::on_write ( es_file_t *target )
 {
-    pimpl->event.event = "write";
-    pimpl->event.parameters["target"] = EndpointSecurityImpl::getEsFile(target);
-    pimpl->event.filename = pimpl->event.parameters["target"];
+    pimpl->event->payload.type = Payload::File;
+    pimpl->setEsFile( pimpl->event->payload.file.target, target );
+}
+
+
+uint64_t EndpointSecurity::formattedDescriptions()
+{
+    return EndpointSecurityImpl::formattedDescriptions;
+}
+
+
+std::string EndpointSecurity::ProcessInfo::csflags_desc() const
+{
+    return EndpointSecurityImpl::getBitmask( value_map_codesign, csflags );
+}
+
+
+std::string EndpointSecurity::Event::process_csflags_desc() const
+{
+    if ( process_cached && process_cached->csflags == process_csflags )
+    {
+        const CachedProcess& cached = *process_cached;
+        std::call_once( cached.csflags_formatted, [&cached](){ cached.csflags_desc = EndpointSecurityImpl::getBitmask( value_map_codesign, cached.csflags ); } );
+        return cached.csflags_desc;
+    }
+    
+    return EndpointSecurityImpl::getBitmask( value_map_codesign, process_csflags );
+}
+
+
+std::string EndpointSecurity::Event::timestamp() const
+{
+    return EndpointSecurityImpl::timeToString( time_s, time_ns );
+}
+
+
+std::string EndpointSecurity::Event::process_start_time() const
+{
+    if ( process_cached )
+        return process_cached->start_time;
+    
+    return EndpointSecurityImpl::timeToString( process_start_time_s );
+}
+
+
+std::string EndpointSecurity::AccessPayload::mode_desc() const
+{
+    return mode == 0 ? "F_OK (0)" : EndpointSecurityImpl::getBitmask( value_map_access, mode );
+}
+
+
+std::string EndpointSecurity::ExitPayload::stat_desc() const
+{
+    EndpointSecurityImpl::formattedDescriptions++;
+    
+    // Parse the stat according to man 2 wait
+    if ( WIFEXITED(stat) )
+        return "normal exit with code " + std::to_string( WEXITSTATUS(stat) );
+    else if ( WIFSIGNALED(stat) )
+        return "killed by signal " + std::to_string( WTERMSIG(stat) ) + (WCOREDUMP(stat) ? " (coredump created)" : "" );
+    else
+        return "";
+}
+
+
+std::string EndpointSecurity::FcntlPayload::cmd_desc() const
+{
+    return EndpointSecurityImpl::getValue( value_map_fcntl, cmd );
+}
+
+
+std::string EndpointSecurity::MmapPayload::flags_desc() const
+{
+    return EndpointSecurityImpl::getBitmask( value_map_mmap_flags, flags );
+}
+
+
+std::string EndpointSecurity::MmapPayload::max_protection_desc() const
+{
+    return max_protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot, max_protection );
+}
+
+
+std::string EndpointSecurity::MmapPayload::protection_desc() const
+{
+    return protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot, protection );
+}
+
+
+std::string EndpointSecurity::MprotectPayload::protection_desc() const
+{
+    return protection == 0 ? "PROT_NONE (0)" : EndpointSecurityImpl::getBitmask( value_map_mmap_prot, protection );
+}
+
+
+std::string EndpointSecurity::OpenPayload::fflag_desc() const
+{
+    return EndpointSecurityImpl::getBitmask( value_map_open, fflag );
+}
+
+
+std::string EndpointSecurity::ProcCheckPayload::type_desc() const
+{
+    return EndpointSecurityImpl::getValue( value_map_proc_check_type, type );
+}
+
+
+// Builds the name/value view of the payload. The names and the formatting match what the handlers used to report.
+std::map<std::string, std::string> EndpointSecurity::Event::parameters() const
+{
+    std::map<std::string, std::string> params;
+    
+    switch ( payload.type )
+    {
+        case Payload::None:
+            break;
+            
+        case Payload::Access:
+            params["target"] = payload.access.target;
+            params["mode"] = std::to_string( payload.access.mode );
+            params["mode_desc"] = payload.access.mode_desc();
+            break;
+            
+        case Payload::File:
+            params["target"] = payload.file.target;
+            break;
+            
+        case Payload::Readlink:
+            params["source"] = payload.readlink.source;
+            break;
+            
+        case Payload::Clone:
+            params["source"] = payload.clone.source;
+            params["target_dir"] = payload.clone.target_dir;
+            params["target_name"] = payload.clone.target_name;
+            break;
+            
+        case Payload::Close:
+            params["target"] = payload.close.target;
+            params["modified"] = payload.close.modified ? "true" : "false";
+            break;
+            
+        case Payload::Create:
+            if ( payload.create.existing_file )
+            {
+                params["filename"] = payload.create.filename;
+                params["fflag"] = EndpointSecurityImpl::getBitmask( value_map_open, 0x00000200 | 0x00000002 | 0x00000400 );
+            }
+            else
+            {
+                params["target_dir"] = payload.create.target_dir;
+                params["target_name"] = payload.create.target_name;
+                params["mode"] = std::to_string( payload.create.mode );
+            }
+            break;
+            
+        case Payload::Extattr:
+            params["target"] = payload.extattr.target;
+            params["extattr"] = payload.extattr.extattr;
+            break;
+            
+        case Payload::Exchangedata:
+            params["file1"] = payload.exchangedata.file1;
+            params["file2"] = payload.exchangedata.file2;
+            break;
+            
+        case Payload::Exec:
+            EndpointSecurityImpl::describeProcess( params, payload.exec.target, "target_" );
+            params["target_args"] = payload.exec.args;
+            break;
+            
+        case Payload::Exit:
+            params["stat"] = std::to_string( payload.exit.stat );
+            params["stat_desc"] = payload.exit.stat_desc();
+            break;
+            
+        case Payload::Fcntl:
+            params["target"] = payload.fcntl.target;
+            params["cmd"] = std::to_string( payload.fcntl.cmd );
+            params["cmd_desc"] = payload.fcntl.cmd_desc();
+            break;
+            
+        case Payload::FileProviderMaterialize:
+            EndpointSecurityImpl::describeProcess( params, payload.file_provider_materialize.instigator, "instigator_" );
+            params["source"] = payload.file_provider_materialize.source;
+            params["target"] = payload.file_provider_materialize.target;
+            break;
+            
+        case Payload::FileProviderUpdate:
+            params["source"] = payload.file_provider_update.source;
+            params["target_path"] = payload.file_provider_update.target_path;
+            break;
+            
+        case Payload::Fork:
+            EndpointSecurityImpl::describeProcess( params, payload.fork.child, "child_" );
+            break;
+            
+        case Payload::Attrlist:
+            params["target"] = payload.attrlist.target;
+            EndpointSecurityImpl::describeAttrlist( params, payload.attrlist.attrlist );
+            break;
+            
+        case Payload::GetTask:
+            EndpointSecurityImpl::describeProcess( params, payload.get_task.target, "target_" );
+            break;
+            
+        case Payload::IokitOpen:
+            params["user_client_class"] = payload.iokit_open.user_client_class;
+            params["user_client_type"] = std::to_string( payload.iokit_open.user_client_type );
+            break;
+            
+        case Payload::Kext:
+            params["identifier"] = payload.kext.identifier;
+            break;
+            
+        case Payload::Link:
+            params["source"] = payload.link.source;
+            params["target_dir"] = payload.link.target_dir;
+            params["target_filename"] = payload.link.target_filename;
+            break;
+            
+        case Payload::Lookup:
+            params["source_dir"] = payload.lookup.source_dir;
+            params["relative_target"] = payload.lookup.relative_target;
+            break;
+            
+        case Payload::Mmap:
+            params["source"] = payload.mmap.source;
+            params["file_pos"] = std::to_string( payload.mmap.file_pos );
+            params["flags"] = payload.mmap.flags_desc();
+            params["max_protection"] = payload.mmap.max_protection_desc();
+            params["protection"] = payload.mmap.protection_desc();
+            break;
+            
+        case Payload::Mount:
+            params["f_mntfromname"] = payload.mount.mntfromname;
+            params["f_mntonname"] = payload.mount.mntonname;
+            break;
+            
+        case Payload::Mprotect:
+            params["address"] = std::to_string( payload.mprotect.address );
+            params["size"] = std::to_string( payload.mprotect.size );
+            params["protection"] = payload.mprotect.protection_desc();
+            break;
+            
+        case Payload::Open:
+            params["filename"] = payload.open.filename;
+            params["fflag"] = payload.open.fflag_desc();
+            break;
+            
+        case Payload::ProcCheck:
+            params["flavor"] = std::to_string( payload.proc_check.flavor );
+            
+            if ( payload.proc_check.target.pid != -1 )
+                EndpointSecurityImpl::describeProcess( params, payload.proc_check.target, "target_" );
+            
+            params["type"] = payload.proc_check.type_desc();
+            break;
+            
+        case Payload::Pty:
+            params["dev"] = std::to_string( payload.pty.dev );
+            break;
+            
+        case Payload::Rename:
+            if ( payload.rename.existing_file )
+            {
+                params["existing_file"] = payload.rename.filename;
+            }
+            else
+            {
+                params["dir"] = payload.rename.dir;
+                params["filename"] = payload.rename.filename;
+            }
+            break;
+            
+        case Payload::Setflags:
+            params["target"] = payload.setflags.target;
+            params["flags"] = std::to_string( payload.setflags.flags );
+            break;
+            
+        case Payload::Setmode:
+            params["target"] = payload.setmode.target;
+            params["mode"] = std::to_string( payload.setmode.mode );
+            break;
+            
+        case Payload::Setowner:
+            params["target"] = payload.setowner.target;
+            params["uid"] = std::to_string( payload.setowner.uid );
+            params["gid"] = std::to_string( payload.setowner.gid );
+            break;
+            
+        case Payload::Signal:
+            EndpointSecurityImpl::describeProcess( params, payload.signal.target, "target_" );
+            params["sig"] = std::to_string( payload.signal.sig );
+            break;
+            
+        case Payload::UipcBind:
+            params["dir"] = payload.uipc_bind.dir;
+            params["filename"] = payload.uipc_bind.filename;
+            params["mode"] = std::to_string( payload.uipc_bind.mode );
+            break;
+            
+        case Payload::UipcConnect:
+            params["file"] = payload.uipc_connect.file;
+            params["domain"] = std::to_string( payload.uipc_connect.domain );
+            params["type"] = std::to_string( payload.uipc_connect.type );
+            params["protocol"] = std::to_string( payload.uipc_connect.protocol );
+            break;
+            
+        case Payload::Utimes:
+            params["target"] = payload.utimes.target;
+            params["mtime"] = EndpointSecurityImpl::timeToString( payload.utimes.mtime.tv_sec );
+            params["atime"] = EndpointSecurityImpl::timeToString( payload.utimes.atime.tv_sec );
+            break;
+    }
+    
+    return params;
+}
+
+
+// Copies the strings of the process fields and the active payload. The other payloads, and the fields the active one does not
+// use for its variant, such as the target_dir of a create on an existing file, may point to the messages which are gone,
+// so they are left alone.
+void EndpointSecurity::Event::materialize()
+{
+    auto materializeProcess = []( ProcessInfo& info )
+    {
+        if ( info.pid == -1 )
+            return;
+        
+        info.signing_id.materialize();
+        info.team_id.materialize();
+        info.executable.materialize();
+    };
+    
+    // The process strings point into process_cached, which the event keeps alive
+    if ( !process_cached )
+    {
+        process_signing_id.materialize();
+        process_team_id.materialize();
+        process_executable.materialize();
+    }
+    
+    filename.materialize();
+    
+    switch ( payload.type )
+    {
+        case Payload::None:
+        case Payload::Exit:
+        case Payload::Mprotect:
+        case Payload::Pty:
+            break;
+            
+        case Payload::Access:
+            payload.access.target.materialize();
+            break;
+            
+        case Payload::File:
+            payload.file.target.materialize();
+            break;
+            
+        case Payload::Readlink:
+            payload.readlink.source.materialize();
+            break;
+            
+        case Payload::Clone:
+            payload.clone.source.materialize();
+            payload.clone.target_dir.materialize();
+            payload.clone.target_name.materialize();
+            break;
+            
+        case Payload::Close:
+            payload.close.target.materialize();
+            break;
+            
+        case Payload::Create:
+            if ( payload.create.existing_file )
+                payload.create.filename.materialize();
+            else
+            {
+                payload.create.target_dir.materialize();
+                payload.create.target_name.materialize();
+            }
+            break;
+            
+        case Payload::Extattr:
+            payload.extattr.target.materialize();
+            payload.extattr.extattr.materialize();
+            break;
+            
+        case Payload::Exchangedata:
+            payload.exchangedata.file1.materialize();
+            payload.exchangedata.file2.materialize();
+            break;
+            
+        case Payload::Exec:
+            materializeProcess( payload.exec.target );
+            
+            for ( auto& arg : payload.exec.argv )
+                arg.materialize();
+            break;
+            
+        case Payload::Fcntl:
+            payload.fcntl.target.materialize();
+            break;
+            
+        case Payload::FileProviderMaterialize:
+            materializeProcess( payload.file_provider_materialize.instigator );
+            payload.file_provider_materialize.source.materialize();
+            payload.file_provider_materialize.target.materialize();
+            break;
+            
+        case Payload::FileProviderUpdate:
+            payload.file_provider_update.source.materialize();
+            payload.file_provider_update.target_path.materialize();
+            break;
+            
+        case Payload::Fork:
+            materializeProcess( payload.fork.child );
+            break;
+            
+        case Payload::Attrlist:
+            payload.attrlist.target.materialize();
+            break;
+            
+        case Payload::GetTask:
+            materializeProcess( payload.get_task.target );
+            break;
+            
+        case Payload::IokitOpen:
+            payload.iokit_open.user_client_class.materialize();
+            break;
+            
+        case Payload::Kext:
+            payload.kext.identifier.materialize();
+            break;
+            
+        case Payload::Link:
+            payload.link.source.materialize();
+            payload.link.target_dir.materialize();
+            payload.link.target_filename.materialize();
+            break;
+            
+        case Payload::Lookup:
+            payload.lookup.source_dir.materialize();
+            payload.lookup.relative_target.materialize();
+            break;
+            
+        case Payload::Mmap:
+            payload.mmap.source.materialize();
+            break;
+            
+        case Payload::Mount:
+            payload.mount.mntfromname.materialize();
+            payload.mount.mntonname.materialize();
+            break;
+            
+        case Payload::Open:
+            payload.open.filename.materialize();
+            break;
+            
+        case Payload::ProcCheck:
+            materializeProcess( payload.proc_check.target );
+            break;
+            
+        case Payload::Rename:
+            payload.rename.filename.materialize();
+            
+            if ( !payload.rename.existing_file )
+                payload.rename.dir.materialize();
+            break;
+            
+        case Payload::Setflags:
+            payload.setflags.target.materialize();
+            break;
+            
+        case Payload::Setmode:
+            payload.setmode.target.materialize();
+            break;
+            
+        case Payload::Setowner:
+            payload.setowner.target.materialize();
+            break;
+            
+        case Payload::Signal:
+            materializeProcess( payload.signal.target );
+            break;
+            
+        case Payload::UipcBind:
+            payload.uipc_bind.dir.materialize();
+            payload.uipc_bind.filename.materialize();
+            break;
+            
+        case Payload::UipcConnect:
+            payload.uipc_connect.file.materialize();
+            break;
+            
+        case Payload::Utimes:
+            payload.utimes.target.materialize();
+            break;
+    }
 }
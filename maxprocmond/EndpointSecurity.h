@@ -22,11 +22,19 @@
 //OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 //SOFTWARE.
 
+#ifndef ENDPOINTSECURITY_H
+#define ENDPOINTSECURITY_H
+
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <ostream>
 #include <vector>
 #include <variant>
 #include <map>
+#include <sys/attr.h>
 
 #include <EndpointSecurity/EndpointSecurity.h>
 
@@ -47,6 +55,19 @@ class EndpointSecurityException
 
 // pimpl
 class EndpointSecurityImpl;
+class EventPool;
+
+// Keeps the messages valid after the ES callback returns, so they could be decoded on another thread.
+// The default one uses es_retain_message(); the stub builds and the benchmarks could provide their own.
+class MessageRetainer
+{
+    public:
+        virtual ~MessageRetainer() {}
+        
+        // Returns the message to use later, the same one or a copy, and releases it
+        virtual const es_message_t * retain( const es_message_t * message ) = 0;
+        virtual void                 release( const es_message_t * message ) = 0;
+};
 
 //
 // Main EndpointSecurity class. Either subclass it (do not cast to base), or use as-is
@@ -54,17 +75,336 @@ class EndpointSecurityImpl;
 class EndpointSecurity
 {
     public:
-        // Contains the information about the event. All data is copied already, so it's safe to pass along.
+        // A string in the event. By default it holds a copy of the data. In the view mode it points into the es_message_t
+        // instead, and is only valid until the report function returns, unless the event is materialized.
+        class EventString
+        {
+            public:
+                EventString() {}
+                EventString( const EventString& other ) { *this = other; }
+                EventString( EventString&& other ) { *this = std::move( other ); }
+            
+                EventString& operator=( const EventString& other )
+                {
+                    if ( other.owned )
+                        assign( other.text.data(), other.text.length() );
+                    else
+                        point( other.text.data(), other.text.length() );
+                    
+                    return *this;
+                }
+            
+                EventString& operator=( EventString&& other )
+                {
+                    if ( other.owned )
+                    {
+                        // the view may point into the small string buffer of the other object
+                        storage = std::move( other.storage );
+                        text = storage;
+                        owned = true;
+                    }
+                    else
+                        point( other.text.data(), other.text.length() );
+                    
+                    return *this;
+                }
+            
+                // Copies the data. The storage keeps its capacity, so this does not allocate once warmed up.
+                void assign( const char * data, size_t length )
+                {
+                    storage.assign( data, length );
+                    text = storage;
+                    owned = true;
+                }
+            
+                // Points to the data without copying
+                void point( const char * data, size_t length )
+                {
+                    text = std::string_view( data, length );
+                    owned = false;
+                }
+            
+                void clear()
+                {
+                    text = std::string_view();
+                    owned = false;
+                }
+            
+                // Makes a copy of the data if it points outside
+                void materialize()
+                {
+                    if ( !owned )
+                        assign( text.data(), text.length() );
+                }
+            
+                bool isView() const { return !owned && !text.empty(); }
+            
+                const char * data() const { return text.data(); }
+                size_t  length() const { return text.length(); }
+                bool    empty() const { return text.empty(); }
+                std::string_view view() const { return text; }
+                std::string str() const { return std::string( text ); }
+                operator std::string_view() const { return text; }
+            
+                bool operator==( std::string_view other ) const { return text == other; }
+                bool operator!=( std::string_view other ) const { return text != other; }
+            
+                friend std::ostream& operator<<( std::ostream& os, const EventString& s ) { return os << s.text; }
+            
+            private:
+                std::string_view    text;
+                std::string         storage;
+                bool                owned = false;
+        };
+        
+        // Process information extracted from es_process_t for the processes an event refers to,
+        // such as the exec target or the fork child. pid is -1 if the process information is not available.
+        struct ProcessInfo
+        {
+            pid_t       pid;
+            pid_t       euid;
+            pid_t       ruid;
+            pid_t       rgid;
+            pid_t       egid;
+            pid_t       ppid;
+            pid_t       oppid;
+            pid_t       gid;
+            pid_t       sid;
+            uint32_t    csflags;
+            bool        is_platform_binary;
+            bool        is_es_client;
+            EventString signing_id;
+            EventString team_id;
+            EventString executable;
+            
+            std::string csflags_desc() const;
+        };
+        
+        // The process information which does not change during the process lifetime. It is extracted once per process
+        // instance, identified by pid and pidversion, and shared by all events of this process until it exits.
+        struct CachedProcess
+        {
+            std::string signing_id;
+            std::string team_id;
+            std::string executable;
+            std::string start_time;
+            
+            // codesigning flags could change while the process runs, so the description is only valid for these flags.
+            // It is formatted by the first process_csflags_desc() call, which could come from several threads at once.
+            uint32_t    csflags;
+            mutable std::once_flag  csflags_formatted;
+            mutable std::string     csflags_desc;
+        };
+        
+        // Typed event payloads. Most event types have their own, the events with identical arguments share one.
+        // The *_desc() functions format the human-readable values, i.e. "FREAD|O_NONBLOCK (5)", only when called.
+        struct AccessPayload { EventString target; int32_t mode; std::string mode_desc() const; };
+        struct FilePayload { EventString target; };     // chdir, chroot, dup, fsgetpath, listextattr, readdir, setacl, stat, truncate, unlink, write
+        struct ReadlinkPayload { EventString source; };
+        struct ClonePayload { EventString source; EventString target_dir; EventString target_name; };
+        struct ClosePayload { EventString target; bool modified; };
+        struct CreatePayload { bool existing_file; EventString filename; EventString target_dir; EventString target_name; uint32_t mode; };
+        struct ExtattrPayload { EventString target; EventString extattr; };     // deleteextattr, getextattr, setextattr
+        struct ExchangedataPayload { EventString file1; EventString file2; };
+        struct ExecPayload
+        {
+            ProcessInfo target;
+            std::string args;   // all arguments quoted and separated by space, see encodeArgs()
+            std::vector< EventString > argv;    // the separate arguments, only filled if enabled by setExecArgv()
+        };
+        struct ExitPayload { int stat; std::string stat_desc() const; };
+        struct FcntlPayload { EventString target; int32_t cmd; std::string cmd_desc() const; };
+        struct FileProviderMaterializePayload { ProcessInfo instigator; EventString source; EventString target; };
+        struct FileProviderUpdatePayload { EventString source; EventString target_path; };
+        struct ForkPayload { ProcessInfo child; };
+        struct AttrlistPayload { EventString target; struct attrlist attrlist; };    // getattrlist, setattrlist
+        struct GetTaskPayload { ProcessInfo target; };
+        struct IokitOpenPayload { EventString user_client_class; uint32_t user_client_type; };
+        struct KextPayload { EventString identifier; };     // kextload, kextunload
+        struct LinkPayload { EventString source; EventString target_dir; EventString target_filename; };
+        struct LookupPayload { EventString source_dir; EventString relative_target; };
+        struct MmapPayload
+        {
+            EventString source; uint64_t file_pos; int32_t flags; int32_t max_protection; int32_t protection;
+            std::string flags_desc() const;
+            std::string max_protection_desc() const;
+            std::string protection_desc() const;
+        };
+        struct MountPayload { EventString mntfromname; EventString mntonname; };    // mount, unmount
+        struct MprotectPayload { user_addr_t address; user_size_t size; int32_t protection; std::string protection_desc() const; };
+        struct OpenPayload { EventString filename; int32_t fflag; std::string fflag_desc() const; };
+        struct ProcCheckPayload { int flavor; ProcessInfo target; int type; std::string type_desc() const; };
+        struct PtyPayload { dev_t dev; };     // pty_close, pty_grant
+        struct RenamePayload { bool existing_file; EventString filename; EventString dir; };
+        struct SetflagsPayload { EventString target; uint32_t flags; };
+        struct SetmodePayload { EventString target; int32_t mode; };
+        struct SetownerPayload { EventString target; int32_t uid; int32_t gid; };
+        struct SignalPayload { ProcessInfo target; uint32_t sig; };
+        struct UipcBindPayload { EventString dir; EventString filename; uint32_t mode; };
+        struct UipcConnectPayload { EventString file; int domain; int type; int protocol; };
+        struct UtimesPayload { EventString target; struct timespec mtime; struct timespec atime; };
+        
+        // The payload of an event; type tells which member is valid. The payloads are kept side by side
+        // instead of in a std::variant so their strings keep the capacity between the messages of different
+        // types, and filling them does not allocate once the daemon has warmed up.
+        struct Payload
+        {
+            enum Type
+            {
+                None,       // settime
+                Access,
+                File,
+                Readlink,
+                Clone,
+                Close,
+                Create,
+                Extattr,
+                Exchangedata,
+                Exec,
+                Exit,
+                Fcntl,
+                FileProviderMaterialize,
+                FileProviderUpdate,
+                Fork,
+                Attrlist,
+                GetTask,
+                IokitOpen,
+                Kext,
+                Link,
+                Lookup,
+                Mmap,
+                Mount,
+                Mprotect,
+                Open,
+                ProcCheck,
+                Pty,
+                Rename,
+                Setflags,
+                Setmode,
+                Setowner,
+                Signal,
+                UipcBind,
+                UipcConnect,
+                Utimes
+            };
+            
+            Type        type;
+            
+            AccessPayload                   access;
+            FilePayload                     file;
+            ReadlinkPayload                 readlink;
+            ClonePayload                    clone;
+            ClosePayload                    close;
+            CreatePayload                   create;
+            ExtattrPayload                  extattr;
+            ExchangedataPayload             exchangedata;
+            ExecPayload                     exec;
+            ExitPayload                     exit;
+            FcntlPayload                    fcntl;
+            FileProviderMaterializePayload  file_provider_materialize;
+            FileProviderUpdatePayload       file_provider_update;
+            ForkPayload                     fork;
+            AttrlistPayload                 attrlist;
+            GetTaskPayload                  get_task;
+            IokitOpenPayload                iokit_open;
+            KextPayload                     kext;
+            LinkPayload                     link;
+            LookupPayload                   lookup;
+            MmapPayload                     mmap;
+            MountPayload                    mount;
+            MprotectPayload                 mprotect;
+            OpenPayload                     open;
+            ProcCheckPayload                proc_check;
+            PtyPayload                      pty;
+            RenamePayload                   rename;
+            SetflagsPayload                 setflags;
+            SetmodePayload                  setmode;
+            SetownerPayload                 setowner;
+            SignalPayload                   signal;
+            UipcBindPayload                 uipc_bind;
+            UipcConnectPayload              uipc_connect;
+            UtimesPayload                   utimes;
+        };
+        
+        // Identifies the event, the same for its notify and auth types. Sinks could switch on it instead of comparing the names.
+        // The values are stored in the log database, so the new events must be added at the end, before Count.
+        enum class EventId : uint8_t
+        {
+            Unknown,
+            Access,
+            Chdir,
+            Chroot,
+            Clone,
+            Close,
+            Create,
+            Deleteextattr,
+            Dup,
+            Exchangedata,
+            Exec,
+            Exit,
+            Fcntl,
+            FileProviderMaterialize,
+            FileProviderUpdate,
+            Fork,
+            Fsgetpath,
+            Getattrlist,
+            Getextattr,
+            GetTask,
+            IokitOpen,
+            Kextload,
+            Kextunload,
+            Link,
+            Listextattr,
+            Lookup,
+            Mmap,
+            Mount,
+            Mprotect,
+            Open,
+            ProcCheck,
+            PtyClose,
+            PtyGrant,
+            Readdir,
+            Readlink,
+            Rename,
+            Setacl,
+            Setattrlist,
+            Setextattr,
+            Setflags,
+            Setmode,
+            Setowner,
+            Settime,
+            Signal,
+            Stat,
+            Truncate,
+            UipcBind,
+            UipcConnect,
+            Unlink,
+            Unmount,
+            Utimes,
+            Write,
+            Count
+        };
+        
+        // Contains the information about the event. By default all data is copied, so it's safe to pass along. In the view
+        // mode the strings point into the message and are only valid until the report function returns: an event kept
+        // longer, whether copied or taken out of the pool with takeEvent(), must be materialize()d first.
         struct Event
         {
-            // the event, i.e. create. open, etc
-            std::string event;
+            // the event, i.e. create. open, etc. It points to the static name from the event table.
+            std::string_view event;
+            EventId     event_id;
             
             // true if this is authentication event, false otherwise
             bool        is_authentication;
             
-            // The event timestamp
-            std::string timestamp;
+            // For the auth events, the nanoseconds which were left until the deadline when the response was sent.
+            // Negative if the deadline was missed, 0 for the notify events.
+            int64_t     auth_slack_ns;
+            
+            // mach_absolute_time() when the message was received, 0 if it did not come through on_message()
+            uint64_t    received_time;
+            
+            // The event time
             __darwin_time_t time_s;
             long time_ns;
             
@@ -79,27 +419,213 @@ class EndpointSecurity
             pid_t       process_gid;
             pid_t       process_sid;
             uint32_t    process_csflags;
-            std::string process_csflags_desc;
             bool        process_is_platform_binary;
             bool        process_is_es_client;
-            std::string process_signing_id;
-            std::string process_team_id;
+            EventString process_signing_id;
+            EventString process_team_id;
             uint64_t    process_thread_id;
-            std::string process_start_time;
-            std::string process_executable;
-            std::string filename;
+            __darwin_time_t process_start_time_s;
+            EventString process_executable;
+            EventString filename;
+            
+            // The process_signing_id, process_team_id and process_executable strings point into it, and it keeps them valid
+            std::shared_ptr< const CachedProcess > process_cached;
+            
+            // The event-specific data
+            Payload     payload;
+            
+            // Human-readable process_csflags, formatted on call
+            std::string process_csflags_desc() const;
+            
+            // The event time and the process start time as the local time, i.e. "2022-07-16 21:33:20.000001000",
+            // formatted on call. The start time has no nanoseconds.
+            std::string timestamp() const;
+            std::string process_start_time() const;
+            
+            // Compatibility view of the payload as the name/value strings, i.e. "fflag" : "FREAD (1)".
+            // It is built on every call, so the sinks which need the speed should read the payload instead.
+            std::map<std::string, std::string>   parameters() const;
+            
+            // In the view mode, copies all the strings the event points to, so the event could be used after
+            // the report function returns. Does nothing for the events which are already copied.
+            void    materialize();
+        };
+        
+        // Describes an es_event_type_t
+        struct EventDescriptor
+        {
+            const char *    name;       // nullptr if the event type is not supported
+            EventId         id;
+            bool            is_auth;
+            
+            // Calls the handler which fills the event payload
+            void            (*extract)( EndpointSecurity& es, const es_message_t * message );
+            
+            // Returns the payload string which becomes Event::filename, or nullptr if the event has none
+            const EventString * (*primary_path)( const Event& event );
+        };
+        
+        // An event taken out of the pool by takeEvent(). It remains valid after the report function returns, and could be
+        // passed to another thread. The slot goes back to the pool, keeping its string capacity, when the handle is released
+        // or destroyed. All handles must be released before the EndpointSecurity object is destroyed.
+        class EventHandle
+        {
+            public:
+                EventHandle() {}
+                EventHandle( EventHandle&& other ) { *this = std::move( other ); }
+                ~EventHandle() { release(); }
+            
+                EventHandle& operator=( EventHandle&& other )
+                {
+                    if ( this != &other )
+                    {
+                        release();
+                        std::swap( pool, other.pool );
+                        std::swap( slot, other.slot );
+                        std::swap( event, other.event );
+                    }
+                    
+                    return *this;
+                }
+            
+                EventHandle( const EventHandle& ) = delete;
+                EventHandle& operator=( const EventHandle& ) = delete;
+            
+                void    release();
+            
+                Event * get() const { return event; }
+                Event * operator->() const { return event; }
+                Event&  operator*() const { return *event; }
+                explicit operator bool() const { return event != nullptr; }
+            
+            private:
+                friend class EndpointSecurity;
+                EventHandle( EventPool * p, unsigned int s, Event * e ) : pool(p), slot(s), event(e) {}
             
-            // std::variant could be better, but it is C++17
-            std::map<std::string, std::string>   parameters;
+                EventPool *     pool = nullptr;
+                unsigned int    slot = 0;
+                Event *         event = nullptr;
         };
         
+        // The events passed to the batch report function, in the order they were delivered. They are only valid
+        // until the function returns.
+        class EventBatch
+        {
+            public:
+                EventBatch( const Event * const * events, size_t count ) : events( events ), count( count ) {}
+            
+                size_t          size() const { return count; }
+                bool            empty() const { return count == 0; }
+                const Event&    operator[]( size_t i ) const { return *events[i]; }
+            
+                class iterator
+                {
+                    public:
+                        explicit iterator( const Event * const * p ) : p( p ) {}
+                        const Event& operator*() const { return **p; }
+                        iterator& operator++() { ++p; return *this; }
+                        bool operator!=( const iterator& other ) const { return p != other.p; }
+                    
+                    private:
+                        const Event * const * p;
+                };
+            
+                iterator        begin() const { return iterator( events ); }
+                iterator        end() const { return iterator( events + count ); }
+            
+            private:
+                const Event * const *   events;
+                size_t                  count;
+        };
+        
+        typedef std::function<void(const EventBatch&)> BatchReportFunc;
+        
+        // The event pool usage. exhausted counts the events dropped because all slots were taken.
+        struct PoolStats
+        {
+            unsigned int    capacity;
+            unsigned int    in_use;
+            uint64_t        exhausted;
+        };
+        
+        // The auth responses so far. The slack is the time left until the message deadline when the response was sent.
+        struct AuthStats
+        {
+            uint64_t    responses;
+            uint64_t    missed;             // responses sent after the deadline
+            int64_t     min_slack_ns;       // INT64_MAX if there were no responses
+            int64_t     total_slack_ns;     // divide by responses for the mean
+        };
+        
+        // Returns the descriptor of the event type. For the unsupported types the name is nullptr.
+        static const EventDescriptor& describeEvent( es_event_type_t type );
+        
+        // Returns the event name for the id, i.e. "open" for EventId::Open, or nullptr for the unknown ids
+        static const char * eventName( EventId id );
+        
         EndpointSecurity();
         virtual ~EndpointSecurity();
         
+        // How many human-readable descriptions (the *_desc() values and the parameters() flags) were formatted so far, by all clients
+        static uint64_t formattedDescriptions();
+        
         // Creates or destroys a client. Throws EndpointSecurityException in case of error
         void    create( std::function<int(const Event&)> reportfunc );
+        
+        // Sets up the event processing without creating the client. The messages could then be passed to on_event()
+        // directly, which is how the benchmarks feed the synthetic messages.
+        void    createDetached( std::function<int(const Event&)> reportfunc );
+        
+        // As above, but the events are collected and reported in batches: once there are maxEvents of them, or the oldest
+        // one waited maxDelayMs, whichever comes first. The batch function could be called from the client thread or from
+        // the flusher thread, never from both at once. The events could not be taken with takeEvent(); the batch holds
+        // their slots until the function returns, so a batch is never larger than the pool, which should have room for
+        // a few. The per-event report function above is this with batches of one event.
+        void    create( BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs );
+        void    createDetached( BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs );
+        
+        // Reports the collected events now
+        void    flush();
+        
         void    destroy();
         
+        // Selects between copying the strings into the event (default), or pointing the event strings into the message.
+        // The latter avoids copying the paths, but the event must be materialized if it is used after the report function returns.
+        void    setViewMode( bool enabled );
+        
+        // Sets the number of the event slots, 64 by default. Must be called before create().
+        void    setPoolSize( unsigned int slots );
+        
+        // Decodes the messages on the given number of worker threads instead of the ES thread, which then only answers
+        // the auth messages, retains the messages and queues them. The workers run the handlers and the report function;
+        // the events of one thread are still reported in order. Each worker has its own event slots of the pool size.
+        // The retainer is not owned, nullptr for the es_retain_message() one. Must be called before create(), and
+        // monitorOnlyProcessPath() is not supported then, as the workers do not share the process tracking.
+        void    setDecodeWorkers( unsigned int workers, MessageRetainer * retainer = nullptr );
+        
+        // When all event slots are taken, the auth events and the events of these types wait for a slot to be released
+        // instead of being dropped. The consumers must keep releasing the slots then. None by default.
+        void    setCriticalEvents( const std::vector< EventId >& ids );
+        
+        // Called from the report function, takes the reported event so it stays valid after the function returns.
+        // In the view mode the event points into the message, so it should be materialized before it is kept.
+        EventHandle takeEvent();
+        
+        // With the decode workers, the totals of the workers
+        PoolStats poolStats() const;
+        
+        // The events of the type dropped because all slots were taken; the sum is PoolStats::exhausted
+        uint64_t  slotDrops( EventId id ) const;
+        
+        AuthStats authStats() const;
+        
+        // Whether the exec events also fill ExecPayload::argv with the separate arguments. Disabled by default.
+        void    setExecArgv( bool enabled );
+        
+        // Encodes the arguments as ExecPayload::args does: each one is quoted, with the quotes inside escaped,
+        // and separated by space, i.e. "clang" "-DNAME=\"value\"". The output is sized once and written in a single pass.
+        static void encodeArgs( std::string& dst, const std::string_view * args, size_t count );
+        
         // Only monitor operations of a specified process. All others will be ignored.
         // This means the tool will suppress all events from all processes until this one is stared.
         // The tool will monitor forks as well.
@@ -165,9 +691,23 @@ class EndpointSecurity
         void    on_utimes ( es_file_t *target, const struct timespec * mtime, const struct timespec * atime );
         void    on_write ( es_file_t *target );
        
+        // Main message callback: responds to the auth messages, then calls on_event()
+        void    on_message( es_client_t * client, const es_message_t * message );
+        
         // Main event callback
         void    on_event( const es_message_t * message );
         
     private:
+        // Creates the Apple client, which passes the messages to on_message()
+        void    connect();
+        
+        // Sets up the batching for the batch function, or for the per-event report function if batchfunc is empty
+        void    startReporting( std::function<int(const Event&)> reportfunc, BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs );
+        
+        // Creates the decoders and the workers if setDecodeWorkers() asked for them
+        void    startDecoders( std::function<int(const Event&)> reportfunc, BatchReportFunc batchfunc, size_t maxEvents, unsigned int maxDelayMs );
+        
         EndpointSecurityImpl * pimpl;
 };
+
+#endif // ENDPOINTSECURITY_H
@@ -0,0 +1,158 @@
+#ifndef ESMESSAGEBUILDER_H
+#define ESMESSAGEBUILDER_H
+
+#include <deque>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+
+#include <EndpointSecurity/EndpointSecurity.h>
+
+//
+// Builds the synthetic es_message_t which could be fed to EndpointSecurity::on_event() without the kernel.
+// The builder owns all the messages, strings and structures the messages point to, so they are valid while the
+// builder is alive. Each message is timestamped one microsecond after the previous one and has the next sequence number.
+//
+class EsMessageBuilder
+{
+    public:
+        EsMessageBuilder( pid_t pid = 1000, const std::string& executable = "/usr/bin/clang" )
+        {
+            thread.thread_id = 1;
+            current = process( pid, executable );
+        }
+
+        ~EsMessageBuilder()
+        {
+            for ( es_message_t * msg : messages )
+                free( msg );
+        }
+
+        EsMessageBuilder( const EsMessageBuilder& ) = delete;
+        EsMessageBuilder& operator=( const EsMessageBuilder& ) = delete;
+
+        // The process which generates the following messages
+        void setProcess( es_process_t * proc ) { current = proc; }
+
+        // Creates the string token pointing to the copy of the string
+        es_string_token_t token( const std::string& value )
+        {
+            strings.push_back( value );
+
+            es_string_token_t tok;
+            tok.length = strings.back().length();
+            tok.data = strings.back().c_str();
+            return tok;
+        }
+
+        es_file_t * file( const std::string& path )
+        {
+            files.emplace_back();
+            memset( &files.back(), 0, sizeof(es_file_t) );
+            files.back().path = token( path );
+            return &files.back();
+        }
+
+        es_process_t * process( pid_t pid, const std::string& executable )
+        {
+            processes.emplace_back();
+            es_process_t * proc = &processes.back();
+            memset( proc, 0, sizeof(es_process_t) );
+
+            // see audit_token_to_pid() and friends in libbsm
+            proc->audit_token.val[1] = 501;     // euid
+            proc->audit_token.val[2] = 20;      // egid
+            proc->audit_token.val[3] = 501;     // ruid
+            proc->audit_token.val[4] = 20;      // rgid
+            proc->audit_token.val[5] = pid;
+            proc->audit_token.val[7] = 1;       // pidversion
+            proc->ppid = 1;
+            proc->original_ppid = 1;
+            proc->group_id = pid;
+            proc->session_id = pid;
+            proc->codesigning_flags = 0x22000005;
+            proc->signing_id = token( "com.apple.clang" );
+            proc->team_id = token( "" );
+            proc->executable = file( executable );
+            proc->start_time.tv_sec = starttime - 60;
+            return proc;
+        }
+
+        es_message_t * open( const std::string& path, int32_t fflag, bool auth = false )
+        {
+            es_message_t * msg = create( auth ? ES_EVENT_TYPE_AUTH_OPEN : ES_EVENT_TYPE_NOTIFY_OPEN, auth );
+            msg->event.open.file = file( path );
+            msg->event.open.fflag = fflag;
+            return msg;
+        }
+
+        es_message_t * close( const std::string& path, bool modified )
+        {
+            es_message_t * msg = create( ES_EVENT_TYPE_NOTIFY_CLOSE );
+            msg->event.close.target = file( path );
+            msg->event.close.modified = modified;
+            return msg;
+        }
+
+        es_message_t * write( const std::string& path )
+        {
+            es_message_t * msg = create( ES_EVENT_TYPE_NOTIFY_WRITE );
+            msg->event.write.target = file( path );
+            return msg;
+        }
+
+        es_message_t * stat( const std::string& path )
+        {
+            es_message_t * msg = create( ES_EVENT_TYPE_NOTIFY_STAT );
+            msg->event.stat.target = file( path );
+            return msg;
+        }
+
+        es_message_t * fork( pid_t child )
+        {
+            es_message_t * msg = create( ES_EVENT_TYPE_NOTIFY_FORK );
+            msg->event.fork.child = process( child, current->executable->path.data );
+            return msg;
+        }
+
+        es_message_t * exit( int stat )
+        {
+            es_message_t * msg = create( ES_EVENT_TYPE_NOTIFY_EXIT );
+            msg->event.exit.stat = stat;
+            return msg;
+        }
+
+    private:
+        es_message_t * create( es_event_type_t type, bool auth = false )
+        {
+            // es_message_t ends with the flexible opaque array, so it is allocated rather than stored in a container
+            es_message_t * msg = (es_message_t *) calloc( 1, sizeof(es_message_t) );
+            uint64_t seq = messages.size();
+
+            msg->version = 4;
+            msg->time.tv_sec = starttime + seq / 1000000;
+            msg->time.tv_nsec = (seq % 1000000) * 1000;
+            msg->seq_num = seq;
+            msg->global_seq_num = seq;
+            msg->process = current;
+            msg->thread = &thread;
+            msg->event_type = type;
+            msg->action_type = auth ? ES_ACTION_TYPE_AUTH : ES_ACTION_TYPE_NOTIFY;
+
+            messages.push_back( msg );
+            return msg;
+        }
+
+        static const time_t starttime = 1658000000;
+
+        es_process_t *  current;
+        es_thread_t     thread;
+
+        // deque does not move the elements when growing, so the pointers into it remain valid
+        std::deque< es_message_t * >    messages;
+        std::deque< std::string >       strings;
+        std::deque< es_file_t >         files;
+        std::deque< es_process_t >      processes;
+};
+
+#endif // ESMESSAGEBUILDER_H
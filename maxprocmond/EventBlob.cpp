@@ -0,0 +1,655 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "EventBlob.h"
+
+typedef EndpointSecurity::Payload Payload;
+
+namespace
+{
+    // The field tags; the ones below 32 take a single byte key, so the frequent fields come first.
+    // The values are stored in the databases, so the new tags must be added at the end, before TagCount.
+    enum Tag : uint32_t
+    {
+        Pid = 1, Ppid, Oppid, Euid, Ruid, Egid, Rgid, Gid, Sid, Csflags, IsPlatformBinary, IsEsClient, SigningId, TeamId,
+        ThreadId, StartTime, AuthSlackNs, IsAuthentication, Executable,
+        Target, Source, Mode, TargetDir, TargetName, Modified, ExistingFile, Filename, Extattr, File1, File2, Args, Argv,
+        Stat, Cmd, Instigator, TargetPath, Child, Commonattr, Volattr, Dirattr, Fileattr, Forkattr, UserClientClass,
+        UserClientType, Identifier, TargetFilename, SourceDir, RelativeTarget, FilePos, Flags, MaxProtection, Protection,
+        Mntfromname, Mntonname, Address, Size, Fflag, Flavor, TypeField, Dev, Dir, Uid, Sig, File, Domain, Protocol,
+        Mtime, Atime,
+        TagCount
+    };
+
+    const char * const tagNames[ TagCount ] =
+    {
+        nullptr, "pid", "ppid", "oppid", "euid", "ruid", "egid", "rgid", "gid", "sid", "csflags", "is_platform_binary",
+        "is_es_client", "signing_id", "team_id", "thread_id", "start_time", "auth_slack_ns", "is_authentication", "executable",
+        "target", "source", "mode", "target_dir", "target_name", "modified", "existing_file", "filename", "extattr", "file1",
+        "file2", "args", "argv", "stat", "cmd", "instigator", "target_path", "child", "commonattr", "volattr", "dirattr",
+        "fileattr", "forkattr", "user_client_class", "user_client_type", "identifier", "target_filename", "source_dir",
+        "relative_target", "file_pos", "flags", "max_protection", "protection", "f_mntfromname", "f_mntonname", "address",
+        "size", "fflag", "flavor", "type", "dev", "dir", "uid", "sig", "file", "domain", "protocol", "mtime", "atime",
+    };
+
+    uint32_t tagOf( std::string_view name )
+    {
+        for ( uint32_t tag = 1; tag < TagCount; tag++ )
+        {
+            if ( name == tagNames[ tag ] )
+                return tag;
+        }
+
+        return 0;
+    }
+
+    // Appends the fields to the string
+    class Writer
+    {
+        public:
+            Writer( const EndpointSecurity::Event& event, std::string& out ) : filename( event.filename.view() ), out( out ) {}
+
+            void unsignedField( uint32_t tag, uint64_t value )
+            {
+                key( tag, EventBlob::Unsigned );
+                varint( value );
+            }
+
+            void signedField( uint32_t tag, int64_t value )
+            {
+                key( tag, EventBlob::Signed );
+                varint( ( (uint64_t) value << 1 ) ^ (uint64_t) ( value >> 63 ) );
+            }
+
+            void flag( uint32_t tag, bool value )
+            {
+                if ( value )
+                    unsignedField( tag, 1 );
+            }
+
+            // A string equal to the filename is written as an empty one, which the other strings never are
+            void string( uint32_t tag, std::string_view value )
+            {
+                if ( value.empty() )
+                    return;
+
+                key( tag, EventBlob::String );
+
+                if ( value == filename )
+                {
+                    varint( 0 );
+                    return;
+                }
+
+                varint( value.length() );
+                out.append( value.data(), value.length() );
+            }
+
+            // The nested process is written first, then its length is put in front of it
+            void process( uint32_t tag, const EndpointSecurity::ProcessInfo& info )
+            {
+                key( tag, EventBlob::Process );
+                size_t start = out.length();
+
+                signedField( Pid, info.pid );
+                signedField( Ppid, info.ppid );
+                signedField( Oppid, info.oppid );
+                signedField( Euid, info.euid );
+                signedField( Ruid, info.ruid );
+                signedField( Egid, info.egid );
+                signedField( Rgid, info.rgid );
+                signedField( Gid, info.gid );
+                signedField( Sid, info.sid );
+                unsignedField( Csflags, info.csflags );
+                flag( IsPlatformBinary, info.is_platform_binary );
+                flag( IsEsClient, info.is_es_client );
+                string( SigningId, info.signing_id );
+                string( TeamId, info.team_id );
+                string( Executable, info.executable );
+
+                char length[10];
+                out.insert( start, length, encodeVarint( out.length() - start, length ) );
+            }
+
+        private:
+            void key( uint32_t tag, EventBlob::Type type )
+            {
+                varint( ( tag << 2 ) | type );
+            }
+
+            void varint( uint64_t value )
+            {
+                EventBlob::appendVarint( out, value );
+            }
+
+            static size_t encodeVarint( uint64_t value, char * bytes )
+            {
+                size_t length = 0;
+
+                while ( value >= 0x80 )
+                {
+                    bytes[ length++ ] = (char) ( value | 0x80 );
+                    value >>= 7;
+                }
+
+                bytes[ length++ ] = (char) value;
+                return length;
+            }
+
+            std::string_view    filename;
+            std::string&        out;
+    };
+
+    // Takes the next field off the blob; false at the end or if the blob is damaged
+    bool readField( std::string_view& in, uint32_t& tag, EventBlob::Value& value )
+    {
+        uint64_t key;
+
+        if ( in.empty() || !EventBlob::readVarint( in, key ) )
+            return false;
+
+        tag = key >> 2;
+        value.type = (EventBlob::Type) ( key & 3 );
+
+        if ( !EventBlob::readVarint( in, value.number ) )
+            return false;
+
+        switch ( value.type )
+        {
+            case EventBlob::Signed:
+                value.number = ( value.number >> 1 ) ^ -( value.number & 1 );
+                break;
+
+            case EventBlob::String:
+            case EventBlob::Process:
+                if ( value.number > in.length() )
+                    return false;
+
+                value.bytes = in.substr( 0, value.number );
+                in.remove_prefix( value.number );
+
+                if ( value.type == EventBlob::String && value.number == 0 )
+                    value.type = EventBlob::SameAsFilename;
+
+                break;
+
+            default:
+                break;
+        }
+
+        return true;
+    }
+
+    void appendJsonString( std::string& out, std::string_view text )
+    {
+        out += '"';
+
+        for ( char c : text )
+        {
+            if ( c == '"' || c == '\\' )
+            {
+                out += '\\';
+                out += c;
+            }
+            else if ( (unsigned char) c < 0x20 )
+            {
+                char escaped[8];
+                snprintf( escaped, sizeof(escaped), "\\u%04x", c );
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+
+        out += '"';
+    }
+
+    std::string jsonOf( std::string_view blob, const std::string_view * filename );
+
+    // The filename is null if it is not known
+    void appendJsonValue( std::string& out, const EventBlob::Value& value, const std::string_view * filename )
+    {
+        switch ( value.type )
+        {
+            case EventBlob::Unsigned:
+                out += std::to_string( value.number );
+                break;
+
+            case EventBlob::Signed:
+                out += std::to_string( (int64_t) value.number );
+                break;
+
+            case EventBlob::String:
+                appendJsonString( out, value.bytes );
+                break;
+
+            case EventBlob::Process:
+                out += jsonOf( value.bytes, filename );
+                break;
+
+            case EventBlob::SameAsFilename:
+                if ( filename )
+                    appendJsonString( out, *filename );
+                else
+                    out += "null";
+
+                break;
+        }
+    }
+
+    void eventField( sqlite3_context * context, int argc, sqlite3_value ** argv )
+    {
+        EventBlob::Value value;
+        std::string_view blob( (const char *) sqlite3_value_blob( argv[0] ), sqlite3_value_bytes( argv[0] ) );
+        const char * path = (const char *) sqlite3_value_text( argv[1] );
+
+        if ( !path || !EventBlob::field( blob, path, value ) )
+            return;     // NULL
+
+        switch ( value.type )
+        {
+            case EventBlob::Unsigned:
+            case EventBlob::Signed:
+                sqlite3_result_int64( context, (sqlite3_int64) value.number );
+                break;
+
+            case EventBlob::String:
+                sqlite3_result_text( context, value.bytes.data(), value.bytes.length(), SQLITE_TRANSIENT );
+                break;
+
+            case EventBlob::Process:
+            {
+                std::string json;
+
+                if ( argc > 2 && sqlite3_value_type( argv[2] ) != SQLITE_NULL )
+                    json = EventBlob::json( value.bytes, std::string_view( (const char *) sqlite3_value_text( argv[2] ), sqlite3_value_bytes( argv[2] ) ) );
+                else
+                    json = EventBlob::json( value.bytes );
+
+                sqlite3_result_text( context, json.data(), json.length(), SQLITE_TRANSIENT );
+                break;
+            }
+
+            case EventBlob::SameAsFilename:
+                if ( argc > 2 )
+                    sqlite3_result_value( context, argv[2] );
+
+                break;
+        }
+    }
+
+    void eventDetail( sqlite3_context * context, int argc, sqlite3_value ** argv )
+    {
+        if ( sqlite3_value_type( argv[0] ) == SQLITE_NULL )
+            return;
+
+        std::string_view blob( (const char *) sqlite3_value_blob( argv[0] ), sqlite3_value_bytes( argv[0] ) );
+        std::string json;
+
+        if ( argc > 1 && sqlite3_value_type( argv[1] ) != SQLITE_NULL )
+            json = EventBlob::json( blob, std::string_view( (const char *) sqlite3_value_text( argv[1] ), sqlite3_value_bytes( argv[1] ) ) );
+        else
+            json = EventBlob::json( blob );
+
+        sqlite3_result_text( context, json.data(), json.length(), SQLITE_TRANSIENT );
+    }
+
+    std::string jsonOf( std::string_view blob, const std::string_view * filename )
+    {
+        std::vector< std::pair< uint32_t, EventBlob::Value > > fields;
+        uint32_t tag;
+        EventBlob::Value value;
+
+        while ( readField( blob, tag, value ) )
+            fields.emplace_back( tag, value );
+
+        std::string out = "{";
+
+        for ( size_t i = 0; i < fields.size(); )
+        {
+            size_t end = i + 1;
+
+            while ( end < fields.size() && fields[ end ].first == fields[i].first )
+                end++;
+
+            if ( i > 0 )
+                out += ',';
+
+            appendJsonString( out, fields[i].first < TagCount ? tagNames[ fields[i].first ] : std::to_string( fields[i].first ) );
+            out += ':';
+
+            if ( end - i > 1 )
+                out += '[';
+
+            for ( size_t j = i; j < end; j++ )
+            {
+                if ( j > i )
+                    out += ',';
+
+                appendJsonValue( out, fields[j].second, filename );
+            }
+
+            if ( end - i > 1 )
+                out += ']';
+
+            i = end;
+        }
+
+        out += '}';
+        return out;
+    }
+}
+
+void EventBlob::encode( const EndpointSecurity::Event& event, std::string& out )
+{
+    out.clear();
+    Writer w( event, out );
+
+    // The executable is in the Executables table
+    w.signedField( Pid, event.process_pid );
+    w.signedField( Ppid, event.process_ppid );
+    w.signedField( Oppid, event.process_oppid );
+    w.signedField( Euid, event.process_euid );
+    w.signedField( Ruid, event.process_ruid );
+    w.signedField( Egid, event.process_egid );
+    w.signedField( Rgid, event.process_rgid );
+    w.signedField( Gid, event.process_gid );
+    w.signedField( Sid, event.process_sid );
+    w.unsignedField( Csflags, event.process_csflags );
+    w.flag( IsPlatformBinary, event.process_is_platform_binary );
+    w.flag( IsEsClient, event.process_is_es_client );
+    w.string( SigningId, event.process_signing_id );
+    w.string( TeamId, event.process_team_id );
+    w.unsignedField( ThreadId, event.process_thread_id );
+    w.signedField( StartTime, event.process_start_time_s );
+    w.flag( IsAuthentication, event.is_authentication );
+
+    if ( event.is_authentication )
+        w.signedField( AuthSlackNs, event.auth_slack_ns );
+
+    const Payload& payload = event.payload;
+
+    switch ( payload.type )
+    {
+        case Payload::None:
+            break;
+
+        case Payload::Access:
+            w.string( Target, payload.access.target );
+            w.signedField( Mode, payload.access.mode );
+            break;
+
+        case Payload::File:
+            w.string( Target, payload.file.target );
+            break;
+
+        case Payload::Readlink:
+            w.string( Source, payload.readlink.source );
+            break;
+
+        case Payload::Clone:
+            w.string( Source, payload.clone.source );
+            w.string( TargetDir, payload.clone.target_dir );
+            w.string( TargetName, payload.clone.target_name );
+            break;
+
+        case Payload::Close:
+            w.string( Target, payload.close.target );
+            w.flag( Modified, payload.close.modified );
+            break;
+
+        case Payload::Create:
+            w.flag( ExistingFile, payload.create.existing_file );
+
+            if ( payload.create.existing_file )
+                w.string( Filename, payload.create.filename );
+            else
+            {
+                w.string( TargetDir, payload.create.target_dir );
+                w.string( TargetName, payload.create.target_name );
+                w.unsignedField( Mode, payload.create.mode );
+            }
+            break;
+
+        case Payload::Extattr:
+            w.string( Target, payload.extattr.target );
+            w.string( Extattr, payload.extattr.extattr );
+            break;
+
+        case Payload::Exchangedata:
+            w.string( File1, payload.exchangedata.file1 );
+            w.string( File2, payload.exchangedata.file2 );
+            break;
+
+        case Payload::Exec:
+            w.process( Target, payload.exec.target );
+
+            // The separate arguments if they were kept, the quoted ones otherwise
+            if ( payload.exec.argv.empty() )
+                w.string( Args, payload.exec.args );
+
+            for ( const EndpointSecurity::EventString& arg : payload.exec.argv )
+                w.string( Argv, arg );
+            break;
+
+        case Payload::Exit:
+            w.signedField( Stat, payload.exit.stat );
+            break;
+
+        case Payload::Fcntl:
+            w.string( Target, payload.fcntl.target );
+            w.signedField( Cmd, payload.fcntl.cmd );
+            break;
+
+        case Payload::FileProviderMaterialize:
+            w.process( Instigator, payload.file_provider_materialize.instigator );
+            w.string( Source, payload.file_provider_materialize.source );
+            w.string( Target, payload.file_provider_materialize.target );
+            break;
+
+        case Payload::FileProviderUpdate:
+            w.string( Source, payload.file_provider_update.source );
+            w.string( TargetPath, payload.file_provider_update.target_path );
+            break;
+
+        case Payload::Fork:
+            w.process( Child, payload.fork.child );
+            break;
+
+        case Payload::Attrlist:
+            w.string( Target, payload.attrlist.target );
+            w.unsignedField( Commonattr, payload.attrlist.attrlist.commonattr );
+            w.unsignedField( Volattr, payload.attrlist.attrlist.volattr );
+            w.unsignedField( Dirattr, payload.attrlist.attrlist.dirattr );
+            w.unsignedField( Fileattr, payload.attrlist.attrlist.fileattr );
+            w.unsignedField( Forkattr, payload.attrlist.attrlist.forkattr );
+            break;
+
+        case Payload::GetTask:
+            w.process( Target, payload.get_task.target );
+            break;
+
+        case Payload::IokitOpen:
+            w.string( UserClientClass, payload.iokit_open.user_client_class );
+            w.unsignedField( UserClientType, payload.iokit_open.user_client_type );
+            break;
+
+        case Payload::Kext:
+            w.string( Identifier, payload.kext.identifier );
+            break;
+
+        case Payload::Link:
+            w.string( Source, payload.link.source );
+            w.string( TargetDir, payload.link.target_dir );
+            w.string( TargetFilename, payload.link.target_filename );
+            break;
+
+        case Payload::Lookup:
+            w.string( SourceDir, payload.lookup.source_dir );
+            w.string( RelativeTarget, payload.lookup.relative_target );
+            break;
+
+        case Payload::Mmap:
+            w.string( Source, payload.mmap.source );
+            w.unsignedField( FilePos, payload.mmap.file_pos );
+            w.signedField( Flags, payload.mmap.flags );
+            w.signedField( MaxProtection, payload.mmap.max_protection );
+            w.signedField( Protection, payload.mmap.protection );
+            break;
+
+        case Payload::Mount:
+            w.string( Mntfromname, payload.mount.mntfromname );
+            w.string( Mntonname, payload.mount.mntonname );
+            break;
+
+        case Payload::Mprotect:
+            w.unsignedField( Address, payload.mprotect.address );
+            w.unsignedField( Size, payload.mprotect.size );
+            w.signedField( Protection, payload.mprotect.protection );
+            break;
+
+        case Payload::Open:
+            w.string( Filename, payload.open.filename );
+            w.signedField( Fflag, payload.open.fflag );
+            break;
+
+        case Payload::ProcCheck:
+            w.signedField( Flavor, payload.proc_check.flavor );
+
+            if ( payload.proc_check.target.pid != -1 )
+                w.process( Target, payload.proc_check.target );
+
+            w.signedField( TypeField, payload.proc_check.type );
+            break;
+
+        case Payload::Pty:
+            w.signedField( Dev, payload.pty.dev );
+            break;
+
+        case Payload::Rename:
+            w.flag( ExistingFile, payload.rename.existing_file );
+            w.string( Filename, payload.rename.filename );
+            w.string( Dir, payload.rename.dir );
+            break;
+
+        case Payload::Setflags:
+            w.string( Target, payload.setflags.target );
+            w.unsignedField( Flags, payload.setflags.flags );
+            break;
+
+        case Payload::Setmode:
+            w.string( Target, payload.setmode.target );
+            w.signedField( Mode, payload.setmode.mode );
+            break;
+
+        case Payload::Setowner:
+            w.string( Target, payload.setowner.target );
+            w.signedField( Uid, payload.setowner.uid );
+            w.signedField( Gid, payload.setowner.gid );
+            break;
+
+        case Payload::Signal:
+            w.process( Target, payload.signal.target );
+            w.unsignedField( Sig, payload.signal.sig );
+            break;
+
+        case Payload::UipcBind:
+            w.string( Dir, payload.uipc_bind.dir );
+            w.string( Filename, payload.uipc_bind.filename );
+            w.unsignedField( Mode, payload.uipc_bind.mode );
+            break;
+
+        case Payload::UipcConnect:
+            w.string( File, payload.uipc_connect.file );
+            w.signedField( Domain, payload.uipc_connect.domain );
+            w.signedField( TypeField, payload.uipc_connect.type );
+            w.signedField( Protocol, payload.uipc_connect.protocol );
+            break;
+
+        case Payload::Utimes:
+            w.string( Target, payload.utimes.target );
+            w.signedField( Mtime, (int64_t) payload.utimes.mtime.tv_sec * 1000000000 + payload.utimes.mtime.tv_nsec );
+            w.signedField( Atime, (int64_t) payload.utimes.atime.tv_sec * 1000000000 + payload.utimes.atime.tv_nsec );
+            break;
+    }
+}
+
+bool EventBlob::field( std::string_view blob, std::string_view path, Value& value )
+{
+    std::string_view name = path.substr( 0, path.find( '.' ) );
+    std::string_view rest = name.length() < path.length() ? path.substr( name.length() + 1 ) : std::string_view();
+    uint32_t wanted = tagOf( name );
+    uint32_t tag;
+
+    // The index of a repeated field, if the rest is a number
+    unsigned long index = 0;
+
+    if ( !rest.empty() && isdigit( (unsigned char) rest.front() ) )
+    {
+        index = strtoul( std::string( rest ).c_str(), nullptr, 10 );
+        rest = std::string_view();
+    }
+
+    if ( wanted == 0 )
+        return false;
+
+    while ( readField( blob, tag, value ) )
+    {
+        if ( tag != wanted || index-- > 0 )
+            continue;
+
+        if ( rest.empty() )
+            return true;
+
+        return value.type == Process && field( value.bytes, rest, value );
+    }
+
+    return false;
+}
+
+std::string EventBlob::json( std::string_view blob )
+{
+    return jsonOf( blob, nullptr );
+}
+
+std::string EventBlob::json( std::string_view blob, std::string_view filename )
+{
+    return jsonOf( blob, &filename );
+}
+
+void EventBlob::appendVarint( std::string& out, uint64_t value )
+{
+    while ( value >= 0x80 )
+    {
+        out += (char) ( value | 0x80 );
+        value >>= 7;
+    }
+
+    out += (char) value;
+}
+
+bool EventBlob::readVarint( std::string_view& in, uint64_t& value )
+{
+    value = 0;
+
+    for ( unsigned int shift = 0; shift < 64 && !in.empty(); shift += 7 )
+    {
+        uint8_t byte = in.front();
+        in.remove_prefix( 1 );
+        value |= (uint64_t) ( byte & 0x7F ) << shift;
+
+        if ( ( byte & 0x80 ) == 0 )
+            return true;
+    }
+
+    return false;
+}
+
+bool EventBlob::registerFunctions( sqlite3 * db )
+{
+    return sqlite3_create_function( db, "event_field", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, eventField, nullptr, nullptr ) == SQLITE_OK
+        && sqlite3_create_function( db, "event_field", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, eventField, nullptr, nullptr ) == SQLITE_OK
+        && sqlite3_create_function( db, "event_detail", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, eventDetail, nullptr, nullptr ) == SQLITE_OK
+        && sqlite3_create_function( db, "event_detail", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, eventDetail, nullptr, nullptr ) == SQLITE_OK;
+}
@@ -0,0 +1,58 @@
+#ifndef EVENTBLOB_H
+#define EVENTBLOB_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+#include "EndpointSecurity.h"
+#include "sqlite3.h"
+
+//
+// The event details which have no Logs column, as a compact blob: the process fields and the typed payload.
+// Each field is a varint key, the field tag shifted left by two with the wire type in the low bits, followed by the
+// value: a varint, a zigzag varint for the signed values, or a varint length and the bytes of a string or of a nested
+// process. The repeated fields, such as argv, follow each other with the same tag. The empty strings and the false flags
+// are left out. A string equal to the event filename, which is in the Filename column already, is written as an empty
+// one, and read back as SameAsFilename.
+//
+// The field names are those of Event::parameters(), with the process of the exec, fork, signal and other events
+// nested under target, child or instigator instead of the prefixes, i.e. "target.pid".
+//
+class EventBlob
+{
+    public:
+        // Encodes the event into the string, reusing its capacity
+        static void encode( const EndpointSecurity::Event& event, std::string& out );
+
+        // A field found by field(). SameAsFilename is not a wire type: it is a String which is the event filename.
+        enum Type { Unsigned, Signed, String, Process, SameAsFilename };
+
+        struct Value
+        {
+            Type                type;
+            uint64_t            number;     // Unsigned; Signed as int64_t
+            std::string_view    bytes;      // String, or the encoded Process
+        };
+
+        // Finds the field by its path: the names of the nested fields separated by dots, and the index of a repeated
+        // field, i.e. "target.signing_id" or "argv.1". Returns false if there is no such field.
+        static bool field( std::string_view blob, std::string_view path, Value& value );
+
+        // The whole blob as a JSON object, the repeated fields as arrays. The fields which are the event filename are
+        // null, unless the filename is given.
+        static std::string json( std::string_view blob );
+        static std::string json( std::string_view blob, std::string_view filename );
+
+        // The unsigned varints of the blob, for the other formats built around it. readVarint() takes the varint
+        // off the front of the bytes, and returns false if they end before it does.
+        static void appendVarint( std::string& out, uint64_t value );
+        static bool readVarint( std::string_view& in, uint64_t& value );
+
+        // Registers event_field(Detail, path[, Filename]), returning the field as an integer or text (a process as its
+        // JSON), or NULL if it is not there, and event_detail(Detail[, Filename]), returning the JSON. A field which is
+        // the event filename is NULL, or null in the JSON, unless the Filename column is passed as well.
+        static bool registerFunctions( sqlite3 * db );
+};
+
+#endif // EVENTBLOB_H
@@ -0,0 +1,139 @@
+#ifndef EVENTRING_H
+#define EVENTRING_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Bounded lock-free queue with many producers and a single consumer. Each cell has a sequence number which tells
+// whether it is free for the producer at this position, or holds the item for the consumer (see D. Vyukov's bounded
+// MPMC queue). push() never blocks and never allocates: when the queue is full it fails, and the overflow is counted.
+//
+template< typename T > class EventRing
+{
+    public:
+        // The capacity is rounded up to the power of two
+        explicit EventRing( size_t capacity )
+        {
+            size_t size = 1;
+
+            while ( size < capacity )
+                size <<= 1;
+
+            cells.reset( new Cell[ size ] );
+            mask = size - 1;
+
+            for ( size_t i = 0; i < size; i++ )
+                cells[i].sequence.store( i, std::memory_order_relaxed );
+
+            head.store( 0, std::memory_order_relaxed );
+            tail.store( 0, std::memory_order_relaxed );
+            highWater.store( 0, std::memory_order_relaxed );
+            overflows.store( 0, std::memory_order_relaxed );
+        }
+
+        EventRing( const EventRing& ) = delete;
+        EventRing& operator=( const EventRing& ) = delete;
+
+        // Could be called from any thread. Returns false and leaves the item intact if the queue is full;
+        // that is counted as overflow unless the caller is going to retry.
+        bool push( T&& item, bool countOverflow = true )
+        {
+            Cell * cell;
+            size_t pos = head.load( std::memory_order_relaxed );
+
+            while ( true )
+            {
+                cell = &cells[ pos & mask ];
+                intptr_t diff = (intptr_t) cell->sequence.load( std::memory_order_acquire ) - (intptr_t) pos;
+
+                if ( diff == 0 )
+                {
+                    if ( head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                        break;
+                }
+                else if ( diff < 0 )
+                {
+                    // The consumer has not taken the item from this cell yet
+                    if ( countOverflow )
+                        overflows.fetch_add( 1, std::memory_order_relaxed );
+
+                    return false;
+                }
+                else
+                    pos = head.load( std::memory_order_relaxed );
+            }
+
+            cell->item = std::move( item );
+            cell->sequence.store( pos + 1, std::memory_order_release );
+
+            // Depth including this item; the consumer might have taken some meanwhile, which only makes it lower
+            size_t depth = pos + 1 - tail.load( std::memory_order_relaxed );
+            size_t high = highWater.load( std::memory_order_relaxed );
+
+            while ( depth > high && !highWater.compare_exchange_weak( high, depth, std::memory_order_relaxed ) )
+                ;
+
+            return true;
+        }
+
+        // Must only be called from the consumer thread. Returns false if the queue is empty.
+        bool pop( T& item )
+        {
+            size_t pos = tail.load( std::memory_order_relaxed );
+            Cell * cell = &cells[ pos & mask ];
+
+            if ( cell->sequence.load( std::memory_order_acquire ) != pos + 1 )
+                return false;
+
+            item = std::move( cell->item );
+            cell->sequence.store( pos + mask + 1, std::memory_order_release );
+            tail.store( pos + 1, std::memory_order_release );
+            return true;
+        }
+
+        size_t capacity() const
+        {
+            return mask + 1;
+        }
+
+        // The number of queued items. It is approximate while the producers are pushing.
+        size_t depth() const
+        {
+            size_t t = tail.load( std::memory_order_acquire );
+            size_t h = head.load( std::memory_order_acquire );
+            return h > t ? h - t : 0;
+        }
+
+        // The highest depth seen so far
+        size_t highWaterMark() const
+        {
+            return highWater.load( std::memory_order_relaxed );
+        }
+
+        // The number of items which were not queued because the queue was full
+        uint64_t overflowCount() const
+        {
+            return overflows.load( std::memory_order_relaxed );
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic< size_t >   sequence;
+            T                       item;
+        };
+
+        std::unique_ptr< Cell[] >   cells;
+        size_t                      mask;
+
+        // The producers and the consumer positions are on separate cache lines
+        alignas(64) std::atomic< size_t >   head;
+        alignas(64) std::atomic< size_t >   tail;
+        alignas(64) std::atomic< size_t >   highWater;
+        std::atomic< uint64_t >             overflows;
+};
+
+#endif // EVENTRING_H
@@ -0,0 +1,124 @@
+#include <algorithm>
+
+#include "EventShards.h"
+
+typedef EndpointSecurity::EventId EventId;
+
+unsigned int expectedEventVolume( es_event_type_t type )
+{
+    // Rough shares measured on a developer machine during a build; only the order of magnitude matters
+    switch ( EndpointSecurity::describeEvent( type ).id )
+    {
+        case EventId::Open:
+        case EventId::Close:
+            return 100;
+
+        case EventId::Stat:
+        case EventId::Lookup:
+            return 80;
+
+        case EventId::Getattrlist:
+        case EventId::Write:
+            return 50;
+
+        case EventId::Access:
+        case EventId::Readlink:
+        case EventId::Mmap:
+        case EventId::Fsgetpath:
+        case EventId::Getextattr:
+        case EventId::Readdir:
+            return 30;
+
+        case EventId::Fcntl:
+        case EventId::Dup:
+        case EventId::Listextattr:
+        case EventId::Mprotect:
+        case EventId::ProcCheck:
+        case EventId::Create:
+        case EventId::Unlink:
+        case EventId::Truncate:
+        case EventId::Setattrlist:
+        case EventId::Rename:
+            return 10;
+
+        default:
+            return 1;
+    }
+}
+
+bool isLowLatencyEvent( es_event_type_t type )
+{
+    const EndpointSecurity::EventDescriptor& descriptor = EndpointSecurity::describeEvent( type );
+
+    if ( descriptor.is_auth )
+        return true;
+
+    switch ( descriptor.id )
+    {
+        case EventId::Exec:
+        case EventId::Fork:
+        case EventId::Exit:
+        case EventId::Signal:
+        case EventId::GetTask:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+std::vector< EventShard > shardSubscriptions( const std::vector< es_event_type_t >& subscriptions, unsigned int clients )
+{
+    EventShard lowLatency, bulk;
+
+    for ( es_event_type_t type : subscriptions )
+    {
+        // The subscriptions could list a type twice, as with "-e all,open"
+        if ( std::find( lowLatency.begin(), lowLatency.end(), type ) != lowLatency.end()
+            || std::find( bulk.begin(), bulk.end(), type ) != bulk.end() )
+            continue;
+
+        if ( isLowLatencyEvent( type ) )
+            lowLatency.push_back( type );
+        else
+            bulk.push_back( type );
+    }
+
+    std::vector< EventShard > shards;
+
+    // A single client gets everything
+    if ( clients <= 1 )
+    {
+        lowLatency.insert( lowLatency.end(), bulk.begin(), bulk.end() );
+
+        if ( !lowLatency.empty() )
+            shards.push_back( lowLatency );
+
+        return shards;
+    }
+
+    if ( !lowLatency.empty() )
+    {
+        shards.push_back( lowLatency );
+        clients--;
+    }
+
+    // The largest types first, each to the shard with the least volume so far
+    std::stable_sort( bulk.begin(), bulk.end(), []( es_event_type_t a, es_event_type_t b )
+    {
+        return expectedEventVolume( a ) > expectedEventVolume( b );
+    });
+
+    std::vector< EventShard > bulkShards( std::min< size_t >( clients, bulk.size() ) );
+    std::vector< unsigned int > volumes( bulkShards.size(), 0 );
+
+    for ( es_event_type_t type : bulk )
+    {
+        size_t lightest = std::min_element( volumes.begin(), volumes.end() ) - volumes.begin();
+        bulkShards[ lightest ].push_back( type );
+        volumes[ lightest ] += expectedEventVolume( type );
+    }
+
+    shards.insert( shards.end(), bulkShards.begin(), bulkShards.end() );
+    return shards;
+}
@@ -0,0 +1,25 @@
+#ifndef EVENTSHARDS_H
+#define EVENTSHARDS_H
+
+#include <vector>
+
+#include "EndpointSecurity.h"
+
+//
+// Splits the subscriptions between several clients, so each event type is delivered to one client only.
+// The auth and the process lifecycle events go to the first client, which is kept free of the file traffic so its
+// responses are not delayed. The other types are spread over the remaining clients by their expected volume.
+//
+typedef std::vector< es_event_type_t > EventShard;
+
+// The relative volume of the event type on a typical machine, for balancing the shards
+unsigned int expectedEventVolume( es_event_type_t type );
+
+// Whether the type belongs to the low-latency client: the auth events, exec, fork, exit, signal and get_task
+bool isLowLatencyEvent( es_event_type_t type );
+
+// The subscriptions of each client, at most the given number of them. Empty shards are not returned,
+// so there could be fewer shards than clients.
+std::vector< EventShard > shardSubscriptions( const std::vector< es_event_type_t >& subscriptions, unsigned int clients );
+
+#endif // EVENTSHARDS_H
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <chrono>
+
+#include "EventWriter.h"
+
+// How many events the writer takes from one queue before it looks at the next one
+static const size_t DRAIN_BATCH = 64;
+
+EventWriter::EventWriter( size_t capacity, Sink sink, unsigned int queues, Idle idle )
+    : sink( sink ), idle( idle ), stopping( false ), deadline( std::chrono::steady_clock::time_point::max() ), sleeping( false )
+{
+    for ( unsigned int i = 0; i < std::max( queues, 1u ); i++ )
+        queueList.emplace_back( new Queue( capacity ) );
+
+    thread = std::thread( &EventWriter::run, this );
+}
+
+EventWriter::~EventWriter()
+{
+    stop();
+}
+
+bool EventWriter::push( EndpointSecurity::EventHandle&& event, unsigned int queue, bool wait )
+{
+    EventRing< EndpointSecurity::EventHandle >& ring = queueList[ queue ]->ring;
+    
+    while ( !ring.push( std::move( event ), !wait ) )
+    {
+        if ( !wait )
+        {
+            event.release();
+            return false;
+        }
+        
+        // The writer is not sleeping while its queue is full
+        std::this_thread::yield();
+    }
+
+    if ( sleeping.load( std::memory_order_acquire ) )
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        wakeup.notify_one();
+    }
+
+    return true;
+}
+
+void EventWriter::stop()
+{
+    stopBefore( std::chrono::steady_clock::time_point::max() );
+}
+
+void EventWriter::stop( std::chrono::milliseconds timeout )
+{
+    stopBefore( std::chrono::steady_clock::now() + timeout );
+}
+
+void EventWriter::requestStop( std::chrono::steady_clock::time_point deadline )
+{
+    std::lock_guard< std::mutex > lock( mutex );
+    this->deadline = std::min( this->deadline, deadline );
+    stopping = true;
+    wakeup.notify_one();
+}
+
+void EventWriter::stopBefore( std::chrono::steady_clock::time_point deadline )
+{
+    if ( !thread.joinable() )
+        return;
+
+    requestStop( deadline );
+    thread.join();
+}
+
+unsigned int EventWriter::queues() const
+{
+    return queueList.size();
+}
+
+EventWriter::Stats EventWriter::stats() const
+{
+    Stats total = {};
+
+    for ( unsigned int i = 0; i < queueList.size(); i++ )
+    {
+        Stats stats = this->stats( i );
+        total.capacity += stats.capacity;
+        total.depth += stats.depth;
+        total.high_water = std::max( total.high_water, stats.high_water );
+        total.overflows += stats.overflows;
+        total.written += stats.written;
+        total.discarded += stats.discarded;
+    }
+
+    return total;
+}
+
+EventWriter::Stats EventWriter::stats( unsigned int queue ) const
+{
+    const Queue& q = *queueList[ queue ];
+
+    Stats stats;
+    stats.capacity = q.ring.capacity();
+    stats.depth = q.ring.depth();
+    stats.high_water = q.ring.highWaterMark();
+    stats.overflows = q.ring.overflowCount();
+    stats.written = q.written;
+    stats.discarded = q.discarded;
+    return stats;
+}
+
+size_t EventWriter::drain( Queue& queue, size_t limit )
+{
+    EndpointSecurity::EventHandle event;
+    size_t count = 0;
+
+    while ( count < limit && queue.ring.pop( event ) )
+    {
+        sink( *event );
+        event.release();
+        count++;
+    }
+
+    queue.written += count;
+    return count;
+}
+
+void EventWriter::run()
+{
+    while ( true )
+    {
+        // In turns, so a busy queue does not hold back the others. Once stopping, the deadline applies below.
+        size_t drained;
+
+        do
+        {
+            drained = 0;
+
+            for ( auto& queue : queueList )
+                drained += drain( *queue, DRAIN_BATCH );
+        }
+        while ( drained > 0 && !stopping.load( std::memory_order_acquire ) );
+
+        if ( idle )
+            idle();
+
+        std::unique_lock< std::mutex > lock( mutex );
+
+        if ( stopping )
+        {
+            // The producers have stopped, but could have queued something after the loop above.
+            // Whatever is not written by the deadline is dropped, so stopping takes a bounded time.
+            lock.unlock();
+
+            do
+            {
+                drained = 0;
+
+                for ( auto& queue : queueList )
+                    drained += drain( *queue, DRAIN_BATCH );
+            }
+            while ( drained > 0 && std::chrono::steady_clock::now() < deadline );
+
+            EndpointSecurity::EventHandle event;
+
+            for ( auto& queue : queueList )
+            {
+                while ( queue->ring.pop( event ) )
+                {
+                    event.release();
+                    queue->discarded++;
+                }
+            }
+
+            return;
+        }
+
+        // Check once more after announcing the sleep, so an event pushed meanwhile is not missed.
+        // The timeout covers a producer which checked the flag just before it was set.
+        sleeping = true;
+
+        if ( stats().depth == 0 )
+            wakeup.wait_for( lock, std::chrono::milliseconds( 10 ) );
+
+        sleeping = false;
+    }
+}
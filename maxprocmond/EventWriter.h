@@ -0,0 +1,94 @@
+#ifndef EVENTWRITER_H
+#define EVENTWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "EndpointSecurity.h"
+#include "EventRing.h"
+
+//
+// Moves the sink work off the Endpoint Security threads. The client threads only queue the events they took from the
+// pool, and the writer thread passes them to the sink and releases them. The sink is therefore only called from one thread.
+// There could be several queues, one per client, so the clients never contend on a queue; the writer takes from them in turn.
+//
+class EventWriter
+{
+    public:
+        typedef std::function<void(const EndpointSecurity::Event&)> Sink;
+        
+        // Called on the writer thread when the queues are empty, at least every 10 ms while they stay so
+        typedef std::function<void()> Idle;
+
+        struct Stats
+        {
+            size_t      capacity;
+            size_t      depth;          // currently queued
+            size_t      high_water;     // the highest depth so far
+            uint64_t    overflows;      // events dropped because the queue was full
+            uint64_t    written;        // events passed to the sink
+            uint64_t    discarded;      // events still queued when stop() ran out of time
+        };
+
+        // Each of the queues holds the given number of events
+        EventWriter( size_t capacity, Sink sink, unsigned int queues = 1, Idle idle = nullptr );
+
+        // Stops the writer thread after it writes the queued events
+        ~EventWriter();
+
+        // Queues the event to the given queue. If the queue is full the event is released and counted as overflow,
+        // and false is returned, unless wait is set: then it waits for the writer to make room. Could be called from any thread.
+        bool    push( EndpointSecurity::EventHandle&& event, unsigned int queue = 0, bool wait = false );
+
+        // Writes the queued events and stops the writer thread. push() must not be called after that.
+        void    stop();
+        
+        // As above, but the events not written within the timeout are released and counted as discarded
+        void    stop( std::chrono::milliseconds timeout );
+
+        // Tells the writer thread to stop by the deadline, as above, without waiting for it; stop() then waits.
+        // This way several writers drain at once.
+        void    requestStop( std::chrono::steady_clock::time_point deadline );
+
+        unsigned int queues() const;
+
+        // The totals of all queues (high_water is the highest of them), and of one queue
+        Stats   stats() const;
+        Stats   stats( unsigned int queue ) const;
+
+    private:
+        struct Queue
+        {
+            explicit Queue( size_t capacity ) : ring( capacity ), written( 0 ), discarded( 0 ) {}
+
+            EventRing< EndpointSecurity::EventHandle > ring;
+            std::atomic< uint64_t > written;
+            std::atomic< uint64_t > discarded;
+        };
+
+        void    run();
+        
+        void    stopBefore( std::chrono::steady_clock::time_point deadline );
+
+        // Passes up to the given number of events from the queue to the sink, returns how many
+        size_t  drain( Queue& queue, size_t limit );
+
+        std::vector< std::unique_ptr< Queue > > queueList;
+        Sink                    sink;
+        Idle                    idle;
+        std::thread             thread;
+        std::atomic< bool >     stopping;
+        std::chrono::steady_clock::time_point deadline;     // for writing the rest after stopping
+
+        // The writer sleeps on it when the queue is empty. The producers only take the mutex if the writer is sleeping.
+        std::mutex              mutex;
+        std::condition_variable wakeup;
+        std::atomic< bool >     sleeping;
+};
+
+#endif // EVENTWRITER_H
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <mach/mach_time.h>
+
+#include "LatencyHistograms.h"
+
+namespace
+{
+    const size_t TOTAL_BUCKETS = LatencyHistograms::IntervalCount * LatencyHistograms::EVENTS * LatencyHistograms::BUCKETS;
+
+    // One thread's buckets. Only the owning thread writes them, so the increments need no atomic read-modify-write;
+    // the atomics only make the reads from the merge well-defined. merged is what the merge took of them so far.
+    struct ThreadBuckets
+    {
+        ThreadBuckets()
+        {
+            for ( size_t i = 0; i < TOTAL_BUCKETS; i++ )
+            {
+                counts[i].store( 0, std::memory_order_relaxed );
+                merged[i] = 0;
+            }
+        }
+
+        std::atomic< uint64_t > counts[ TOTAL_BUCKETS ];
+        uint64_t                merged[ TOTAL_BUCKETS ];
+    };
+
+    // The buckets of the live threads, and the merged counts of all threads, the finished ones included.
+    // All guarded by the mutex.
+    std::mutex& registryMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    std::vector< ThreadBuckets * >& registry()
+    {
+        static std::vector< ThreadBuckets * > buckets;
+        return buckets;
+    }
+
+    std::vector< uint64_t >& mergedCounts()
+    {
+        static std::vector< uint64_t > counts( TOTAL_BUCKETS );
+        return counts;
+    }
+
+    // Adds what the thread recorded since the last merge
+    void mergeLocked( ThreadBuckets * buckets )
+    {
+        std::vector< uint64_t >& merged = mergedCounts();
+
+        for ( size_t i = 0; i < TOTAL_BUCKETS; i++ )
+        {
+            uint64_t count = buckets->counts[i].load( std::memory_order_relaxed );
+            merged[i] += count - buckets->merged[i];
+            buckets->merged[i] = count;
+        }
+    }
+
+    // Owns the buckets of the thread; when the thread exits, merges the rest of them and frees them
+    struct ThreadBucketsOwner
+    {
+        ThreadBuckets * buckets = nullptr;
+
+        ~ThreadBucketsOwner()
+        {
+            if ( !buckets )
+                return;
+
+            {
+                std::lock_guard< std::mutex > lock( registryMutex() );
+                mergeLocked( buckets );
+
+                std::vector< ThreadBuckets * >& live = registry();
+                live.erase( std::find( live.begin(), live.end(), buckets ) );
+            }
+
+            delete buckets;
+        }
+    };
+
+    ThreadBuckets * threadBuckets()
+    {
+        static thread_local ThreadBucketsOwner owner;
+
+        if ( !owner.buckets )
+        {
+            owner.buckets = new ThreadBuckets();
+
+            std::lock_guard< std::mutex > lock( registryMutex() );
+            registry().push_back( owner.buckets );
+        }
+
+        return owner.buckets;
+    }
+
+    const struct
+    {
+        const char *    name;
+        double          fraction;
+    } percentiles[] =
+    {
+        { "p50", 0.5 },
+        { "p90", 0.9 },
+        { "p99", 0.99 },
+        { "p99.9", 0.999 },
+        { "max", 1.0 },
+    };
+
+    const char * eventName( unsigned int id )
+    {
+        const char * name = EndpointSecurity::eventName( (EndpointSecurity::EventId) id );
+        return name ? name : "unknown";
+    }
+}
+
+void LatencyHistograms::record( Interval interval, EndpointSecurity::EventId id, uint64_t ns )
+{
+    if ( (unsigned int) id >= EVENTS )
+        id = EndpointSecurity::EventId::Unknown;
+
+    std::atomic< uint64_t >& counter = threadBuckets()->counts[ index( interval, id, bucketOf( ns ) ) ];
+    counter.store( counter.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+}
+
+void LatencyHistograms::recordSince( Interval interval, EndpointSecurity::EventId id, uint64_t start, uint64_t end )
+{
+    static mach_timebase_info_data_t timebase = []
+    {
+        mach_timebase_info_data_t tb;
+        mach_timebase_info( &tb );
+        return tb;
+    }();
+
+    if ( start == 0 )
+        return;
+
+    uint64_t ticks = end > start ? end - start : 0;
+    record( interval, id, ticks * timebase.numer / timebase.denom );
+}
+
+void LatencyHistograms::merge()
+{
+    std::lock_guard< std::mutex > lock( registryMutex() );
+
+    for ( ThreadBuckets * buckets : registry() )
+        mergeLocked( buckets );
+}
+
+LatencyHistograms::Snapshot LatencyHistograms::snapshot()
+{
+    Snapshot snap;
+    std::lock_guard< std::mutex > lock( registryMutex() );
+
+    for ( ThreadBuckets * buckets : registry() )
+        mergeLocked( buckets );
+
+    snap.counts = mergedCounts();
+    return snap;
+}
+
+unsigned int LatencyHistograms::bucketOf( uint64_t ns )
+{
+    if ( ns < SUB_BUCKETS )
+        return ns;
+
+    unsigned int exponent = 63 - __builtin_clzll( ns );
+
+    if ( exponent > MAX_EXPONENT )
+        return BUCKETS - 1;
+
+    unsigned int sub = ( ns >> ( exponent - SUB_BUCKET_BITS ) ) & ( SUB_BUCKETS - 1 );
+    return ( exponent - SUB_BUCKET_BITS + 1 ) * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistograms::bucketLow( unsigned int bucket )
+{
+    if ( bucket < SUB_BUCKETS )
+        return bucket;
+
+    unsigned int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    return (uint64_t) ( SUB_BUCKETS + bucket % SUB_BUCKETS ) << ( exponent - SUB_BUCKET_BITS );
+}
+
+uint64_t LatencyHistograms::bucketHigh( unsigned int bucket )
+{
+    if ( bucket < SUB_BUCKETS )
+        return bucket;
+
+    unsigned int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    return bucketLow( bucket ) + ( (uint64_t) 1 << ( exponent - SUB_BUCKET_BITS ) ) - 1;
+}
+
+const char * LatencyHistograms::intervalName( Interval interval )
+{
+    switch ( interval )
+    {
+        case Delivery:
+            return "delivery";
+
+        case Response:
+            return "response";
+
+        case Persist:
+            return "persist";
+
+        default:
+            return "unknown";
+    }
+}
+
+uint64_t LatencyHistograms::Snapshot::total( Interval interval, EndpointSecurity::EventId id ) const
+{
+    uint64_t total = 0;
+
+    for ( unsigned int b = 0; b < BUCKETS; b++ )
+        total += count( interval, id, b );
+
+    return total;
+}
+
+uint64_t LatencyHistograms::Snapshot::percentile( Interval interval, EndpointSecurity::EventId id, double fraction ) const
+{
+    uint64_t total = this->total( interval, id );
+    uint64_t seen = 0;
+
+    if ( total == 0 )
+        return 0;
+
+    for ( unsigned int b = 0; b < BUCKETS; b++ )
+    {
+        seen += count( interval, id, b );
+
+        if ( seen >= fraction * total )
+            return bucketHigh( b );
+    }
+
+    return bucketHigh( BUCKETS - 1 );
+}
+
+std::string LatencyHistograms::Snapshot::text() const
+{
+    std::ostringstream out;
+
+    for ( unsigned int i = 0; i < IntervalCount; i++ )
+    {
+        out << intervalName( (Interval) i ) << " latency, ns:\n";
+
+        for ( unsigned int id = 0; id < EVENTS; id++ )
+        {
+            uint64_t total = this->total( (Interval) i, (EndpointSecurity::EventId) id );
+
+            if ( total == 0 )
+                continue;
+
+            out << "  " << eventName( id ) << ": count " << total;
+
+            for ( auto& p : percentiles )
+                out << ", " << p.name << " " << percentile( (Interval) i, (EndpointSecurity::EventId) id, p.fraction );
+
+            out << "\n";
+        }
+    }
+
+    return out.str();
+}
+
+std::string LatencyHistograms::Snapshot::json() const
+{
+    std::ostringstream out;
+    out << "{";
+
+    for ( unsigned int i = 0; i < IntervalCount; i++ )
+    {
+        bool firstEvent = true;
+        out << ( i > 0 ? "," : "" ) << "\"" << intervalName( (Interval) i ) << "\":{";
+
+        for ( unsigned int id = 0; id < EVENTS; id++ )
+        {
+            Interval interval = (Interval) i;
+            EndpointSecurity::EventId event = (EndpointSecurity::EventId) id;
+            uint64_t total = this->total( interval, event );
+
+            if ( total == 0 )
+                continue;
+
+            out << ( firstEvent ? "" : "," ) << "\"" << eventName( id ) << "\":{\"count\":" << total
+                << ",\"p50_ns\":" << percentile( interval, event, 0.5 )
+                << ",\"p90_ns\":" << percentile( interval, event, 0.9 )
+                << ",\"p99_ns\":" << percentile( interval, event, 0.99 )
+                << ",\"p999_ns\":" << percentile( interval, event, 0.999 )
+                << ",\"max_ns\":" << percentile( interval, event, 1.0 )
+                << ",\"buckets\":[";
+
+            // [lowest value, count] of the non-empty buckets
+            bool firstBucket = true;
+
+            for ( unsigned int b = 0; b < BUCKETS; b++ )
+            {
+                uint64_t c = count( interval, event, b );
+
+                if ( c == 0 )
+                    continue;
+
+                out << ( firstBucket ? "" : "," ) << "[" << bucketLow( b ) << "," << c << "]";
+                firstBucket = false;
+            }
+
+            out << "]}";
+            firstEvent = false;
+        }
+
+        out << "}";
+    }
+
+    out << "}";
+    return out.str();
+}
@@ -0,0 +1,86 @@
+#ifndef LATENCYHISTOGRAMS_H
+#define LATENCYHISTOGRAMS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "EndpointSecurity.h"
+
+//
+// Latency histograms of the time events spend in the daemon, per interval and per event type.
+// The buckets are log-linear as in HdrHistogram: eight per power of two, so a value is placed within 12.5%,
+// from 1 ns up to 2^41 ns (about 36 minutes); the longer values go into the last bucket.
+//
+// Each thread records into its own buckets, with no locks and no shared cache lines. merge() adds what the threads
+// recorded since the last merge to the merged counts, and is called periodically; the snapshot merges first, so it is
+// current. A thread which exits merges the rest of its buckets and frees them.
+//
+class LatencyHistograms
+{
+    public:
+        enum Interval
+        {
+            Delivery,       // message time to the callback entry
+            Response,       // callback entry to the auth response
+            Persist,        // callback entry to the SQLite commit
+            IntervalCount
+        };
+
+        static const unsigned int SUB_BUCKET_BITS = 3;
+        static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static const unsigned int MAX_EXPONENT = 40;
+        static const unsigned int BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+        static const unsigned int EVENTS = (unsigned int) EndpointSecurity::EventId::Count;
+
+        // Records the value in nanoseconds
+        static void record( Interval interval, EndpointSecurity::EventId id, uint64_t ns );
+
+        // Records the time between two mach_absolute_time() values; nothing if the start is not known
+        static void recordSince( Interval interval, EndpointSecurity::EventId id, uint64_t start, uint64_t end );
+
+        // The merged counts of all threads, indexed by index()
+        class Snapshot
+        {
+            public:
+                Snapshot() : counts( IntervalCount * EVENTS * BUCKETS ) {}
+
+                uint64_t    count( Interval interval, EndpointSecurity::EventId id, unsigned int bucket ) const
+                {
+                    return counts[ index( interval, id, bucket ) ];
+                }
+
+                // Total number of values, and the value below which the given fraction of them are
+                uint64_t    total( Interval interval, EndpointSecurity::EventId id ) const;
+                uint64_t    percentile( Interval interval, EndpointSecurity::EventId id, double fraction ) const;
+
+                // Human-readable table, and JSON with the percentiles and the non-empty buckets:
+                // {"<interval>":{"<event>":{"count":n,"p50_ns":n,...,"buckets":[[low,count],...]},...},...}
+                std::string text() const;
+                std::string json() const;
+
+            private:
+                friend class LatencyHistograms;
+                std::vector< uint64_t > counts;
+        };
+
+        // Merges the buckets of the threads; the snapshot then only adds what was recorded after it
+        static void merge();
+
+        static Snapshot snapshot();
+
+        // The bucket for the value, and the lowest and highest values the bucket holds
+        static unsigned int bucketOf( uint64_t ns );
+        static uint64_t     bucketLow( unsigned int bucket );
+        static uint64_t     bucketHigh( unsigned int bucket );
+
+        static const char * intervalName( Interval interval );
+
+    private:
+        static size_t index( Interval interval, EndpointSecurity::EventId id, unsigned int bucket )
+        {
+            return ( (size_t) interval * EVENTS + (size_t) id ) * BUCKETS + bucket;
+        }
+};
+
+#endif // LATENCYHISTOGRAMS_H
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <stdio.h>
+#include <mach/mach_time.h>
+
+#include "LatencyHistograms.h"
+#include "LogBatcher.h"
+#include "logdb.h"
+
+LogBatcher::LogBatcher( sqlite3 * db, logdb_inserter * insert, unsigned int maxRows, unsigned int maxDelayMs )
+    : db( db ), inserter( insert ), maxRows( std::max( maxRows, 1u ) ), maxDelay( maxDelayMs ), committedRows( 0 ), committedBatches( 0 )
+{
+    pending.reserve( this->maxRows );
+}
+
+LogBatcher::~LogBatcher()
+{
+    commit();
+}
+
+void LogBatcher::insert( const EndpointSecurity::Event& event )
+{
+    if ( pending.empty() )
+    {
+        if ( maxRows > 1 && sqlite3_exec( db, "BEGIN", 0, 0, 0 ) != SQLITE_OK )
+            fprintf(stderr, "Cannot begin the transaction: %s\n", sqlite3_errmsg(db));
+
+        started = std::chrono::steady_clock::now();
+    }
+
+    logdb_insert( inserter, event );
+    pending.emplace_back( event.event_id, event.received_time );
+
+    if ( pending.size() >= maxRows )
+        commit();
+    else
+        poll();
+}
+
+void LogBatcher::poll()
+{
+    if ( !pending.empty() && std::chrono::steady_clock::now() - started >= maxDelay )
+        commit();
+}
+
+void LogBatcher::commit()
+{
+    if ( pending.empty() )
+        return;
+
+    // A single row was committed by its insert
+    if ( maxRows > 1 && sqlite3_exec( db, "COMMIT", 0, 0, 0 ) != SQLITE_OK )
+        fprintf(stderr, "Cannot commit the transaction: %s\n", sqlite3_errmsg(db));
+
+    uint64_t now = mach_absolute_time();
+
+    for ( auto& row : pending )
+        LatencyHistograms::recordSince( LatencyHistograms::Persist, row.first, row.second, now );
+
+    committedRows += pending.size();
+    committedBatches++;
+    pending.clear();
+}
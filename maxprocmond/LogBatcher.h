@@ -0,0 +1,55 @@
+#ifndef LOGBATCHER_H
+#define LOGBATCHER_H
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include "EndpointSecurity.h"
+#include "logdb.h"
+#include "sqlite3.h"
+
+//
+// Groups the inserts of one writer thread into transactions. A transaction is committed once it has maxRows rows,
+// or once its first row waited maxDelayMs, whichever comes first; that is how many rows a crash could lose.
+// The rows are committed from insert(), or from poll() which the writer calls when it has nothing to write.
+// With maxRows of one every row is committed by itself, as with the autocommit inserts.
+//
+// The persist latency of each row is recorded when it is committed. Not thread-safe; used by the writer thread only.
+//
+class LogBatcher
+{
+    public:
+        LogBatcher( sqlite3 * db, logdb_inserter * insert, unsigned int maxRows, unsigned int maxDelayMs );
+
+        // Commits the open transaction
+        ~LogBatcher();
+
+        // Inserts the event with the inserter from logdb_open(), starting the transaction if needed
+        void    insert( const EndpointSecurity::Event& event );
+
+        // Commits the transaction if its first row waited long enough
+        void    poll();
+
+        // Commits the transaction now, if there is one
+        void    commit();
+
+        // The committed rows and transactions
+        uint64_t    rows() const { return committedRows; }
+        uint64_t    commits() const { return committedBatches; }
+
+    private:
+        sqlite3 *       db;
+        logdb_inserter * inserter;
+        unsigned int    maxRows;
+        std::chrono::milliseconds maxDelay;
+
+        // The rows of the open transaction: the event type and the time it was received, for the latency
+        std::vector< std::pair< EndpointSecurity::EventId, uint64_t > > pending;
+        std::chrono::steady_clock::time_point started;
+
+        uint64_t        committedRows;
+        uint64_t        committedBatches;
+};
+
+#endif // LOGBATCHER_H
@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "PartitionedLog.h"
+
+PartitionedLog::PartitionedLog( const std::string& directory, unsigned int shard, unsigned int period, unsigned int commitRows, unsigned int commitDelayMs )
+    : directory( directory ), shard( shard ), period( period ), commitRows( commitRows ), commitDelayMs( commitDelayMs ),
+      db( nullptr ), inserter( nullptr ), periodEnd( 0 ), closedRows( 0 ), droppedRows( 0 )
+{
+}
+
+PartitionedLog::~PartitionedLog()
+{
+    close();
+}
+
+bool PartitionedLog::open( time_t time )
+{
+    close();
+
+    // The periods are aligned to UTC, as the names are
+    periodEnd = time - time % period + period;
+    path = logdb_partition_path( directory, time, period, shard );
+
+    if ( !logdb_catalog_open( directory, path, shard ) )
+        return false;
+
+    db = logdb_open( path, &inserter );
+
+    if ( !db )
+        return false;
+
+    batcher.reset( new LogBatcher( db, inserter, commitRows, commitDelayMs ) );
+    return true;
+}
+
+void PartitionedLog::insert( const EndpointSecurity::Event& event )
+{
+    if ( event.time_s >= periodEnd && !open( event.time_s ) )
+        fprintf(stderr, "Cannot open the partition %s, dropping the events until the next one\n", path.c_str());
+
+    if ( !batcher )
+    {
+        droppedRows++;
+        return;
+    }
+
+    batcher->insert( event );
+}
+
+void PartitionedLog::poll()
+{
+    if ( batcher )
+        batcher->poll();
+}
+
+void PartitionedLog::close()
+{
+    if ( !batcher )
+        return;
+
+    batcher->commit();
+    closedRows += batcher->rows();
+    batcher.reset();
+
+    logdb_catalog_close( directory, path, db );
+    logdb_close( db, inserter );
+    db = nullptr;
+    inserter = nullptr;
+}
+
+uint64_t PartitionedLog::rows() const
+{
+    return closedRows + ( batcher ? batcher->rows() : 0 );
+}
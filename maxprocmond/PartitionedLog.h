@@ -0,0 +1,62 @@
+#ifndef PARTITIONEDLOG_H
+#define PARTITIONEDLOG_H
+
+#include <memory>
+#include <string>
+
+#include "EndpointSecurity.h"
+#include "LogBatcher.h"
+#include "logdb.h"
+
+//
+// The partitions of one writer: a database file per hour or per day, from logdb_partition_path(), listed in the
+// catalog. The writer moves to the next partition with the first event past the end of the current period; the later
+// events of the earlier period still go into the current one, as the catalog records the bounds of the rows. The rows are
+// committed by a LogBatcher, and the closed partition is checkpointed, so it is complete on the disk.
+//
+// Not thread-safe; used by the writer thread only, and by the shutdown after the writer stopped.
+//
+class PartitionedLog
+{
+    public:
+        PartitionedLog( const std::string& directory, unsigned int shard, unsigned int period, unsigned int commitRows, unsigned int commitDelayMs );
+
+        // Closes the current partition
+        ~PartitionedLog();
+
+        // Opens the partition for the time, so the errors show up at start. Returns false on error.
+        bool    open( time_t time );
+
+        // Inserts the event into its partition, moving to the next one if needed. While a partition could not be
+        // opened the events are dropped and counted, until the next period.
+        void    insert( const EndpointSecurity::Event& event );
+
+        // Commits the rows which waited long enough, see LogBatcher
+        void    poll();
+
+        // Commits the rows, records the bounds in the catalog, and closes the partition
+        void    close();
+
+        // The committed rows of all partitions so far, and the events dropped because there was no partition
+        uint64_t    rows() const;
+        uint64_t    dropped() const { return droppedRows; }
+
+    private:
+        std::string     directory;
+        unsigned int    shard;
+        unsigned int    period;
+        unsigned int    commitRows;
+        unsigned int    commitDelayMs;
+
+        // The current partition and the end of its period. The period is still set when the partition could not be opened.
+        std::string     path;
+        sqlite3 *       db;
+        logdb_inserter * inserter;
+        std::unique_ptr< LogBatcher > batcher;
+        time_t          periodEnd;
+
+        uint64_t        closedRows;
+        uint64_t        droppedRows;
+};
+
+#endif // PARTITIONEDLOG_H
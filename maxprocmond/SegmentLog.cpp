@@ -0,0 +1,602 @@
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach/mach_time.h>
+#include <map>
+
+#include "EventBlob.h"
+#include "LatencyHistograms.h"
+#include "SegmentLog.h"
+#include "logdb.h"
+
+// The write buffer; the records are written in pieces this large
+static const size_t SEGMENT_BUFFER_BYTES = 1 << 20;
+
+// The record header, and the longest body a record could have. A longer length is damage, not a record.
+static const size_t RECORD_HEADER_BYTES = 8;
+static const uint32_t MAX_RECORD_BYTES = 16 << 20;
+
+namespace
+{
+    void putUint32( char * out, uint32_t value )
+    {
+        for ( int i = 0; i < 4; i++ )
+            out[i] = (char) ( value >> ( 8 * i ) );
+    }
+
+    uint32_t getUint32( const char * in )
+    {
+        uint32_t value = 0;
+
+        for ( int i = 0; i < 4; i++ )
+            value |= (uint32_t) (uint8_t) in[i] << ( 8 * i );
+
+        return value;
+    }
+
+    // CRC-32 with the polynomial of zlib, so the segments could be checked with the usual tools. It takes 8 bytes
+    // at a time with a table for each, as the repair reads through a whole segment.
+    struct Crc32Tables
+    {
+        uint32_t entries[8][256];
+
+        Crc32Tables()
+        {
+            for ( uint32_t i = 0; i < 256; i++ )
+            {
+                uint32_t crc = i;
+
+                for ( int bit = 0; bit < 8; bit++ )
+                    crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0xEDB88320 : 0 );
+
+                entries[0][i] = crc;
+            }
+
+            for ( int k = 1; k < 8; k++ )
+            {
+                for ( uint32_t i = 0; i < 256; i++ )
+                    entries[k][i] = ( entries[k - 1][i] >> 8 ) ^ entries[0][ entries[k - 1][i] & 0xFF ];
+            }
+        }
+    };
+
+    uint32_t crc32( const char * data, size_t length )
+    {
+        static const Crc32Tables tables;
+        const uint32_t (&t)[8][256] = tables.entries;
+        uint32_t crc = 0xFFFFFFFF;
+
+        for ( ; length >= 8; data += 8, length -= 8 )
+        {
+            uint32_t low = getUint32( data ) ^ crc, high = getUint32( data + 4 );
+
+            crc = t[7][ low & 0xFF ] ^ t[6][ ( low >> 8 ) & 0xFF ] ^ t[5][ ( low >> 16 ) & 0xFF ] ^ t[4][ low >> 24 ]
+                ^ t[3][ high & 0xFF ] ^ t[2][ ( high >> 8 ) & 0xFF ] ^ t[1][ ( high >> 16 ) & 0xFF ] ^ t[0][ high >> 24 ];
+        }
+
+        for ( ; length > 0; data++, length-- )
+            crc = t[0][ ( crc ^ (uint8_t) *data ) & 0xFF ] ^ ( crc >> 8 );
+
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    // Calls the function with the body of each whole record with the right CRC, and returns the bytes up to the end
+    // of the last one
+    template < typename Function >
+    size_t scanRecords( std::string_view data, Function function )
+    {
+        size_t offset = 0;
+
+        while ( data.length() - offset >= RECORD_HEADER_BYTES )
+        {
+            uint32_t length = getUint32( data.data() + offset );
+
+            if ( length > MAX_RECORD_BYTES || length > data.length() - offset - RECORD_HEADER_BYTES )
+                break;
+
+            const char * body = data.data() + offset + RECORD_HEADER_BYTES;
+
+            if ( crc32( body, length ) != getUint32( data.data() + offset + 4 ) )
+                break;
+
+            function( std::string_view( body, length ) );
+            offset += RECORD_HEADER_BYTES + length;
+        }
+
+        return offset;
+    }
+
+    struct Record
+    {
+        EndpointSecurity::EventId event_id;
+        int64_t             time;
+        std::string_view    executable;
+        std::string_view    filename;
+        std::string_view    detail;
+    };
+
+    bool readString( std::string_view& in, std::string_view& value )
+    {
+        uint64_t length;
+
+        if ( !EventBlob::readVarint( in, length ) || length > in.length() )
+            return false;
+
+        value = in.substr( 0, length );
+        in.remove_prefix( length );
+        return true;
+    }
+
+    bool decodeRecord( std::string_view body, Record& record )
+    {
+        uint64_t id, time;
+
+        if ( !EventBlob::readVarint( body, id ) || !EventBlob::readVarint( body, time )
+             || !readString( body, record.executable ) || !readString( body, record.filename ) )
+            return false;
+
+        record.event_id = (EndpointSecurity::EventId) id;
+        record.time = (int64_t) time;
+        record.detail = body;
+        return true;
+    }
+
+    // The file mapped for reading
+    class MappedFile
+    {
+        public:
+            MappedFile( const std::string& path ) : fd( ::open( path.c_str(), O_RDONLY ) ), address( MAP_FAILED )
+            {
+                struct stat st;
+
+                if ( fd < 0 || fstat( fd, &st ) != 0 )
+                    return;
+
+                if ( st.st_size == 0 )
+                {
+                    data = std::string_view( "", 0 );
+                    return;
+                }
+
+                address = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+                if ( address != MAP_FAILED )
+                    data = std::string_view( (const char *) address, st.st_size );
+            }
+
+            ~MappedFile()
+            {
+                if ( address != MAP_FAILED )
+                    munmap( address, data.length() );
+
+                if ( fd >= 0 )
+                    ::close( fd );
+            }
+
+            bool mapped() const
+            {
+                return data.data() != nullptr;
+            }
+
+            std::string_view data;
+
+        private:
+            int     fd;
+            void *  address;
+    };
+
+    // The segment names in the directory with the suffix, sorted, so the segments of each writer are in their order.
+    // The shard and the sequence of each are put into the vectors.
+    std::vector< std::string > listSegments( const std::string& directory, const char * suffix, std::vector< unsigned int > * shards = nullptr,
+                                             std::vector< uint64_t > * sequences = nullptr )
+    {
+        std::vector< std::string > names;
+        DIR * dir = opendir( directory.c_str() );
+
+        if ( !dir )
+            return names;
+
+        while ( struct dirent * entry = readdir( dir ) )
+        {
+            unsigned int shard;
+            unsigned long long sequence;
+            char found[16];
+
+            if ( sscanf( entry->d_name, "events-%u-%llu.%15s", &shard, &sequence, found ) == 3 && strcmp( found, suffix ) == 0 )
+                names.push_back( entry->d_name );
+        }
+
+        closedir( dir );
+        std::sort( names.begin(), names.end() );
+
+        for ( const std::string& name : names )
+        {
+            unsigned int shard;
+            unsigned long long sequence;
+            sscanf( name.c_str(), "events-%u-%llu", &shard, &sequence );
+
+            if ( shards )
+                shards->push_back( shard );
+
+            if ( sequences )
+                sequences->push_back( sequence );
+        }
+
+        return names;
+    }
+
+    std::string segmentName( unsigned int shard, uint64_t sequence )
+    {
+        char name[64];
+        snprintf( name, sizeof(name), "events-%u-%010llu", shard, (unsigned long long) sequence );
+        return name;
+    }
+}
+
+SegmentLog::SegmentLog( const std::string& directory, unsigned int shard, uint64_t maxBytes, unsigned int maxDelayMs )
+    : directory( directory ), shard( shard ), maxBytes( maxBytes ), maxDelay( maxDelayMs ),
+      fd( -1 ), sequence( 0 ), segmentBytes( 0 ), writtenRows( 0 ), droppedRows( 0 )
+{
+    buffer.reserve( SEGMENT_BUFFER_BYTES + 4096 );
+}
+
+SegmentLog::~SegmentLog()
+{
+    close();
+}
+
+std::string SegmentLog::segmentsDirectory( const std::string& directory )
+{
+    return directory + "/segments";
+}
+
+bool SegmentLog::open()
+{
+    close();
+
+    std::string segments = segmentsDirectory( directory );
+    mkdir( directory.c_str(), 0755 );
+    mkdir( segments.c_str(), 0755 );
+
+    // The segment of this writer which was being written when it stopped
+    std::vector< unsigned int > shards;
+    std::vector< std::string > open = listSegments( segments, "open", &shards );
+
+    for ( size_t i = 0; i < open.size(); i++ )
+    {
+        if ( shards[i] != shard )
+            continue;
+
+        std::string openPath = segments + "/" + open[i];
+        std::string sealedPath = openPath.substr( 0, openPath.length() - 4 ) + "seg";
+        uint64_t records = 0;
+        size_t valid, length;
+
+        {
+            MappedFile file( openPath );
+
+            if ( !file.mapped() )
+            {
+                fprintf(stderr, "Cannot read the segment %s\n", openPath.c_str());
+                return false;
+            }
+
+            length = file.data.length();
+            valid = scanRecords( file.data, [&]( std::string_view ){ records++; } );
+        }
+
+        if ( ( valid < length && truncate( openPath.c_str(), valid ) != 0 )
+             || ( valid > 0 ? rename( openPath.c_str(), sealedPath.c_str() ) : unlink( openPath.c_str() ) ) != 0 )
+        {
+            fprintf(stderr, "Cannot repair the segment %s\n", openPath.c_str());
+            return false;
+        }
+
+        if ( valid < length )
+            fprintf(stderr, "Repaired the segment %s: kept %llu records, cut %zu bytes\n", sealedPath.c_str(), (unsigned long long) records, length - valid);
+    }
+
+    // The next segment follows every one of this writer, including those not imported yet, and the imported ones,
+    // which the catalog remembers, see openSegment()
+    shards.clear();
+    std::vector< uint64_t > sequences;
+    listSegments( segments, "seg", &shards, &sequences );
+    listSegments( segments, "damaged", &shards, &sequences );
+    sequence = 0;
+
+    for ( size_t i = 0; i < shards.size(); i++ )
+    {
+        if ( shards[i] == shard )
+            sequence = std::max( sequence, sequences[i] + 1 );
+    }
+
+    return openSegment();
+}
+
+bool SegmentLog::openSegment()
+{
+    // The import records the segment names in the partitions, so a name used before would have its rows skipped
+    if ( !logdb_catalog_segment( directory, shard, sequence ) )
+    {
+        fprintf(stderr, "Cannot reserve the next segment of the writer %u\n", shard);
+        return false;
+    }
+
+    path = segmentsDirectory( directory ) + "/" + segmentName( shard, sequence );
+    segmentBytes = 0;
+    fd = ::open( ( path + ".open" ).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+
+    if ( fd < 0 )
+    {
+        fprintf(stderr, "Cannot create the segment %s.open\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void SegmentLog::insert( const EndpointSecurity::Event& event )
+{
+    if ( fd < 0 )
+    {
+        droppedRows++;
+        return;
+    }
+
+    if ( pending.empty() )
+        started = std::chrono::steady_clock::now();
+
+    // The header is filled in once the body is there
+    size_t start = buffer.length();
+    buffer.append( RECORD_HEADER_BYTES, '\0' );
+
+    EventBlob::appendVarint( buffer, (uint64_t) event.event_id );
+    EventBlob::appendVarint( buffer, (uint64_t) event.time_s * 1000000000 + event.time_ns );
+    EventBlob::appendVarint( buffer, event.process_executable.length() );
+    buffer.append( event.process_executable.data(), event.process_executable.length() );
+    EventBlob::appendVarint( buffer, event.filename.length() );
+    buffer.append( event.filename.data(), event.filename.length() );
+
+    EventBlob::encode( event, detail );
+    buffer += detail;
+
+    uint32_t length = buffer.length() - start - RECORD_HEADER_BYTES;
+    putUint32( &buffer[ start ], length );
+    putUint32( &buffer[ start + 4 ], crc32( buffer.data() + start + RECORD_HEADER_BYTES, length ) );
+    pending.emplace_back( event.event_id, event.received_time );
+
+    if ( segmentBytes + buffer.length() >= maxBytes )
+    {
+        seal();
+        sequence++;
+        openSegment();
+    }
+    else if ( buffer.length() >= SEGMENT_BUFFER_BYTES )
+        flush();
+    else
+        poll();
+}
+
+void SegmentLog::poll()
+{
+    if ( !pending.empty() && std::chrono::steady_clock::now() - started >= maxDelay )
+        flush();
+}
+
+void SegmentLog::flush()
+{
+    if ( pending.empty() )
+        return;
+
+    size_t written = 0;
+
+    while ( written < buffer.length() )
+    {
+        ssize_t rc = write( fd, buffer.data() + written, buffer.length() - written );
+
+        if ( rc < 0 && errno == EINTR )
+            continue;
+
+        if ( rc <= 0 )
+            break;
+
+        written += rc;
+    }
+
+    // A partly written buffer is cut off, so the next records follow the last whole one
+    if ( written < buffer.length() )
+    {
+        fprintf(stderr, "Cannot write the segment %s.open: %s\n", path.c_str(), strerror(errno));
+        ftruncate( fd, segmentBytes );
+        droppedRows += pending.size();
+    }
+    else
+    {
+        uint64_t now = mach_absolute_time();
+
+        for ( auto& row : pending )
+            LatencyHistograms::recordSince( LatencyHistograms::Persist, row.first, row.second, now );
+
+        segmentBytes += written;
+        writtenRows += pending.size();
+    }
+
+    buffer.clear();
+    pending.clear();
+}
+
+void SegmentLog::seal()
+{
+    if ( fd < 0 )
+        return;
+
+    flush();
+    fsync( fd );
+    ::close( fd );
+    fd = -1;
+
+    std::string openPath = path + ".open";
+
+    if ( segmentBytes == 0 )
+        unlink( openPath.c_str() );
+    else if ( rename( openPath.c_str(), ( path + ".seg" ).c_str() ) != 0 )
+        fprintf(stderr, "Cannot rename the segment %s: %s\n", openPath.c_str(), strerror(errno));
+}
+
+void SegmentLog::close()
+{
+    seal();
+}
+
+bool SegmentLog::import( const std::string& directory, unsigned int period, ImportStats& stats )
+{
+    std::string segments = segmentsDirectory( directory );
+    std::vector< unsigned int > shards;
+    std::vector< std::string > names = listSegments( segments, "seg", &shards );
+
+    stats = ImportStats();
+
+    for ( size_t i = 0; i < names.size(); i++ )
+    {
+        std::string segmentPath = segments + "/" + names[i];
+        std::string segment = names[i].substr( 0, names[i].length() - 4 );
+        MappedFile file( segmentPath );
+
+        if ( !file.mapped() )
+        {
+            fprintf(stderr, "Cannot read the segment %s\n", segmentPath.c_str());
+            return false;
+        }
+
+        // The partitions the records of the segment go to, each with its transaction
+        struct Target
+        {
+            sqlite3 *           db;
+            logdb_inserter *    inserter;
+            bool                imported;
+            uint64_t            records;
+        };
+
+        std::map< std::string, Target > targets;
+        uint64_t inserted = 0, skipped = 0;
+        bool failed = false;
+
+        size_t valid = scanRecords( file.data, [&]( std::string_view body )
+        {
+            Record record;
+
+            if ( failed || !decodeRecord( body, record ) )
+                return;
+
+            std::string path = logdb_partition_path( directory, record.time / 1000000000, period, shards[i] );
+            auto it = targets.find( path );
+
+            if ( it == targets.end() )
+            {
+                Target target = { nullptr, nullptr, false, 0 };
+                sqlite3_stmt * pStmt;
+
+                if ( logdb_catalog_open( directory, path, shards[i] ) )
+                    target.db = logdb_open( path, &target.inserter );
+
+                if ( !target.db
+                     || sqlite3_exec( target.db, "CREATE TABLE IF NOT EXISTS Imported(Segment TEXT PRIMARY KEY, Records INTEGER);"
+                                                 "BEGIN;", 0, 0, 0 ) != SQLITE_OK
+                     || sqlite3_prepare_v2( target.db, "SELECT 1 FROM Imported WHERE Segment = ?", -1, &pStmt, 0 ) != SQLITE_OK )
+                {
+                    fprintf(stderr, "Cannot import into the partition %s\n", path.c_str());
+                    failed = true;
+
+                    if ( target.db )
+                        logdb_close( target.db, target.inserter );
+
+                    return;
+                }
+
+                sqlite3_bind_text( pStmt, 1, segment.c_str(), -1, SQLITE_STATIC );
+                target.imported = sqlite3_step( pStmt ) == SQLITE_ROW;
+                sqlite3_finalize( pStmt );
+
+                it = targets.emplace( path, target ).first;
+            }
+
+            Target& target = it->second;
+
+            if ( target.imported )
+            {
+                skipped++;
+                return;
+            }
+
+            if ( logdb_insert_record( target.inserter, record.event_id, record.time, record.executable, record.filename, record.detail ) != SQLITE_DONE )
+            {
+                fprintf(stderr, "Cannot import into the partition %s: %s\n", it->first.c_str(), sqlite3_errmsg(target.db));
+                failed = true;
+                return;
+            }
+
+            target.records++;
+            inserted++;
+        } );
+
+        // The segment is recorded with its rows, in the same transaction
+        for ( auto& entry : targets )
+        {
+            Target& target = entry.second;
+
+            if ( !failed && !target.imported )
+            {
+                sqlite3_stmt * pStmt;
+
+                if ( sqlite3_prepare_v2( target.db, "INSERT INTO Imported(Segment, Records) VALUES(?, ?)", -1, &pStmt, 0 ) == SQLITE_OK )
+                {
+                    sqlite3_bind_text( pStmt, 1, segment.c_str(), -1, SQLITE_STATIC );
+                    sqlite3_bind_int64( pStmt, 2, target.records );
+                    failed = sqlite3_step( pStmt ) != SQLITE_DONE;
+                    sqlite3_finalize( pStmt );
+                }
+                else
+                    failed = true;
+            }
+
+            if ( failed || sqlite3_exec( target.db, "COMMIT;", 0, 0, 0 ) != SQLITE_OK )
+            {
+                sqlite3_exec( target.db, "ROLLBACK;", 0, 0, 0 );
+                failed = true;
+            }
+
+            logdb_catalog_close( directory, entry.first, target.db );
+            logdb_close( target.db, target.inserter );
+        }
+
+        // The segment stays for the next import
+        if ( failed )
+        {
+            fprintf(stderr, "Failed to import the segment %s\n", segmentPath.c_str());
+            return false;
+        }
+
+        stats.records += inserted;
+        stats.skipped += skipped;
+
+        if ( valid < file.data.length() )
+        {
+            fprintf(stderr, "The segment %s is damaged after %zu bytes of %zu, the rest was not imported\n", segmentPath.c_str(), valid, file.data.length());
+            rename( segmentPath.c_str(), ( segments + "/" + segment + ".damaged" ).c_str() );
+            stats.damaged++;
+        }
+        else
+        {
+            unlink( segmentPath.c_str() );
+            stats.segments++;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,96 @@
+#ifndef SEGMENTLOG_H
+#define SEGMENTLOG_H
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "EndpointSecurity.h"
+
+//
+// The append-only alternative to the SQLite partitions, for the peak loads: the events of one writer as records in the
+// segment files <directory>/segments/events-<k>-<sequence>.seg, which import() loads into the partitions later.
+//
+// A record is the length of its body and the CRC-32 of the body, both 4 bytes little-endian, followed by the body:
+// the varints of the event id and of the time in nanoseconds since the epoch, the executable and the filename, each as
+// a varint length and the bytes, and the rest is the EventBlob of the details. The records are gathered in a buffer,
+// which is written at once when it is full, or when its first record waited maxDelayMs; that is how many records a crash
+// could lose. The segment being written is named .open. Once it has maxBytes it is synced and renamed to .seg, and the
+// writer starts the next one. The sequence numbers are reserved in the catalog, so they are not used again after the
+// import deleted the segments.
+//
+// A .open segment left by a crash is repaired by open(): it is cut after the last record with the right CRC, which
+// takes one read through it, and then renamed to .seg like the others.
+//
+// Not thread-safe; used by the writer thread only, and by the shutdown after the writer stopped.
+//
+class SegmentLog
+{
+    public:
+        SegmentLog( const std::string& directory, unsigned int shard, uint64_t maxBytes, unsigned int maxDelayMs );
+
+        // Writes the buffer and closes the segment
+        ~SegmentLog();
+
+        // Repairs the segments this writer left open, and starts the next one. Returns false on error.
+        bool    open();
+
+        // Appends the event to the buffer, writing the buffer if it is full, and moves to the next segment if needed
+        void    insert( const EndpointSecurity::Event& event );
+
+        // Writes the buffer if its first record waited long enough
+        void    poll();
+
+        // Writes the buffer and closes the segment, renaming it to .seg
+        void    close();
+
+        // The records written, and those lost because the segment could not be opened or written
+        uint64_t    rows() const { return writtenRows; }
+        uint64_t    dropped() const { return droppedRows; }
+
+        struct ImportStats
+        {
+            uint64_t    segments;       // imported and deleted
+            uint64_t    records;        // inserted into the partitions
+            uint64_t    skipped;        // already in a partition, from an import which was interrupted
+            uint64_t    damaged;        // segments with a record with the wrong CRC, imported up to it and renamed to .damaged
+        };
+
+        // Imports the .seg segments in the directory into the partitions of their writers, for the period, see
+        // PartitionedLog, and deletes them. Runs apart from the writers, which only hand over a segment when it is
+        // complete. Each partition gets the rows of a segment in one transaction, which also records the segment in
+        // its Imported table, so an interrupted import adds none of them twice. Returns false on error.
+        static bool import( const std::string& directory, unsigned int period, ImportStats& stats );
+
+        // The segments directory in the root directory
+        static std::string segmentsDirectory( const std::string& directory );
+
+    private:
+        bool    openSegment();
+        void    flush();
+        void    seal();
+
+        std::string     directory;
+        unsigned int    shard;
+        uint64_t        maxBytes;
+        std::chrono::milliseconds maxDelay;
+
+        // The segment being written: the descriptor, its name without the suffix, and the bytes written to it
+        int             fd;
+        std::string     path;
+        uint64_t        sequence;
+        uint64_t        segmentBytes;
+
+        // The records not written yet, with the event type and the time it was received, for the persist latency
+        std::string     buffer;
+        std::string     detail;
+        std::vector< std::pair< EndpointSecurity::EventId, uint64_t > > pending;
+        std::chrono::steady_clock::time_point started;
+
+        uint64_t        writtenRows;
+        uint64_t        droppedRows;
+};
+
+#endif // SEGMENTLOG_H
@@ -0,0 +1,222 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Worker threads, each with its own queue. An item goes to the queue of the worker chosen by its key, and a worker
+// which has nothing to do takes the items from the other queues. The items with the same key are still handled in the
+// order they were pushed: every item carries the sequence number of the previous item with its key, and it is only
+// handled once that one is done. A worker only steals an item which is ready, so it does not wait for the owner.
+//
+template< typename T > class WorkStealingPool
+{
+    public:
+        // Called on a worker thread with the worker index
+        typedef std::function<void(unsigned int worker, T& item)> Handler;
+
+        WorkStealingPool( unsigned int workers, Handler handler )
+            : handler( handler ), sequence( 0 ), pending( 0 ), sleepers( 0 ), stolen( 0 ), stopping( false )
+        {
+            for ( auto& strand : strands )
+            {
+                strand.last = 0;
+                strand.done = 0;
+            }
+
+            for ( unsigned int i = 0; i < std::max( workers, 1u ); i++ )
+                workerList.emplace_back( new Worker() );
+
+            for ( unsigned int i = 0; i < workerList.size(); i++ )
+                workerList[i]->thread = std::thread( &WorkStealingPool::run, this, i );
+        }
+
+        WorkStealingPool( const WorkStealingPool& ) = delete;
+        WorkStealingPool& operator=( const WorkStealingPool& ) = delete;
+
+        // Handles the queued items and stops the workers
+        ~WorkStealingPool()
+        {
+            stop();
+        }
+
+        // Queues the item. Must be called from one thread at a time, as that defines the order of the items.
+        void push( uint64_t key, T&& item )
+        {
+            Strand& strand = strands[ key % STRANDS ];
+            Entry entry { std::move( item ), &strand, strand.last, ++sequence };
+            strand.last = entry.seq;
+
+            Worker& worker = *workerList[ key % workerList.size() ];
+            pending.fetch_add( 1, std::memory_order_release );
+
+            {
+                std::lock_guard< std::mutex > lock( worker.mutex );
+                worker.entries.push_back( std::move( entry ) );
+            }
+
+            if ( sleepers.load( std::memory_order_acquire ) > 0 )
+            {
+                std::lock_guard< std::mutex > lock( sleepMutex );
+                wakeup.notify_one();
+            }
+        }
+
+        // Handles the queued items and stops the workers. push() must not be called after that.
+        void stop()
+        {
+            {
+                std::lock_guard< std::mutex > lock( sleepMutex );
+
+                if ( stopping )
+                    return;
+
+                stopping = true;
+                wakeup.notify_all();
+            }
+
+            for ( auto& worker : workerList )
+                worker->thread.join();
+        }
+
+        unsigned int workers() const
+        {
+            return workerList.size();
+        }
+
+        // The items handled by another worker than the one they were queued to
+        uint64_t steals() const
+        {
+            return stolen.load( std::memory_order_relaxed );
+        }
+
+    private:
+        // The items sharing a strand are ordered; the keys are hashed into a fixed number of them,
+        // so two keys could share one, which only orders them more than needed.
+        static const unsigned int STRANDS = 4096;
+
+        struct Strand
+        {
+            uint64_t                last;   // the sequence of the last pushed item, only used by push()
+            std::atomic< uint64_t > done;   // the sequence of the last handled item
+        };
+
+        struct Entry
+        {
+            T           item;
+            Strand *    strand;
+            uint64_t    after;      // handled once this one is done
+            uint64_t    seq;
+        };
+
+        struct Worker
+        {
+            std::mutex          mutex;
+            std::deque< Entry > entries;
+            std::thread         thread;
+        };
+
+        bool ready( const Entry& entry ) const
+        {
+            return entry.strand->done.load( std::memory_order_acquire ) == entry.after;
+        }
+
+        // Takes the next item of the worker's own queue, or else a ready item from another queue
+        bool take( unsigned int self, Entry& entry )
+        {
+            {
+                Worker& own = *workerList[ self ];
+                std::lock_guard< std::mutex > lock( own.mutex );
+
+                if ( !own.entries.empty() )
+                {
+                    entry = std::move( own.entries.front() );
+                    own.entries.pop_front();
+                    return true;
+                }
+            }
+
+            for ( unsigned int i = 1; i < workerList.size(); i++ )
+            {
+                Worker& victim = *workerList[ ( self + i ) % workerList.size() ];
+                std::lock_guard< std::mutex > lock( victim.mutex );
+
+                if ( !victim.entries.empty() && ready( victim.entries.front() ) )
+                {
+                    entry = std::move( victim.entries.front() );
+                    victim.entries.pop_front();
+                    stolen.fetch_add( 1, std::memory_order_relaxed );
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void run( unsigned int self )
+        {
+            Entry entry;
+
+            while ( true )
+            {
+                if ( take( self, entry ) )
+                {
+                    // The previous item with this key could still be handled by another worker
+                    while ( !ready( entry ) )
+                        std::this_thread::yield();
+
+                    handler( self, entry.item );
+                    entry.strand->done.store( entry.seq, std::memory_order_release );
+                    entry.item = T();
+                    pending.fetch_sub( 1, std::memory_order_acq_rel );
+                    continue;
+                }
+
+                std::unique_lock< std::mutex > lock( sleepMutex );
+
+                if ( pending.load( std::memory_order_acquire ) == 0 )
+                {
+                    if ( stopping )
+                        return;
+
+                    // As in EventWriter: check after announcing the sleep, and wake up anyway in case a push was missed
+                    sleepers++;
+
+                    if ( pending.load( std::memory_order_acquire ) == 0 )
+                        wakeup.wait_for( lock, std::chrono::milliseconds( 10 ) );
+
+                    sleepers--;
+                }
+                else
+                {
+                    // Items are queued, but not ready to be stolen
+                    lock.unlock();
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        std::vector< std::unique_ptr< Worker > > workerList;
+        Handler                 handler;
+        Strand                  strands[ STRANDS ];
+        uint64_t                sequence;
+
+        std::atomic< size_t >   pending;    // queued or being handled
+        std::atomic< unsigned int > sleepers;
+        std::atomic< uint64_t > stolen;
+
+        std::mutex              sleepMutex;
+        std::condition_variable wakeup;
+        bool                    stopping;
+};
+
+#endif // WORKSTEALINGPOOL_H
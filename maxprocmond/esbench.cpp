@@ -0,0 +1,1461 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <regex>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mach/mach_time.h>
+
+#include "BackpressurePolicy.h"
+#include "EndpointSecurity.h"
+#include "EsMessageBuilder.h"
+#include "EventBlob.h"
+#include "EventShards.h"
+#include "EventWriter.h"
+#include "LatencyHistograms.h"
+#include "LogBatcher.h"
+#include "PartitionedLog.h"
+#include "SegmentLog.h"
+#include "esbench.h"
+#include "logdb.h"
+#include "flags.h"
+#include "sqlite3.h"
+
+// Allocation counter for the benchmarks. Replacing operator new is global, so it is only built with
+// MAXPROCMON_COUNT_ALLOCATIONS, which the Debug configuration defines; otherwise the counts stay 0.
+static thread_local uint64_t allocations;
+
+#ifdef MAXPROCMON_COUNT_ALLOCATIONS
+// Not inlined, or GCC sees malloc() and free() paired with the operators and warns of the mismatch
+__attribute__((noinline)) void * operator new( std::size_t size )
+{
+    allocations++;
+    
+    if ( void * p = malloc( size ? size : 1 ) )
+        return p;
+    
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete( void * p ) noexcept
+{
+    free( p );
+}
+
+__attribute__((noinline)) void operator delete( void * p, std::size_t ) noexcept
+{
+    free( p );
+}
+
+static const bool countingAllocations = true;
+#else
+static const bool countingAllocations = false;
+#endif
+
+// Exposes on_event() so the benchmarks could feed the messages directly
+class BenchEndpointSecurity : public EndpointSecurity
+{
+    public:
+        using EndpointSecurity::on_event;
+        using EndpointSecurity::on_message;
+};
+
+// The typical build host mix: mostly open/close/write of the long paths
+static std::vector< es_message_t * > buildFileMix( EsMessageBuilder& builder, unsigned int count )
+{
+    std::vector< es_message_t * > messages;
+    
+    for ( unsigned int i = 0; i < count; i++ )
+    {
+        std::string path = "/Users/builder/src/project/node_modules/@scope/package-" + std::to_string( i % 97 ) + "/dist/esm/internal/module-" + std::to_string( i ) + ".js";
+        
+        switch ( i % 5 )
+        {
+            case 0:
+                messages.push_back( builder.open( path, 0x00000001 ) );
+                break;
+                
+            case 1:
+                messages.push_back( builder.write( path ) );
+                break;
+                
+            case 2:
+                messages.push_back( builder.close( path, true ) );
+                break;
+                
+            case 3:
+                messages.push_back( builder.stat( path ) );
+                break;
+                
+            case 4:
+                messages.push_back( builder.open( path, 0x00000002 | 0x00000200 ) );
+                break;
+        }
+    }
+    
+    return messages;
+}
+
+// Runs the messages through on_event() and reports the time and allocations per event
+static void runEvents( const char * title, const std::vector< es_message_t * >& messages, unsigned int count, std::function<int(const EndpointSecurity::Event&)> sink, bool viewMode = false )
+{
+    BenchEndpointSecurity epsec;
+    epsec.createDetached( sink );
+    epsec.setViewMode( viewMode );
+    
+    // Warm up, so the reused strings get their capacity
+    for ( es_message_t * msg : messages )
+        epsec.on_event( msg );
+    
+    uint64_t startallocs = allocations;
+    uint64_t startdescs = EndpointSecurity::formattedDescriptions();
+    auto start = std::chrono::steady_clock::now();
+    
+    for ( unsigned int i = 0; i < count; i++ )
+        epsec.on_event( messages[ i % messages.size() ] );
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    uint64_t totalallocs = allocations - startallocs;
+    uint64_t totaldescs = EndpointSecurity::formattedDescriptions() - startdescs;
+    
+    std::cout << title << ": " << count << " events, "
+              << (double) elapsed / count << " ns/event, "
+              << (double) totalallocs / count << " allocations/event, "
+              << (double) totaldescs / count << " descriptions/event\n";
+}
+
+// Allocations made by the event decoding, with the typed payload and with the compatibility parameters view
+static void bench_alloc( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    runEvents( "typed payload", messages, count, [](const EndpointSecurity::Event& event){ return 0; } );
+    runEvents( "parameters() view", messages, count, [](const EndpointSecurity::Event& event){ return (int) event.parameters().size(); } );
+}
+
+// Copying the strings into the event versus pointing into the message. The sink hashes the path, as a consumer which only needs the bytes once.
+static void bench_views( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    size_t hash = 0;
+    
+    auto sink = [&hash](const EndpointSecurity::Event& event)
+    {
+        hash ^= std::hash<std::string_view>()( event.filename.view() );
+        return 0;
+    };
+    
+    auto materializingSink = [&hash](const EndpointSecurity::Event& event)
+    {
+        EndpointSecurity::Event copy = event;
+        copy.materialize();
+        hash ^= std::hash<std::string_view>()( copy.filename.view() );
+        return 0;
+    };
+    
+    runEvents( "copy mode", messages, count, sink );
+    runEvents( "view mode", messages, count, sink, true );
+    runEvents( "view mode, materialized", messages, count, materializingSink, true );
+    
+    // so the hashing is not optimized away
+    std::cout << "(hash " << hash << ")\n";
+}
+
+// Events from many processes, with a sink reading the per-process descriptions as the console output does.
+// Each process formats its descriptions once, and the exits evict it from the cache.
+static void bench_process( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages;
+    
+    for ( pid_t pid = 2000; pid < 2100; pid++ )
+    {
+        builder.setProcess( builder.process( pid, "/usr/local/bin/process-" + std::to_string( pid ) ) );
+        std::vector< es_message_t * > mix = buildFileMix( builder, 100 );
+        messages.insert( messages.end(), mix.begin(), mix.end() );
+        messages.push_back( builder.exit( 0 ) );
+    }
+    
+    size_t total = 0;
+    
+    runEvents( "process descriptions", messages, count, [&total](const EndpointSecurity::Event& event)
+    {
+        total += event.process_csflags_desc().length() + event.process_start_time().length() + event.process_executable.length();
+        return 0;
+    } );
+    
+    std::cout << "(" << total << " chars)\n";
+}
+
+// Passes the events to a consumer thread, either copying each event or taking its pool slot. Unless burst is set,
+// the producer waits for a free slot, so this measures the sustained rate; with burst the events are dropped instead.
+template< typename Item > static void runHandoff( const char * title, const std::vector< es_message_t * >& messages, unsigned int count,
+                                                  unsigned int poolSize, bool burst, std::function<Item(BenchEndpointSecurity&, const EndpointSecurity::Event&)> take )
+{
+    BenchEndpointSecurity epsec;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque< Item > queue;
+    bool finished = false;
+    
+    epsec.setPoolSize( poolSize );
+    epsec.createDetached( [&](const EndpointSecurity::Event& event)
+    {
+        Item item = take( epsec, event );
+        std::lock_guard< std::mutex > lock( mutex );
+        queue.push_back( std::move( item ) );
+        cond.notify_one();
+        return 0;
+    } );
+    
+    std::thread consumer( [&]()
+    {
+        std::deque< Item > batch;
+        std::unique_lock< std::mutex > lock( mutex );
+        
+        while ( !finished || !queue.empty() )
+        {
+            if ( queue.empty() )
+            {
+                cond.wait( lock );
+                continue;
+            }
+            
+            // Destroying the items releases the events
+            batch.swap( queue );
+            lock.unlock();
+            batch.clear();
+            lock.lock();
+        }
+    } );
+    
+    uint64_t startallocs = allocations;
+    auto start = std::chrono::steady_clock::now();
+    
+    for ( unsigned int i = 0; i < count; i++ )
+    {
+        while ( !burst && epsec.poolStats().in_use == poolSize )
+            std::this_thread::yield();
+        
+        epsec.on_event( messages[ i % messages.size() ] );
+    }
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    uint64_t totalallocs = allocations - startallocs;
+    
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        finished = true;
+        cond.notify_one();
+    }
+    
+    consumer.join();
+    
+    std::cout << title << ": " << (double) elapsed / count << " ns/event, "
+              << (double) totalallocs / count << " allocations/event in the ES thread, "
+              << epsec.poolStats().exhausted << " dropped\n";
+}
+
+// Handing the events to another thread: the deep copy which was required before, and the pool slots
+static void bench_pool( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    auto take = [](BenchEndpointSecurity& epsec, const EndpointSecurity::Event& event) { return epsec.takeEvent(); };
+    
+    runHandoff< EndpointSecurity::Event >( "deep copy", messages, count, 1, true,
+        [](BenchEndpointSecurity& epsec, const EndpointSecurity::Event& event) { return event; } );
+    
+    for ( unsigned int size : { 16, 256, 4096 } )
+    {
+        std::string title = "pool of " + std::to_string( size );
+        runHandoff< EndpointSecurity::EventHandle >( title.c_str(), messages, count, size, false, take );
+    }
+    
+    runHandoff< EndpointSecurity::EventHandle >( "pool of 256, burst", messages, count, 256, true, take );
+}
+
+// Several clients, each on its own thread, queueing the events for the writer thread. The sink is the given function.
+// A client waits for a free slot when the writer falls behind, so this measures the sustained rate through the sink.
+static void runQueue( const char * title, unsigned int clients, unsigned int count, EventWriter::Sink sink )
+{
+    EventWriter writer( 4096, sink );
+    std::vector< std::thread > threads;
+    auto start = std::chrono::steady_clock::now();
+    
+    for ( unsigned int c = 0; c < clients; c++ )
+    {
+        threads.emplace_back( [&writer, clients, count]()
+        {
+            EsMessageBuilder builder;
+            std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+            BenchEndpointSecurity epsec;
+            
+            epsec.setPoolSize( 1024 );
+            epsec.createDetached( [&](const EndpointSecurity::Event& event){ writer.push( epsec.takeEvent() ); return 0; } );
+            
+            for ( unsigned int i = 0; i < count / clients; i++ )
+            {
+                while ( epsec.poolStats().in_use == 1024 )
+                    std::this_thread::yield();
+                
+                epsec.on_event( messages[ i % messages.size() ] );
+            }
+            
+            // The slots must be back before the client goes away
+            while ( epsec.poolStats().in_use > 0 )
+                std::this_thread::yield();
+        } );
+    }
+    
+    for ( auto& t : threads )
+        t.join();
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    EventWriter::Stats stats = writer.stats();
+    
+    std::cout << title << ": " << (double) elapsed / count << " ns/event, " << (uint64_t) (count * 1e9 / elapsed) << " events/s, written "
+              << stats.written << ", high water " << stats.high_water << ", overflows " << stats.overflows << "\n";
+}
+
+// The throughput of the queue between the clients and the writer thread, with the empty sink and the SQLite one
+static void bench_queue( unsigned int count )
+{
+    runQueue( "1 client, empty sink", 1, count, [](const EndpointSecurity::Event& event){} );
+    runQueue( "4 clients, empty sink", 4, count, [](const EndpointSecurity::Event& event){} );
+    
+    sqlite3 * db;
+    sqlite3_stmt * stmt;
+    sqlite3_open( ":memory:", &db );
+    sqlite3_exec( db, "CREATE TABLE Logs(EventType INTEGER, Timestamp DATETIME, TimeNS REAL, Executable TEXT, Filename TEXT);", 0, 0, 0 );
+    sqlite3_prepare_v2( db, "INSERT INTO Logs(EventType, Timestamp, TimeNS, Executable, Filename) VALUES(?, ?, ?, ?, ?)", -1, &stmt, 0 );
+    
+    auto sqliteSink = [stmt](const EndpointSecurity::Event& event)
+    {
+        sqlite3_bind_int( stmt, 1, (int) event.event_id );
+        sqlite3_bind_double( stmt, 2, event.time_s );
+        sqlite3_bind_double( stmt, 3, event.time_ns );
+        sqlite3_bind_text( stmt, 4, event.process_executable.data(), event.process_executable.length(), NULL );
+        sqlite3_bind_text( stmt, 5, event.filename.data(), event.filename.length(), NULL );
+        sqlite3_step( stmt );
+        sqlite3_reset( stmt );
+    };
+    
+    runQueue( "1 client, in-memory SQLite sink", 1, count, sqliteSink );
+    runQueue( "4 clients, in-memory SQLite sink", 4, count, sqliteSink );
+    
+    sqlite3_finalize( stmt );
+    sqlite3_close( db );
+}
+
+// Each client on its own thread runs its messages the given number of times over, queueing the events to its own queue.
+// Returns the nanoseconds until all events went through the writer.
+static int64_t runClients( const std::vector< std::vector< es_message_t * > >& clientMessages, const std::vector< unsigned int >& counts, EventWriter& writer )
+{
+    std::vector< std::thread > threads;
+    auto start = std::chrono::steady_clock::now();
+    
+    for ( unsigned int c = 0; c < clientMessages.size(); c++ )
+    {
+        threads.emplace_back( [&, c]()
+        {
+            const std::vector< es_message_t * >& messages = clientMessages[c];
+            BenchEndpointSecurity epsec;
+            
+            epsec.setPoolSize( 1024 );
+            epsec.createDetached( [&](const EndpointSecurity::Event& event){ writer.push( epsec.takeEvent(), c ); return 0; } );
+            
+            for ( unsigned int i = 0; i < counts[c]; i++ )
+            {
+                while ( epsec.poolStats().in_use == 1024 )
+                    std::this_thread::yield();
+                
+                epsec.on_event( messages[ i % messages.size() ] );
+            }
+            
+            while ( epsec.poolStats().in_use > 0 )
+                std::this_thread::yield();
+        } );
+    }
+    
+    for ( auto& t : threads )
+        t.join();
+    
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+}
+
+// Several clients subscribed to the same events, so each of them gets every event, against the clients splitting the events
+// between them. The stream is the file mix with some process and auth events; the rate is of the distinct events.
+static void bench_shard( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    for ( unsigned int i = 0; i < 20; i++ )
+    {
+        messages.push_back( builder.fork( 1000 + i ) );
+        messages.push_back( builder.exit( 0 ) );
+        messages.push_back( builder.open( "/Users/builder/src/project/config-" + std::to_string( i ) + ".json", 1, true ) );
+    }
+    
+    std::vector< es_event_type_t > subscriptions;
+    
+    for ( es_message_t * msg : messages )
+    {
+        if ( std::find( subscriptions.begin(), subscriptions.end(), msg->event_type ) == subscriptions.end() )
+            subscriptions.push_back( msg->event_type );
+    }
+    
+    auto emptySink = [](const EndpointSecurity::Event& event){};
+    
+    for ( unsigned int clients = 1; clients <= 8; clients++ )
+    {
+        // Duplicated: every client gets the whole stream
+        EventWriter duplicatedWriter( 4096, emptySink, clients );
+        std::vector< std::vector< es_message_t * > > duplicated( clients, messages );
+        int64_t duplicatedTime = runClients( duplicated, std::vector< unsigned int >( clients, count ), duplicatedWriter );
+        duplicatedWriter.stop();
+        
+        // Sharded: every client gets the events of its types, in the proportion they have in the stream
+        std::vector< EventShard > shards = shardSubscriptions( subscriptions, clients );
+        std::vector< std::vector< es_message_t * > > sharded( shards.size() );
+        std::vector< unsigned int > shardCounts;
+        
+        for ( unsigned int c = 0; c < shards.size(); c++ )
+        {
+            for ( es_message_t * msg : messages )
+            {
+                if ( std::find( shards[c].begin(), shards[c].end(), msg->event_type ) != shards[c].end() )
+                    sharded[c].push_back( msg );
+            }
+            
+            shardCounts.push_back( (uint64_t) count * sharded[c].size() / messages.size() );
+        }
+        
+        EventWriter shardedWriter( 4096, emptySink, shards.size() );
+        int64_t shardedTime = runClients( sharded, shardCounts, shardedWriter );
+        shardedWriter.stop();
+        
+        std::cout << clients << " clients: duplicated " << (uint64_t) ( count * 1e9 / duplicatedTime ) << " events/s, "
+                  << duplicatedWriter.stats().written << " written; sharded over " << shards.size() << " "
+                  << (uint64_t) ( shardedWriter.stats().written * 1e9 / shardedTime ) << " events/s, " << shardedWriter.stats().written << " written\n";
+    }
+}
+
+// Ingest into SQLite files with 1, 2 and 4 writer threads, each with its own connection and file, and a client per writer.
+// Then reads all of them back through the merged view, and checks the count and the time order.
+static void bench_writers( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    for ( unsigned int writers : { 1, 2, 4 } )
+    {
+        char directory[] = "/tmp/maxprocmon-bench-XXXXXX";
+        
+        if ( !mkdtemp( directory ) )
+            return;
+        
+        std::vector< sqlite3 * > databases;
+        std::vector< logdb_inserter * > inserters;
+        std::vector< std::unique_ptr< EventWriter > > writerList;
+        
+        for ( unsigned int w = 0; w < writers; w++ )
+        {
+            logdb_inserter * insert;
+            databases.push_back( logdb_open( logdb_path( directory, w, writers ), &insert ) );
+            inserters.push_back( insert );
+            writerList.emplace_back( new EventWriter( 4096, [insert](const EndpointSecurity::Event& event){ logdb_insert( insert, event ); } ) );
+        }
+        
+        std::vector< std::vector< es_message_t * > > clientMessages( writers, messages );
+        std::vector< unsigned int > counts( writers, count / writers );
+        std::vector< std::thread > threads;
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int w = 0; w < writers; w++ )
+        {
+            threads.emplace_back( [&, w]()
+            {
+                BenchEndpointSecurity epsec;
+                
+                epsec.setPoolSize( 1024 );
+                epsec.createDetached( [&](const EndpointSecurity::Event& event){ writerList[w]->push( epsec.takeEvent() ); return 0; } );
+                
+                for ( unsigned int i = 0; i < counts[w]; i++ )
+                {
+                    while ( epsec.poolStats().in_use == 1024 )
+                        std::this_thread::yield();
+                    
+                    epsec.on_event( messages[ i % messages.size() ] );
+                }
+                
+                while ( epsec.poolStats().in_use > 0 )
+                    std::this_thread::yield();
+            } );
+        }
+        
+        for ( auto& t : threads )
+            t.join();
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        writerList.clear();
+        
+        // The merged view: the rows of all writers, none out of order
+        sqlite3 * merged = logdb_open_merged( directory );
+        sqlite3_stmt * stmt;
+        uint64_t rows = 0, misordered = 0;
+        sqlite3_int64 last = 0;
+        
+        sqlite3_prepare_v2( merged, "SELECT Time FROM Logs", -1, &stmt, 0 );
+        
+        while ( sqlite3_step( stmt ) == SQLITE_ROW )
+        {
+            sqlite3_int64 time = sqlite3_column_int64( stmt, 0 );
+            misordered += ( time < last );
+            last = time;
+            rows++;
+        }
+        
+        sqlite3_finalize( stmt );
+        sqlite3_close( merged );
+        
+        std::cout << writers << " writers: " << (uint64_t) ( counts[0] * writers * 1e9 / elapsed ) << " events/s, merged view "
+                  << rows << " rows, " << misordered << " out of order\n";
+        
+        for ( unsigned int w = 0; w < writers; w++ )
+        {
+            logdb_close( databases[w], inserters[w] );
+            std::string path = logdb_path( directory, w, writers );
+            unlink( path.c_str() );
+            unlink( ( path + "-wal" ).c_str() );
+            unlink( ( path + "-shm" ).c_str() );
+        }
+        
+        rmdir( directory );
+    }
+}
+
+// A burst into a slow sink, without waiting for the writer: the losses without a policy, where any event could be lost,
+// against the policy, which sheds the low priority events and keeps the critical ones
+static void bench_backpressure( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages;
+    
+    // Mostly stat traffic, repeating the same files in runs, some file writes, and the process and auth events which must not be lost
+    for ( unsigned int i = 0; i < 1000; i++ )
+    {
+        std::string path = "/Users/builder/src/project/module-" + std::to_string( i % 50 ) + ".js";
+        
+        if ( i % 50 == 0 )
+            messages.push_back( builder.fork( 1000 + i ) );
+        else if ( i % 50 == 1 )
+            messages.push_back( builder.exit( 0 ) );
+        else if ( i % 50 == 2 )
+            messages.push_back( builder.open( path, 1, true ) );
+        else if ( i % 3 == 0 )
+            messages.push_back( builder.write( path ) );
+        else
+            messages.push_back( builder.stat( "/Users/builder/src/project/module-" + std::to_string( i / 8 % 50 ) + ".js" ) );
+    }
+    
+    auto slowSink = [](const EndpointSecurity::Event& event)
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds( 2 );
+        
+        while ( std::chrono::steady_clock::now() < until )
+            ;
+    };
+    
+    BackpressurePolicy::Config defaults;
+    
+    BackpressurePolicy::Config sampled;
+    sampled.sample = 10;
+    
+    BackpressurePolicy::Config coalescing;
+    coalescing.coalesce = true;
+    
+    const struct
+    {
+        const char *                        title;
+        const BackpressurePolicy::Config *  config;
+    } runs[] =
+    {
+        { "no policy", nullptr },
+        { "default policy", &defaults },
+        { "sampling 1 of 10", &sampled },
+        { "coalescing", &coalescing },
+    };
+    
+    for ( auto& run : runs )
+    {
+        EventWriter writer( 256, slowSink );
+        BenchEndpointSecurity epsec;
+        std::unique_ptr< BackpressurePolicy > policy( run.config ? new BackpressurePolicy( *run.config ) : nullptr );
+        std::map< EndpointSecurity::EventId, uint64_t > sent, written, overflowed;
+        
+        epsec.setPoolSize( 256 );
+        
+        if ( policy )
+            epsec.setCriticalEvents( BackpressurePolicy::criticalEvents() );
+        
+        epsec.createDetached( [&](const EndpointSecurity::Event& event)
+        {
+            bool critical = policy && policy->priority( event ) == BackpressurePolicy::Critical;
+            
+            if ( policy )
+            {
+                EndpointSecurity::PoolStats pool = epsec.poolStats();
+                EventWriter::Stats stats = writer.stats( 0 );
+                unsigned int pressure = std::max( pool.in_use * 100 / pool.capacity, (unsigned int) ( stats.depth * 100 / stats.capacity ) );
+                
+                if ( policy->decide( event, pressure ) != BackpressurePolicy::Admit )
+                    return 0;
+            }
+            
+            EndpointSecurity::EventId id = event.event_id;
+            
+            if ( writer.push( epsec.takeEvent(), 0, critical ) )
+                written[ id ]++;
+            else if ( policy )
+                policy->overflowed( id );
+            else
+                overflowed[ id ]++;
+            
+            return 0;
+        } );
+        
+        uint64_t poolDrops = epsec.poolStats().exhausted;
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int i = 0; i < count; i++ )
+        {
+            epsec.on_event( messages[ i % messages.size() ] );
+            sent[ EndpointSecurity::describeEvent( messages[ i % messages.size() ]->event_type ).id ]++;
+        }
+        
+        writer.stop();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        poolDrops = epsec.poolStats().exhausted - poolDrops;
+        
+        std::cout << run.title << ": " << (double) elapsed / count << " ns/event, " << poolDrops << " lost for no event slot, " << writer.stats().overflows << " to the full queue\n";
+        
+        for ( auto id : { EndpointSecurity::EventId::Fork, EndpointSecurity::EventId::Exit, EndpointSecurity::EventId::Open,
+                          EndpointSecurity::EventId::Write, EndpointSecurity::EventId::Stat } )
+        {
+            uint64_t shed = policy ? policy->shed( id ) : 0;
+            uint64_t coalesced = policy ? policy->coalesced( id ) : 0;
+            uint64_t overflows = policy ? policy->overflows( id ) : overflowed[ id ];
+            
+            // Every event is either written or counted as lost somewhere, so nothing should be unaccounted
+            std::cout << "  " << EndpointSecurity::eventName( id ) << ": " << sent[ id ] << " sent, " << written[ id ] << " written, "
+                      << shed << " shed, " << coalesced << " coalesced, " << overflows << " to the full queue, " << epsec.slotDrops( id ) << " no slot, "
+                      << sent[ id ] - written[ id ] - shed - coalesced - overflows - epsec.slotDrops( id ) << " unaccounted\n";
+        }
+    }
+}
+
+// The synthetic messages belong to the builder, so there is nothing to retain
+class BenchRetainer : public MessageRetainer
+{
+    public:
+        const es_message_t * retain( const es_message_t * message ) override { return message; }
+        void release( const es_message_t * message ) override {}
+};
+
+// The time the delivery thread spends per message when it decodes the messages itself, and when it only queues them
+// for the decode workers, with a sink taking a microsecond. Also checks the events of each thread stay in order.
+static void bench_decode( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, std::min( count, 100000u ) );
+    std::vector< es_thread_t > threads( 16 );
+    
+    // The message time grows with the sequence, so it tells the order
+    for ( unsigned int i = 0; i < messages.size(); i++ )
+    {
+        threads[ i % threads.size() ].thread_id = 1000 + i % threads.size();
+        messages[i]->thread = &threads[ i % threads.size() ];
+    }
+    
+    BenchRetainer retainer;
+    
+    for ( unsigned int workers : { 0, 1, 2, 4 } )
+    {
+        std::mutex mutex;
+        std::map< uint64_t, double > lastTime;
+        uint64_t misordered = 0, reported = 0;
+        
+        BenchEndpointSecurity epsec;
+        epsec.setPoolSize( 1024 );
+        
+        if ( workers > 0 )
+            epsec.setDecodeWorkers( workers, &retainer );
+        
+        epsec.createDetached( [&](const EndpointSecurity::Event& event)
+        {
+            auto until = std::chrono::steady_clock::now() + std::chrono::microseconds( 1 );
+            
+            while ( std::chrono::steady_clock::now() < until )
+                ;
+            
+            double time = event.time_s + event.time_ns / 1e9;
+            std::lock_guard< std::mutex > lock( mutex );
+            double& last = lastTime[ event.process_thread_id ];
+            
+            misordered += ( time < last );
+            last = time;
+            reported++;
+            return 0;
+        } );
+        
+        auto start = std::chrono::steady_clock::now();
+        
+        // One pass over the messages, as the repeated ones would go back in time
+        for ( es_message_t * msg : messages )
+            epsec.on_message( nullptr, msg );
+        
+        auto delivered = std::chrono::steady_clock::now();
+        epsec.destroy();
+        auto done = std::chrono::steady_clock::now();
+        
+        std::cout << ( workers ? std::to_string( workers ) + " workers" : std::string( "on the delivery thread" ) ) << ": "
+                  << std::chrono::duration_cast<std::chrono::nanoseconds>( delivered - start ).count() / messages.size() << " ns/message on the delivery thread, "
+                  << std::chrono::duration_cast<std::chrono::nanoseconds>( done - start ).count() / messages.size() << " ns/message until reported, "
+                  << reported << " reported, " << misordered << " out of order\n";
+    }
+}
+
+// Inserting into SQLite from the per-event report function, a transaction per event, against the batch report
+// function with a transaction per batch.
+static void bench_report( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    for ( size_t batchSize : { 0, 16, 256 } )
+    {
+        char directory[] = "/tmp/maxprocmon-bench-XXXXXX";
+        
+        if ( !mkdtemp( directory ) )
+            return;
+        
+        std::string path = logdb_path( directory, 0, 1 );
+        logdb_inserter * insert;
+        sqlite3 * db = logdb_open( path, &insert );
+        uint64_t batches = 0, reported = 0;
+        
+        BenchEndpointSecurity epsec;
+        epsec.setPoolSize( 1024 );
+        
+        if ( batchSize == 0 )
+        {
+            epsec.createDetached( [&](const EndpointSecurity::Event& event)
+            {
+                logdb_insert( insert, event );
+                reported++;
+                return 0;
+            } );
+        }
+        else
+        {
+            epsec.createDetached( [&](const EndpointSecurity::EventBatch& batch)
+            {
+                sqlite3_exec( db, "BEGIN", 0, 0, 0 );
+                
+                for ( const EndpointSecurity::Event& event : batch )
+                    logdb_insert( insert, event );
+                
+                sqlite3_exec( db, "COMMIT", 0, 0, 0 );
+                reported += batch.size();
+                batches++;
+            }, batchSize, 10 );
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int i = 0; i < count; i++ )
+            epsec.on_event( messages[ i % messages.size() ] );
+        
+        epsec.destroy();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        
+        if ( batchSize == 0 )
+            std::cout << "per event: ";
+        else
+            std::cout << "batches of " << batchSize << ": ";
+        
+        std::cout << (uint64_t) ( count * 1e9 / elapsed ) << " events/s, " << reported << " reported";
+        
+        if ( batchSize )
+            std::cout << " in " << batches << " batches";
+        
+        std::cout << "\n";
+        
+        logdb_close( db, insert );
+        unlink( path.c_str() );
+        unlink( ( path + "-wal" ).c_str() );
+        unlink( ( path + "-shm" ).c_str() );
+        rmdir( directory );
+    }
+}
+
+// SQLite ingest through the LogBatcher, committing every row up to transactions of 10000 rows. The commit latency is
+// the time of the insert which committed the transaction, so the durability window a batch size costs.
+static void bench_ingest( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    for ( unsigned int batchSize : { 1, 10, 100, 1000, 10000 } )
+    {
+        char directory[] = "/tmp/maxprocmon-bench-XXXXXX";
+        
+        if ( !mkdtemp( directory ) )
+            return;
+        
+        std::string path = logdb_path( directory, 0, 1 );
+        logdb_inserter * insert;
+        sqlite3 * db = logdb_open( path, &insert );
+        
+        // The autocommit rows are slow, so the small batches get fewer of them
+        unsigned int rows = std::min< uint64_t >( count, 20000ull * batchSize );
+        std::vector< int64_t > commitTimes;
+        int64_t elapsed;
+        
+        {
+            LogBatcher batcher( db, insert, batchSize, 60000 );
+            BenchEndpointSecurity epsec;
+            
+            epsec.createDetached( [&](const EndpointSecurity::Event& event)
+            {
+                uint64_t commits = batcher.commits();
+                auto start = std::chrono::steady_clock::now();
+                
+                batcher.insert( event );
+                
+                if ( batcher.commits() > commits )
+                    commitTimes.push_back( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count() );
+                
+                return 0;
+            } );
+            
+            auto start = std::chrono::steady_clock::now();
+            
+            for ( unsigned int i = 0; i < rows; i++ )
+                epsec.on_event( messages[ i % messages.size() ] );
+            
+            batcher.commit();
+            elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        }
+        
+        std::sort( commitTimes.begin(), commitTimes.end() );
+        
+        std::cout << "batches of " << batchSize << ": " << (uint64_t) ( rows * 1e9 / elapsed ) << " rows/s, "
+                  << commitTimes.size() << " commits, p99 commit " << ( commitTimes.empty() ? 0 : commitTimes[ commitTimes.size() * 99 / 100 ] / 1000 ) << " us\n";
+        
+        logdb_close( db, insert );
+        unlink( path.c_str() );
+        unlink( ( path + "-wal" ).c_str() );
+        unlink( ( path + "-shm" ).c_str() );
+        rmdir( directory );
+    }
+}
+
+// Eight hours of events written into the hourly partitions and into one database. Then a query of one hour, which
+// opens one partition, and the retention of four hours, by deleting the partitions against deleting the rows.
+static void bench_partitions( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    const time_t base = 1700000000 - 1700000000 % LOGDB_HOURLY;
+    const unsigned int hours = 8;
+    
+    char directory[] = "/tmp/maxprocmon-bench-XXXXXX";
+    
+    if ( !mkdtemp( directory ) )
+        return;
+    
+    std::string single = std::string( directory ) + "/single.db";
+    logdb_inserter * singleInsert;
+    sqlite3 * singleDb = logdb_open( single, &singleInsert );
+    
+    {
+        PartitionedLog log( directory, 0, LOGDB_HOURLY, 1000, 100 );
+        LogBatcher batcher( singleDb, singleInsert, 1000, 100 );
+        BenchEndpointSecurity epsec;
+        
+        log.open( base );
+        epsec.createDetached( [&](const EndpointSecurity::Event& event){ log.insert( event ); batcher.insert( event ); return 0; } );
+        
+        for ( unsigned int i = 0; i < count; i++ )
+        {
+            es_message_t * msg = messages[ i % messages.size() ];
+            msg->time.tv_sec = base + (uint64_t) i * hours * LOGDB_HOURLY / count;
+            epsec.on_event( msg );
+        }
+    }
+    
+    // The third hour
+    int64_t from = (int64_t) ( base + 2 * LOGDB_HOURLY ) * 1000000000, to = from + (int64_t) LOGDB_HOURLY * 1000000000 - 1;
+    auto start = std::chrono::steady_clock::now();
+    sqlite3 * merged = logdb_open_merged( directory, from, to );
+    sqlite3_stmt * stmt;
+    int64_t rows = 0, attached = -2;     // main and temp are listed too
+    
+    if ( merged )
+    {
+        sqlite3_prepare_v2( merged, "SELECT count(*) FROM Logs WHERE Time BETWEEN ? AND ?", -1, &stmt, 0 );
+        sqlite3_bind_int64( stmt, 1, from );
+        sqlite3_bind_int64( stmt, 2, to );
+        
+        if ( sqlite3_step( stmt ) == SQLITE_ROW )
+            rows = sqlite3_column_int64( stmt, 0 );
+        
+        sqlite3_finalize( stmt );
+        sqlite3_prepare_v2( merged, "PRAGMA database_list", -1, &stmt, 0 );
+        
+        while ( sqlite3_step( stmt ) == SQLITE_ROW )
+            attached++;
+        
+        sqlite3_finalize( stmt );
+        sqlite3_close( merged );
+    }
+    
+    std::cout << "one hour query: " << rows << " rows from " << attached << " of " << hours << " partitions in "
+              << std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() << " us\n";
+    
+    int64_t before = (int64_t) ( base + 4 * LOGDB_HOURLY ) * 1000000000;
+    start = std::chrono::steady_clock::now();
+    unsigned int deleted = logdb_retain( directory, before );
+    auto retained = std::chrono::steady_clock::now();
+    
+    sqlite3_exec( singleDb, ( "DELETE FROM Logs WHERE Time < " + std::to_string( before ) ).c_str(), 0, 0, 0 );
+    auto rowsDeleted = std::chrono::steady_clock::now();
+    
+    std::cout << "retention of four hours: " << deleted << " partitions deleted in "
+              << std::chrono::duration_cast<std::chrono::microseconds>( retained - start ).count() << " us, "
+              << sqlite3_changes( singleDb ) << " rows deleted from one database in "
+              << std::chrono::duration_cast<std::chrono::microseconds>( rowsDeleted - retained ).count() << " us\n";
+    
+    logdb_close( singleDb, singleInsert );
+    
+    for ( const std::string& path : logdb_catalog_partitions( directory, 0, INT64_MAX ) )
+        unlink( path.c_str() );
+    
+    for ( const char * name : { "/single.db", "/single.db-wal", "/single.db-shm", "/catalog.db" } )
+        unlink( ( directory + std::string( name ) ).c_str() );
+    
+    rmdir( directory );
+}
+
+// Capturing into the segments against the SQLite partitions, the repair of a segment cut in the middle of a record,
+// and the import of the segments into the partitions
+static void bench_segments( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    char directory[] = "/tmp/maxprocmon-bench-XXXXXX";
+    
+    if ( !mkdtemp( directory ) )
+        return;
+    
+    std::string segments = SegmentLog::segmentsDirectory( directory );
+    
+    auto capture = [&]( std::function<void(const EndpointSecurity::Event&)> sink, std::function<void()> close )
+    {
+        BenchEndpointSecurity epsec;
+        epsec.createDetached( [&](const EndpointSecurity::Event& event){ sink( event ); return 0; } );
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int i = 0; i < count; i++ )
+            epsec.on_event( messages[ i % messages.size() ] );
+        
+        close();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    };
+    
+    // The SQLite partitions are those of the second writer, so the import does not add to them
+    {
+        PartitionedLog log( directory, 1, LOGDB_DAILY, 1000, 100 );
+        log.open( time( nullptr ) );
+        int64_t elapsed = capture( [&](const EndpointSecurity::Event& event){ log.insert( event ); }, [&](){ log.close(); } );
+        std::cout << "SQLite partitions: " << (uint64_t) ( count * 1e9 / elapsed ) << " events/s\n";
+    }
+    
+    {
+        SegmentLog log( directory, 0, 64 << 20, 100 );
+        log.open();
+        int64_t elapsed = capture( [&](const EndpointSecurity::Event& event){ log.insert( event ); }, [&](){ log.close(); } );
+        
+        uint64_t bytes = 0;
+        DIR * dir = opendir( segments.c_str() );
+        struct stat st;
+        
+        while ( struct dirent * entry = dir ? readdir( dir ) : nullptr )
+        {
+            if ( stat( ( segments + "/" + entry->d_name ).c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+                bytes += st.st_size;
+        }
+        
+        if ( dir )
+            closedir( dir );
+        
+        std::cout << "segments: " << (uint64_t) ( count * 1e9 / elapsed ) << " events/s, " << (double) bytes / count << " bytes/event, "
+                  << (uint64_t) ( bytes * 1e9 / elapsed / ( 1 << 20 ) ) << " MB/s\n";
+    }
+    
+    // The first segment as the one the third writer was writing when it crashed, with half a record after it
+    {
+        std::ifstream in( segments + "/events-0-0000000000.seg", std::ios::binary );
+        std::ofstream out( segments + "/events-2-0000000000.open", std::ios::binary );
+        out << in.rdbuf() << std::string( "\x40\0\0\0\x12\x34\x56\x78partial", 15 );
+    }
+    
+    {
+        SegmentLog log( directory, 2, 64 << 20, 100 );
+        auto start = std::chrono::steady_clock::now();
+        log.open();
+        std::cout << "repair of a torn segment: " << std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() << " us\n";
+    }
+    
+    SegmentLog::ImportStats stats;
+    auto start = std::chrono::steady_clock::now();
+    SegmentLog::import( directory, LOGDB_DAILY, stats );
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    
+    std::cout << "import: " << stats.segments << " segments, " << stats.records << " rows, " << (uint64_t) ( stats.records * 1e9 / elapsed ) << " rows/s, "
+              << stats.damaged << " damaged\n";
+    
+    // A writer started again after the import must not reuse the names of the imported segments, or its rows are skipped
+    {
+        SegmentLog log( directory, 0, 64 << 20, 100 );
+        log.open();
+        capture( [&](const EndpointSecurity::Event& event){ log.insert( event ); }, [&](){ log.close(); } );
+    }
+    
+    SegmentLog::import( directory, LOGDB_DAILY, stats );
+    std::cout << "import after a restart: " << stats.records << " rows, " << stats.skipped << " skipped\n";
+    
+    for ( const std::string& path : logdb_catalog_partitions( directory, 0, INT64_MAX ) )
+    {
+        unlink( path.c_str() );
+        unlink( ( path + "-wal" ).c_str() );
+        unlink( ( path + "-shm" ).c_str() );
+    }
+    
+    unlink( ( directory + std::string( "/catalog.db" ) ).c_str() );
+    rmdir( segments.c_str() );
+    rmdir( directory );
+}
+
+// The size of the Detail blob per event against the JSON of the same fields, and the time to encode it
+static void bench_detail( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    
+    for ( unsigned int i = 0; i < 100; i++ )
+    {
+        messages.push_back( builder.fork( 1000 + i ) );
+        messages.push_back( builder.exit( 0 ) );
+    }
+    
+    uint64_t events = 0, blobBytes = 0, jsonBytes = 0, mismatches = 0;
+    int64_t encodeTime = 0;
+    std::string blob;
+    
+    BenchEndpointSecurity epsec;
+    epsec.createDetached( [&](const EndpointSecurity::Event& event)
+    {
+        auto start = std::chrono::steady_clock::now();
+        EventBlob::encode( event, blob );
+        encodeTime += std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        
+        EventBlob::Value pid;
+        
+        if ( !EventBlob::field( blob, "pid", pid ) || (pid_t) pid.number != event.process_pid )
+            mismatches++;
+        
+        events++;
+        blobBytes += blob.length();
+        jsonBytes += EventBlob::json( blob ).length();
+        return 0;
+    } );
+    
+    for ( unsigned int i = 0; i < count; i++ )
+        epsec.on_event( messages[ i % messages.size() ] );
+    
+    std::cout << events << " events: blob " << (double) blobBytes / events << " bytes/event, JSON " << (double) jsonBytes / events
+              << " bytes/event (" << (double) jsonBytes / blobBytes << "x), encoding " << (double) encodeTime / events << " ns/event, "
+              << mismatches << " decoded pids differ\n";
+}
+
+// Time from receiving an auth message to the response, with a synchronous sink taking 20 microseconds as a slow disk
+// would. Before the response was moved ahead, it was sent after on_event() and so after the sink.
+static void bench_auth( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages;
+    
+    for ( unsigned int i = 0; i < 1000; i++ )
+        messages.push_back( builder.open( "/Users/builder/project/src/file" + std::to_string( i ) + ".cpp", 1, true ) );
+    
+    auto slowSink = [](const EndpointSecurity::Event& event)
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds( 20 );
+        
+        while ( std::chrono::steady_clock::now() < until )
+            ;
+        
+        return 0;
+    };
+    
+    // The deadline is a minute ahead of the dispatch, so the latency is that minus the slack
+    const int64_t budget = 60000000000LL;
+    BenchEndpointSecurity epsec;
+    epsec.createDetached( slowSink );
+    
+    int64_t maxLatency = 0, totalLatency = 0;
+    
+    for ( unsigned int i = 0; i < count; i++ )
+    {
+        es_message_t * msg = messages[ i % messages.size() ];
+        auto start = std::chrono::steady_clock::now();
+        epsec.on_event( msg );
+        int64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        
+        maxLatency = std::max( maxLatency, latency );
+        totalLatency += latency;
+    }
+    
+    std::cout << "respond after the sink: mean " << totalLatency / count << " ns, max " << maxLatency << " ns to the response\n";
+    
+    BenchEndpointSecurity responding;
+    responding.createDetached( slowSink );
+    
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info( &timebase );
+    uint64_t budgetTicks = budget * timebase.denom / timebase.numer;
+    
+    for ( unsigned int i = 0; i < count; i++ )
+    {
+        es_message_t * msg = messages[ i % messages.size() ];
+        msg->deadline = mach_absolute_time() + budgetTicks;
+        responding.on_message( nullptr, msg );
+    }
+    
+    EndpointSecurity::AuthStats stats = responding.authStats();
+    std::cout << "respond before the sink: mean " << budget - stats.total_slack_ns / (int64_t) stats.responses << " ns, max "
+              << budget - stats.min_slack_ns << " ns to the response, " << stats.missed << " deadlines missed\n";
+}
+
+// The cost of recording a latency value, from one thread and from several, and of taking the snapshot
+static void bench_latency( unsigned int count )
+{
+    const unsigned int threadCounts[] = { 1, 4 };
+    
+    for ( unsigned int threads : threadCounts )
+    {
+        std::vector< std::thread > workers;
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int t = 0; t < threads; t++ )
+        {
+            workers.emplace_back( [=]()
+            {
+                for ( unsigned int i = 0; i < count; i++ )
+                    LatencyHistograms::record( LatencyHistograms::Delivery, EndpointSecurity::EventId::Unknown, ( i * 2654435761u ) % 10000000 );
+            });
+        }
+        
+        for ( auto& w : workers )
+            w.join();
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << threads << " thread(s): " << elapsed / ( (int64_t) count * threads ) << " ns per record\n";
+    }
+    
+    // The delivery and response intervals through on_message()
+    EsMessageBuilder builder;
+    es_message_t * msg = builder.open( "/Users/builder/project/src/main.cpp", 1, true );
+    BenchEndpointSecurity epsec;
+    epsec.createDetached( [](const EndpointSecurity::Event& event){ return 0; } );
+    
+    for ( unsigned int i = 0; i < 1000; i++ )
+    {
+        msg->mach_time = mach_absolute_time();
+        msg->deadline = msg->mach_time + 60000000000LL;
+        epsec.on_message( nullptr, msg );
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    LatencyHistograms::Snapshot snapshot = LatencyHistograms::snapshot();
+    std::string json = snapshot.json();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+    
+    std::cout << "snapshot and JSON: " << elapsed << " us, " << json.size() << " bytes\n" << snapshot.text();
+}
+
+// The std::map based decoders which flags.h used to have, kept for the comparison
+template< size_t N > static std::map< unsigned int, const char *> legacyMap( const FlagName (&flags)[N] )
+{
+    std::map< unsigned int, const char *> map;
+    
+    for ( auto& f : flags )
+        map[ f.value ] = f.name;
+    
+    return map;
+}
+
+static std::string legacyGetBitmask( const std::map< unsigned int, const char *>& map, unsigned int value )
+{
+    std::string res;
+    unsigned int origvalue = value;
+    
+    for ( auto i : map )
+    {
+        if ( value & i.first )
+        {
+            value ^= i.first;
+            
+            if ( !res.empty() )
+                res += "|";
+            
+            res += i.second;
+        }
+    }
+    
+    if ( value )
+        res += " [" + std::to_string(value) + "?] (";
+    else
+        res += " (";
+
+    res += std::to_string( origvalue ) + ")";
+    return res;
+}
+
+static std::string legacyGetValue( const std::map< unsigned int, const char *>& map, unsigned int value )
+{
+    std::string res;
+    
+    auto i = map.find( value );
+    
+    if ( i != map.end() )
+        res = i->second;
+    else
+        res = "[?]";
+    
+    res += " (" + std::to_string( value ) + ")";
+    return res;
+}
+
+// The compile-time flag tables against the std::map ones. Also checks they produce the same text.
+static void bench_flags( unsigned int count )
+{
+    auto codesign = legacyMap( flags_codesign );
+    auto open = legacyMap( flags_open );
+    auto fork = legacyMap( flags_attr_fork );
+    auto fcntl = legacyMap( flags_fcntl );
+    
+    // Typical values: a signed platform binary, open(O_RDONLY), and random ones for the check
+    std::vector< unsigned int > values = { 0x26000001, 0x22000005, 0x00000001, 0x00000003, 0x00000202, 0, 0xFFFFFFFF };
+    
+    for ( unsigned int i = 0; i < 1000; i++ )
+        values.push_back( (unsigned int) rand() * 2654435761u );
+    
+    unsigned int mismatches = 0;
+    char buf[ FLAG_DESC_MAX ];
+    
+    for ( unsigned int v : values )
+    {
+        if ( legacyGetBitmask( codesign, v ) != std::string( buf, formatBitmask( buf, sizeof(buf), value_map_codesign, v ) ) )
+            mismatches++;
+        
+        if ( legacyGetBitmask( open, v ) != std::string( buf, formatBitmask( buf, sizeof(buf), value_map_open, v ) ) )
+            mismatches++;
+        
+        if ( legacyGetBitmask( fork, v ) != std::string( buf, formatBitmask( buf, sizeof(buf), value_map_attr_fork, v ) ) )
+            mismatches++;
+        
+        if ( legacyGetValue( fcntl, v % 128 ) != std::string( buf, formatValue( buf, sizeof(buf), value_map_fcntl, v % 128 ) ) )
+            mismatches++;
+    }
+    
+    std::cout << "output mismatches: " << mismatches << "\n";
+    
+    auto run = [&]( const char * title, std::function<size_t(unsigned int)> func )
+    {
+        size_t total = 0;
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int i = 0; i < count; i++ )
+            total += func( values[ i % 8 ] );
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << title << ": " << (double) elapsed / count << " ns/call (" << total << " chars)\n";
+    };
+    
+    run( "codesign getBitmask", [&]( unsigned int v ){ return legacyGetBitmask( codesign, v ).length(); } );
+    run( "codesign formatBitmask", [&]( unsigned int v ){ return formatBitmask( buf, sizeof(buf), value_map_codesign, v ); } );
+    run( "open getBitmask", [&]( unsigned int v ){ return legacyGetBitmask( open, v ).length(); } );
+    run( "open formatBitmask", [&]( unsigned int v ){ return formatBitmask( buf, sizeof(buf), value_map_open, v ); } );
+    run( "fcntl getValue", [&]( unsigned int v ){ return legacyGetValue( fcntl, v % 128 ).length(); } );
+    run( "fcntl formatValue", [&]( unsigned int v ){ return formatValue( buf, sizeof(buf), value_map_fcntl, v % 128 ); } );
+}
+
+// The timestamp formatting which on_event() used to do for every event
+static std::string legacyTimespec( time_t tval, long nsec = -1 )
+{
+    char outtime[ 256 ];
+    size_t len = strftime( outtime, sizeof(outtime) - 1, "%Y-%m-%d %H:%M:%S", std::localtime(&tval) );
+    
+    if ( nsec >= 0 )
+        len += snprintf( outtime + len, sizeof(outtime) - len, ".%ld", nsec );
+    
+    return std::string( outtime, len );
+}
+
+// Event and process start time formatting: localtime per event, the cached formatter, and not formatting at all
+static void bench_time( unsigned int count )
+{
+    EsMessageBuilder builder;
+    std::vector< es_message_t * > messages = buildFileMix( builder, 1000 );
+    size_t total = 0;
+    
+    runEvents( "localtime per event", messages, count, [&total](const EndpointSecurity::Event& event)
+    {
+        total += legacyTimespec( event.time_s, event.time_ns ).length() + legacyTimespec( event.process_start_time_s ).length();
+        return 0;
+    } );
+    
+    runEvents( "cached formatter", messages, count, [&total](const EndpointSecurity::Event& event)
+    {
+        total += event.timestamp().length() + event.process_start_time().length();
+        return 0;
+    } );
+    
+    runEvents( "not formatted", messages, count, [](const EndpointSecurity::Event& event){ return 0; } );
+    
+    std::cout << "(" << total << " chars)\n";
+}
+
+// The exec arguments encoding which on_exec() used to do
+static void legacyEncodeArgs( std::string& dst, const std::vector< std::string_view >& args )
+{
+    dst.clear();
+    
+    for ( size_t i = 0; i < args.size(); i++ )
+    {
+        std::string arg( args[i] );
+        
+        // Escape quotes in the args
+        arg = std::regex_replace(arg, std::regex("\""), "\\\"" );
+
+        if ( i > 0 )
+            dst.append( " " );
+        
+        dst += "\"" + arg + "\"";
+    }
+}
+
+// Encoding the arguments of a 10k-argument exec, as the compiler and linker invocations have. es_exec_arg() reads
+// the message layout which is private to EndpointSecurity, so the arguments are encoded directly rather than via on_exec().
+static void bench_exec( unsigned int count )
+{
+    std::deque< std::string > storage;
+    std::vector< std::string_view > args;
+    
+    for ( unsigned int i = 0; i < 10000; i++ )
+    {
+        if ( i % 10 == 0 )
+            storage.push_back( "-DVERSION_" + std::to_string( i ) + "=\"1.0." + std::to_string( i ) + "\"" );
+        else
+            storage.push_back( "/Users/builder/ci/workspace/project/build/obj/module_" + std::to_string( i ) + ".o" );
+        
+        args.push_back( storage.back() );
+    }
+    
+    std::string legacy, encoded;
+    legacyEncodeArgs( legacy, args );
+    EndpointSecurity::encodeArgs( encoded, args.data(), args.size() );
+    std::cout << "output " << (legacy == encoded ? "matches" : "DIFFERS") << ", " << encoded.length() << " chars\n";
+    
+    auto run = [&]( const char * title, std::function<void()> func )
+    {
+        uint64_t startallocs = allocations;
+        auto start = std::chrono::steady_clock::now();
+        
+        for ( unsigned int i = 0; i < count; i++ )
+            func();
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << title << ": " << (double) elapsed / count / 1000 << " us/exec, " << (double) (allocations - startallocs) / count << " allocations/exec\n";
+    };
+    
+    run( "std::regex per argument", [&](){ legacyEncodeArgs( legacy, args ); } );
+    run( "single pass encoder", [&](){ EndpointSecurity::encodeArgs( encoded, args.data(), args.size() ); } );
+}
+
+static const struct
+{
+    const char * name;
+    const char * description;
+    void (*func)( unsigned int count );
+} benchmarks[] = {
+    { "alloc", "allocations per decoded event", bench_alloc },
+    { "views", "copying the event strings versus pointing into the message", bench_views },
+    { "process", "per-process information from the process cache", bench_process },
+    { "pool", "handing the events to another thread by copying and by the pool slots", bench_pool },
+    { "queue", "clients queueing the events for the writer thread", bench_queue },
+    { "shard", "clients duplicating the subscriptions against the sharded ones, 1 to 8 clients", bench_shard },
+    { "writers", "SQLite ingest with 1, 2 and 4 writer threads and files, read back through the merged view", bench_writers },
+    { "backpressure", "losses per event type in a burst, without and with the backpressure policy", bench_backpressure },
+    { "decode", "decoding on the delivery thread against the decode workers", bench_decode },
+    { "report", "SQLite inserts from the per-event report function against the batch report function", bench_report },
+    { "ingest", "SQLite rows per second and commit latency with transactions of 1 to 10000 rows", bench_ingest },
+    { "segments", "capture into the append-only segments against the SQLite partitions, their repair and import", bench_segments },
+    { "partitions", "a one hour query and the retention over the hourly partitions against one database", bench_partitions },
+    { "detail", "bytes per event of the Detail blob against JSON, and the encoding time", bench_detail },
+    { "auth", "auth response latency with a slow synchronous sink", bench_auth },
+    { "latency", "recording into the latency histograms and taking the snapshot", bench_latency },
+    { "exec", "encoding the arguments of a 10k-argument exec", bench_exec },
+    { "flags", "flag table decoders against the std::map ones", bench_flags },
+    { "time", "timestamp formatting with localtime against the cached formatter", bench_time },
+};
+
+bool es_bench( const std::string& name, unsigned int count )
+{
+    for ( auto& b : benchmarks )
+    {
+        if ( name == b.name )
+        {
+            if ( !countingAllocations )
+                std::cout << "allocations are not counted in this build, see MAXPROCMON_COUNT_ALLOCATIONS\n";
+            
+            b.func( count );
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void es_bench_list()
+{
+    for ( auto& b : benchmarks )
+        std::cout << "    " << b.name << " - " << b.description << "\n";
+}
@@ -0,0 +1,12 @@
+#ifndef ESBENCH_H
+#define ESBENCH_H
+
+#include <string>
+
+// Runs the named benchmark, feeding the synthetic messages through EndpointSecurity. Returns false if there is no such benchmark.
+bool es_bench( const std::string& name, unsigned int count );
+
+// Lists the available benchmarks
+void es_bench_list();
+
+#endif // ESBENCH_H
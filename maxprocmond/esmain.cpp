@@ -22,99 +22,131 @@
 //OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 //SOFTWARE.
 
+#include <chrono>
 #include <iostream>
-#include <vector>
 #include <mutex>
+#include <vector>
+#include <signal.h>
 #include <unistd.h>
+#include <string.h>
+#include <strings.h>
 
+#include "BackpressurePolicy.h"
 #include "EndpointSecurity.h"
+#include "EventShards.h"
+#include "EventWriter.h"
+#include "LatencyHistograms.h"
+#include "PartitionedLog.h"
+#include "SegmentLog.h"
+#include "esbench.h"
+#include "esstatus.h"
+#include "logdb.h"
 #include "sqlite3.h"
 
+// The events queued for the writer thread, and the event slots of each client. The slot pool limits how many events
+// a client could have in flight, so the queue is sized for a few clients.
+static const size_t WRITER_QUEUE_SIZE = 4096;
+static const unsigned int CLIENT_POOL_SIZE = 1024;
+
+// On shutdown the writers get this long to write the queued events; the rest are dropped. Should anything else hang,
+// the process is killed after the limit.
+static const std::chrono::milliseconds SHUTDOWN_DRAIN_TIME( 3000 );
+static const unsigned int SHUTDOWN_LIMIT_SECONDS = 10;
+
+// The rows are committed in transactions of this many, or after the first one waited this long
+static const unsigned int COMMIT_ROWS = 1000;
+static const unsigned int COMMIT_DELAY_MS = 100;
+
 // First is a notify event, second is an auth event or ES_EVENT_TYPE_LAST if there is no auth event
 typedef std::tuple<unsigned int, unsigned int> helpdata;
 
-static std::map< std::string, helpdata > supportedEvents = {
-        { "access", { ES_EVENT_TYPE_NOTIFY_ACCESS, ES_EVENT_TYPE_LAST } },
-        { "chdir", { ES_EVENT_TYPE_NOTIFY_CHDIR, ES_EVENT_TYPE_AUTH_CHDIR } },
-        { "chroot", { ES_EVENT_TYPE_NOTIFY_CHROOT, ES_EVENT_TYPE_AUTH_CHROOT } },
-        { "clone", { ES_EVENT_TYPE_NOTIFY_CLONE, ES_EVENT_TYPE_AUTH_CLONE } },
-        { "close", { ES_EVENT_TYPE_NOTIFY_CLOSE, ES_EVENT_TYPE_LAST } },
-        { "create", { ES_EVENT_TYPE_NOTIFY_CREATE, ES_EVENT_TYPE_AUTH_CREATE } },
-        { "deleteextattr", { ES_EVENT_TYPE_NOTIFY_DELETEEXTATTR, ES_EVENT_TYPE_AUTH_DELETEEXTATTR } },
-        { "dup", { ES_EVENT_TYPE_NOTIFY_DUP, ES_EVENT_TYPE_LAST } },
-        { "exchangedata", { ES_EVENT_TYPE_NOTIFY_EXCHANGEDATA, ES_EVENT_TYPE_AUTH_EXCHANGEDATA } },
-        { "exec", { ES_EVENT_TYPE_NOTIFY_EXEC, ES_EVENT_TYPE_AUTH_EXEC } },
-        { "exit", { ES_EVENT_TYPE_NOTIFY_EXIT, ES_EVENT_TYPE_LAST } },
-        { "fcntl", { ES_EVENT_TYPE_NOTIFY_FCNTL, ES_EVENT_TYPE_AUTH_FCNTL } },
-        { "file_provider_materialize", { ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_MATERIALIZE, ES_EVENT_TYPE_AUTH_FILE_PROVIDER_MATERIALIZE } },
-        { "file_provider_update", { ES_EVENT_TYPE_NOTIFY_FILE_PROVIDER_UPDATE, ES_EVENT_TYPE_AUTH_FILE_PROVIDER_UPDATE } },
-        { "fork", { ES_EVENT_TYPE_NOTIFY_FORK, ES_EVENT_TYPE_LAST } },
-        { "fsgetpath", { ES_EVENT_TYPE_NOTIFY_FSGETPATH, ES_EVENT_TYPE_AUTH_FSGETPATH } },
-        { "getattrlist", { ES_EVENT_TYPE_NOTIFY_GETATTRLIST, ES_EVENT_TYPE_AUTH_GETATTRLIST } },
-        { "getextattr", { ES_EVENT_TYPE_NOTIFY_GETEXTATTR, ES_EVENT_TYPE_AUTH_GETEXTATTR } },
-        { "get_task", { ES_EVENT_TYPE_NOTIFY_GET_TASK, ES_EVENT_TYPE_AUTH_GET_TASK } },
-        { "iokit_open", { ES_EVENT_TYPE_NOTIFY_IOKIT_OPEN, ES_EVENT_TYPE_AUTH_IOKIT_OPEN } },
-        { "kextload", { ES_EVENT_TYPE_NOTIFY_KEXTLOAD, ES_EVENT_TYPE_AUTH_KEXTLOAD } },
-        { "kextunload", { ES_EVENT_TYPE_NOTIFY_KEXTUNLOAD, ES_EVENT_TYPE_LAST } },
-        { "link", { ES_EVENT_TYPE_NOTIFY_LINK, ES_EVENT_TYPE_AUTH_LINK } },
-        { "listextattr", { ES_EVENT_TYPE_NOTIFY_LISTEXTATTR, ES_EVENT_TYPE_AUTH_LISTEXTATTR } },
-        { "lookup", { ES_EVENT_TYPE_NOTIFY_LOOKUP, ES_EVENT_TYPE_LAST } },
-        { "mmap", { ES_EVENT_TYPE_NOTIFY_MMAP, ES_EVENT_TYPE_AUTH_MMAP } },
-        { "mount", { ES_EVENT_TYPE_NOTIFY_MOUNT, ES_EVENT_TYPE_AUTH_MOUNT } },
-        { "mprotect", { ES_EVENT_TYPE_NOTIFY_MPROTECT, ES_EVENT_TYPE_AUTH_MPROTECT } },
-        { "open", { ES_EVENT_TYPE_NOTIFY_OPEN, ES_EVENT_TYPE_AUTH_OPEN } },
-        { "proc_check", { ES_EVENT_TYPE_NOTIFY_PROC_CHECK, ES_EVENT_TYPE_AUTH_PROC_CHECK } },
-        { "pty_close", { ES_EVENT_TYPE_NOTIFY_PTY_CLOSE, ES_EVENT_TYPE_LAST } },
-        { "pty_grant", { ES_EVENT_TYPE_NOTIFY_PTY_GRANT, ES_EVENT_TYPE_LAST } },
-        { "readdir", { ES_EVENT_TYPE_NOTIFY_READDIR, ES_EVENT_TYPE_AUTH_READDIR } },
-        { "readlink", { ES_EVENT_TYPE_NOTIFY_READLINK, ES_EVENT_TYPE_AUTH_READLINK } },
-        { "rename", { ES_EVENT_TYPE_NOTIFY_RENAME, ES_EVENT_TYPE_AUTH_RENAME } },
-        { "setacl", { ES_EVENT_TYPE_NOTIFY_SETACL, ES_EVENT_TYPE_AUTH_SETACL } },
-        { "setattrlist", { ES_EVENT_TYPE_NOTIFY_SETATTRLIST, ES_EVENT_TYPE_AUTH_SETATTRLIST } },
-        { "setextattr", { ES_EVENT_TYPE_NOTIFY_SETEXTATTR, ES_EVENT_TYPE_AUTH_SETEXTATTR } },
-        { "setflags", { ES_EVENT_TYPE_NOTIFY_SETFLAGS, ES_EVENT_TYPE_AUTH_SETFLAGS } },
-        { "setmode", { ES_EVENT_TYPE_NOTIFY_SETMODE, ES_EVENT_TYPE_AUTH_SETMODE } },
-        { "setowner", { ES_EVENT_TYPE_NOTIFY_SETOWNER, ES_EVENT_TYPE_AUTH_SETOWNER } },
-        { "settime", { ES_EVENT_TYPE_NOTIFY_SETTIME, ES_EVENT_TYPE_AUTH_SETTIME } },
-        { "signal", { ES_EVENT_TYPE_NOTIFY_SIGNAL, ES_EVENT_TYPE_AUTH_SIGNAL } },
-        { "stat", { ES_EVENT_TYPE_NOTIFY_STAT, ES_EVENT_TYPE_LAST } },
-        { "truncate", { ES_EVENT_TYPE_NOTIFY_TRUNCATE, ES_EVENT_TYPE_AUTH_TRUNCATE } },
-        { "uipc_bind", { ES_EVENT_TYPE_NOTIFY_UIPC_BIND, ES_EVENT_TYPE_AUTH_UIPC_BIND } },
-        { "uipc_connect", { ES_EVENT_TYPE_NOTIFY_UIPC_CONNECT, ES_EVENT_TYPE_AUTH_UIPC_CONNECT } },
-        { "unlink", { ES_EVENT_TYPE_NOTIFY_UNLINK, ES_EVENT_TYPE_AUTH_UNLINK } },
-        { "unmount", { ES_EVENT_TYPE_NOTIFY_UNMOUNT, ES_EVENT_TYPE_LAST } },
-        { "utimes", { ES_EVENT_TYPE_NOTIFY_UTIMES, ES_EVENT_TYPE_AUTH_UTIMES } },
-        { "write", { ES_EVENT_TYPE_NOTIFY_WRITE, ES_EVENT_TYPE_LAST } }
-};
-
-static int event_callback(sqlite3 *db, sqlite3_stmt *pStmt, const EndpointSecurity::Event& event )
+// Built from the EndpointSecurity event table
+static std::map< std::string, helpdata > buildSupportedEvents()
 {
-//    if (event.process_is_es_client) {
-//        return 0;
-//    }
-    static std::mutex m;
-    std::lock_guard<std::mutex> lockGuard(m);
+    std::map< std::string, helpdata > events;
     
-    sqlite3_bind_text(pStmt, 1, event.event.data(), event.event.length(), NULL);
-    sqlite3_bind_double(pStmt, 2, event.time_s);
-    sqlite3_bind_double(pStmt, 3, event.time_ns);
-    sqlite3_bind_text(pStmt, 4, event.process_executable.data(), event.process_executable.length(), NULL);
-    if (event.filename.length() == 0) {
-//        if (event.process_team_id.length() > 0) {
-//            sqlite3_bind_text(pStmt, 5, event.process_team_id.data(), event.process_team_id.length(), NULL);
-//        }
-        std::string msg = "<missing>";
-        sqlite3_bind_text(pStmt, 5, msg.data(), msg.length(), NULL);
-    } else {
-        sqlite3_bind_text(pStmt, 5, event.filename.data(), event.filename.length(), NULL);
+    for ( unsigned int type = 0; type < ES_EVENT_TYPE_LAST; type++ )
+    {
+        const EndpointSecurity::EventDescriptor& descriptor = EndpointSecurity::describeEvent( (es_event_type_t) type );
+        
+        if ( !descriptor.name )
+            continue;
+        
+        auto it = events.emplace( descriptor.name, helpdata( ES_EVENT_TYPE_LAST, ES_EVENT_TYPE_LAST ) ).first;
+        
+        if ( descriptor.is_auth )
+            std::get<1>( it->second ) = type;
+        else
+            std::get<0>( it->second ) = type;
     }
     
-    int rc = sqlite3_step(pStmt);
-    sqlite3_reset(pStmt);
+    return events;
+}
+
+static std::map< std::string, helpdata > supportedEvents = buildSupportedEvents();
+
+// Set by SIGUSR1, which asks to dump the latency histograms
+static volatile sig_atomic_t dumpRequested = 0;
+
+static void on_sigusr1( int )
+{
+    dumpRequested = 1;
+}
+
+// Set by SIGTERM or SIGINT, which ask to shut down
+static volatile sig_atomic_t stopRequested = 0;
+
+static void on_sigterm( int )
+{
+    stopRequested = 1;
+}
+
+// The running clients and their policies, for the status. The status is asked for on an XPC queue, so the mutex guards
+// the vectors while es_main() adds to them; es_main() reads them without it, as it is the only one changing them.
+static std::vector< EndpointSecurity * > clients;
+static std::vector< BackpressurePolicy * > policies;
+static std::mutex clientsMutex;
+
+char * es_status( void )
+{
+    std::string shed;
     
-    std::cout << "event : " << event.event << "\n" << "  time: " << event.timestamp << "\n";
+    {
+        std::lock_guard< std::mutex > lock( clientsMutex );
+        shed = BackpressurePolicy::json( policies, clients );
+    }
+    
+    std::string json = "{\"latency\":" + LatencyHistograms::snapshot().json() + ",\"shed\":" + shed + "}";
+    return strdup( json.c_str() );
+}
 
-    for ( auto k : event.parameters )
+// How full the client's event pool or queue is, in percent, whichever is more
+static unsigned int client_pressure( EndpointSecurity * epsec, EventWriter * writer, unsigned int queue )
+{
+    EndpointSecurity::PoolStats pool = epsec->poolStats();
+    EventWriter::Stats stats = writer->stats( queue );
+    
+    return std::max( pool.in_use * 100 / pool.capacity, (unsigned int) ( stats.depth * 100 / stats.capacity ) );
+}
+
+// The printout is shared by the writer threads
+static std::mutex outputMutex;
+
+// The sinks. Each writer thread has its own partitions, or its own segments, so only the output needs locking.
+static int event_callback( PartitionedLog * log, SegmentLog * segments, const EndpointSecurity::Event& event )
+{
+//    if (event.process_is_es_client) {
+//        return 0;
+//    }
+    if ( segments )
+        segments->insert( event );
+    else
+        log->insert( event );
+    
+    std::lock_guard< std::mutex > lock( outputMutex );
+    std::cout << "event : " << event.event << "\n" << "  time: " << event.timestamp() << "\n";
+
+    for ( auto k : event.parameters() )
         std::cout << "  " <<  k.first << " : " << k.second << "\n";
     
     std::cout << " process:\n"
@@ -137,9 +169,9 @@ static int event_callback(sqlite3 *db, sqlite3_stmt *pStmt, const EndpointSecuri
         << "        SID : " << event.process_sid << "\n"
         << "   threadid : " << event.process_sid << "\n"
         << "       path : " << event.process_executable << "\n"
-        << "    csflags : " << event.process_csflags_desc << "\n"
+        << "    csflags : " << event.process_csflags_desc() << "\n"
         << "    sign_id : " << event.process_signing_id << "\n"
-        << "    started : " << event.process_start_time << "\n"
+        << "    started : " << event.process_start_time() << "\n"
         << "      extra : " << (event.process_is_platform_binary ? "(platform_binary) " : "")
                             << (event.process_is_es_client ? "(es_client) " : "") << "\n";
                             
@@ -183,7 +215,30 @@ static void help( const char * exe )
         "               for example, -e chdir -e +open -e close\n"
         "              + in front of event means it will be handled as auth event\n"
         " -p <path>   only monitor processes started from this path (including subpaths)\n"
-        "  --test-max-clients   tests you how many clients you can create\n";
+        "  -c <n>     create n clients. Without --shard each of them subscribes to all the events\n"
+        "  --shard    split the events between the clients: auth and process events on the first one,\n"
+        "               the file events spread over the others by their volume\n"
+        "  -w <n>     write with n threads, each to its own logs-<period>-<k>.db. The clients are spread over them\n"
+        "  --root <dir>   keep the databases in the directory, " LOGDB_DIRECTORY " by default\n"
+        "  --partition hourly|daily   start a new database file every hour or day (UTC), daily by default\n"
+        "  --retain <hours>   delete the database files with the events older than that, none by default\n"
+        "  --decode-workers <n>   decode the messages of each client on n worker threads, not with -p\n"
+        "  --commit-rows <n>   commit the rows in transactions of n, 1000 by default; 1 commits each row\n"
+        "  --commit-ms <ms>    commit the transaction at the latest ms after its first row, 100 by default\n"
+        "  --segments <MB>   write the events into append-only segment files of that size in <root>/segments instead,\n"
+        "               for the peak loads; --commit-ms is how long the events wait in the write buffer\n"
+        "  --import    imports the complete segments into the databases of --partition, and deletes them\n"
+        "  --query <sql>   runs the query over the Logs and LogsView of all the databases, merged in time order\n"
+        "  --from <time> --to <time>   only read the databases with the events in between, in seconds since the epoch\n"
+        "\nWhen a client's event pool or queue fills up, auth, exec, fork and exit events are always kept, and:\n"
+        "  --low <event,...>     the events shed first, stat,lookup,readdir,access by default\n"
+        "  --shed-low <percent>  how full before the low priority events are shed, 50 by default\n"
+        "  --shed-normal <percent>   how full before the other events are shed, 90 by default\n"
+        "  --sample <n>          keep one of n events which would be shed\n"
+        "  --coalesce            drop the repeats of an event from the same process on the same file while above --shed-low\n"
+        "  --test-max-clients   tests you how many clients you can create\n"
+        "  --bench <name> [count]   runs the benchmark on synthetic events, no client is created\n"
+        "\nSend SIGUSR1 to print the latency histograms to stderr, SIGTERM or SIGINT to write the queued events and exit\n";
     
     std::cout << "\nEvents you can listen to:\n";
 
@@ -194,14 +249,80 @@ static void help( const char * exe )
         else
             std::cout << "      " << e.first << "\n";
     }
+    
+    std::cout << "\nBenchmarks:\n";
+    es_bench_list();
 }
 
 
+// Runs the query over the merged databases with the events between the times and prints the rows, the columns separated by |
+static bool query_logs( const std::string& root, const char * query, int64_t from, int64_t to )
+{
+    // The databases from before the partitions are read as well, so they are converted first, if the daemon has not yet
+    if ( !logdb_upgrade_legacy( root ) )
+        return false;
+    
+    sqlite3 * db = logdb_open_merged( root, from, to );
+    
+    if ( !db )
+        return false;
+    
+    sqlite3_stmt * pStmt;
+    
+    if ( sqlite3_prepare_v2( db, query, -1, &pStmt, 0 ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return false;
+    }
+    
+    while ( sqlite3_step( pStmt ) == SQLITE_ROW )
+    {
+        for ( int i = 0; i < sqlite3_column_count( pStmt ); i++ )
+        {
+            const unsigned char * value = sqlite3_column_text( pStmt, i );
+            std::cout << ( i > 0 ? "|" : "" ) << ( value ? (const char *) value : "" );
+        }
+        
+        std::cout << "\n";
+    }
+    
+    sqlite3_finalize( pStmt );
+    sqlite3_close( db );
+    return true;
+}
+
+// Imports the segments into the partitions and prints how many rows went in
+static bool import_segments( const std::string& root, unsigned int period )
+{
+    SegmentLog::ImportStats stats;
+    auto start = std::chrono::steady_clock::now();
+    bool imported = SegmentLog::import( root, period, stats );
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    
+    std::cerr << "imported " << stats.segments << " segments, " << stats.records << " rows, " << (uint64_t) ( stats.records / seconds ) << " rows/s; "
+              << stats.skipped << " rows were imported before, " << stats.damaged << " segments damaged\n";
+    return imported;
+}
+
 void es_main ( int argc, char ** argv )
 {
     std::string monitoredPath;
     std::vector< es_event_type_t > subscriptions;
     unsigned int totalClients = 1;
+    unsigned int totalWriters = 1;
+    unsigned int decodeWorkers = 0;
+    unsigned int commitRows = COMMIT_ROWS;
+    unsigned int commitDelayMs = COMMIT_DELAY_MS;
+    std::string root = LOGDB_DIRECTORY;
+    unsigned int period = LOGDB_DAILY;
+    unsigned int retainHours = 0;
+    const char * query = nullptr;
+    bool import = false;
+    uint64_t segmentBytes = 0;
+    int64_t queryFrom = 0, queryTo = INT64_MAX;
+    BackpressurePolicy::Config policyConfig;
+    bool shard = false;
     bool verbose = false;
     
     if ( argc == 1 )
@@ -336,6 +457,155 @@ void es_main ( int argc, char ** argv )
 
             totalClients = std::stoi( argv[ca] );
         }
+        else if ( arg == "-w" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "-w requires an argument\n";
+                exit(1);
+            }
+            
+            totalWriters = std::stoi( argv[ca] );
+            
+            if ( totalWriters < 1 || totalWriters > LOGDB_MAX_SHARDS )
+            {
+                std::cerr << "-w must be between 1 and " << LOGDB_MAX_SHARDS << "\n";
+                exit(1);
+            }
+        }
+        else if ( arg == "--decode-workers" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "--decode-workers requires an argument\n";
+                exit(1);
+            }
+            
+            decodeWorkers = std::stoi( argv[ca] );
+        }
+        else if ( arg == "--commit-rows" || arg == "--commit-ms" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << arg << " requires an argument\n";
+                exit(1);
+            }
+            
+            if ( arg == "--commit-rows" )
+                commitRows = std::max( std::stoi( argv[ca] ), 1 );
+            else
+                commitDelayMs = std::stoi( argv[ca] );
+        }
+        else if ( arg == "--query" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "--query requires an argument\n";
+                exit(1);
+            }
+            
+            // Runs after the other options are parsed
+            query = argv[ca];
+        }
+        else if ( arg == "--import" )
+        {
+            import = true;
+        }
+        else if ( arg == "--segments" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "--segments requires an argument\n";
+                exit(1);
+            }
+            
+            segmentBytes = (uint64_t) std::max( std::stoi( argv[ca] ), 1 ) << 20;
+        }
+        else if ( arg == "--root" || arg == "--partition" || arg == "--retain" || arg == "--from" || arg == "--to" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << arg << " requires an argument\n";
+                exit(1);
+            }
+            
+            std::string value = argv[ca];
+            
+            if ( arg == "--root" )
+                root = value;
+            else if ( arg == "--retain" )
+                retainHours = std::stoi( value );
+            else if ( arg == "--from" )
+                queryFrom = std::stoll( value ) * 1000000000;
+            else if ( arg == "--to" )
+                queryTo = std::stoll( value ) * 1000000000 + 999999999;
+            else if ( value == "hourly" )
+                period = LOGDB_HOURLY;
+            else if ( value == "daily" )
+                period = LOGDB_DAILY;
+            else
+            {
+                std::cerr << "--partition must be hourly or daily\n";
+                exit(1);
+            }
+        }
+        else if ( arg == "--shed-low" || arg == "--shed-normal" || arg == "--sample" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << arg << " requires an argument\n";
+                exit(1);
+            }
+            
+            unsigned int value = std::stoi( argv[ca] );
+            
+            if ( arg == "--shed-low" )
+                policyConfig.shed_low_at = value;
+            else if ( arg == "--shed-normal" )
+                policyConfig.shed_normal_at = value;
+            else
+                policyConfig.sample = value;
+        }
+        else if ( arg == "--coalesce" )
+        {
+            policyConfig.coalesce = true;
+        }
+        else if ( arg == "--low" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "--low requires an argument\n";
+                exit(1);
+            }
+            
+            // Replaces the default list
+            std::string list = argv[ca];
+            std::string::size_type offset = 0;
+            policyConfig.low.clear();
+            
+            while ( offset < list.length() )
+            {
+                std::string::size_type newoffset = list.find( ',', offset );
+                
+                if ( newoffset == std::string::npos )
+                    newoffset = list.length();
+                
+                auto it = supportedEvents.find( list.substr( offset, newoffset - offset ) );
+                
+                if ( it == supportedEvents.end() )
+                {
+                    std::cerr << "Unknown event: " << list.substr( offset, newoffset - offset ) << "\n";
+                    exit( 1 );
+                }
+                
+                policyConfig.low.push_back( EndpointSecurity::describeEvent( (es_event_type_t) std::get<0>( it->second ) ).id );
+                offset = newoffset + 1;
+            }
+        }
+        else if ( arg == "--shard" )
+        {
+            shard = true;
+        }
         else if ( arg == "--help" )
         {
             help( argv[0] );
@@ -346,6 +616,28 @@ void es_main ( int argc, char ** argv )
             test_max_clients();
             exit( 1 );
         }
+        else if ( arg == "--bench" )
+        {
+            if ( ++ca >= argc )
+            {
+                std::cerr << "--bench requires an argument\n";
+                exit(1);
+            }
+            
+            std::string name = argv[ca];
+            unsigned int count = 1000000;
+            
+            if ( ca + 1 < argc && isdigit( argv[ca + 1][0] ) )
+                count = std::stoi( argv[++ca] );
+            
+            if ( !es_bench( name, count ) )
+            {
+                std::cerr << "Unknown benchmark: " << name << "\n";
+                exit( 1 );
+            }
+            
+            exit( 0 );
+        }
         else if ( arg == "-v" )
         {
             verbose = true;
@@ -357,70 +649,233 @@ void es_main ( int argc, char ** argv )
         }
     }
     
+    if ( import )
+        exit( import_segments( root, period ) ? 0 : 1 );
+    
+    if ( query )
+        exit( query_logs( root, query, queryFrom, queryTo ) ? 0 : 1 );
+    
     try
     {
         if ( verbose )
-            std::cout << "Starting the interceptor using " << totalClients << " EPS clients\n";
+            std::cout << "Starting the interceptor using " << totalClients << " EPS clients and " << totalWriters << " writers\n";
         
-        sqlite3 *db;
-        char *err_msg = 0;
+        // Either each client subscribes to all the events, or they get a part of them each
+        std::vector< EventShard > shards;
         
-        int rc = sqlite3_open("/Library/Application Support/maxprocmon/database.db", &db);
+        if ( shard )
+            shards = shardSubscriptions( subscriptions, totalClients );
+        else
+            shards.assign( totalClients, subscriptions );
         
-        if (rc != SQLITE_OK) {
-                
-            fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-            sqlite3_close(db);
-            
-            return;
-        }
-        rc = sqlite3_exec(db, "PRAGMA journal_mode = WAL;",0,0,0);
-
-        if (rc != SQLITE_OK) {
-                
-            fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-            sqlite3_close(db);
-            
-            return;
-        }
+        // The databases from before the partitions are only read, so they are converted to the current schema here
+        if ( !logdb_upgrade_legacy( root ) )
+            std::cerr << "The older databases in " << root << " could not be converted, the queries will not read them\n";
         
-        rc = sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Logs(EventType TEXT, Timestamp DATETIME, TimeNS REAL, Executable TEXT, Filename TEXT);", 0, 0, &err_msg);
+        // Each writer thread has its own partitions or segments, and the clients are spread over the writers. Each client has its own queue.
+        totalWriters = std::max( 1u, std::min< unsigned int >( totalWriters, shards.size() ) );
+        std::vector< EventWriter * > writers;
+        std::vector< PartitionedLog * > logs;
+        std::vector< SegmentLog * > segmentLogs;
         
-        if (rc != SQLITE_OK ) {
-            fprintf(stderr, "Failed to create table\n");
-            fprintf(stderr, "SQL error: %s\n", err_msg);
-            sqlite3_free(err_msg);
+        for ( unsigned int w = 0; w < totalWriters; w++ )
+        {
+            PartitionedLog * log = nullptr;
+            SegmentLog * segments = nullptr;
             
-        } else {
-            fprintf(stdout, "Table Friends created successfully\n");
-        }
-        
-        sqlite3_stmt *pStmt;
-        rc = sqlite3_prepare_v2(db, "INSERT INTO Logs(EventType, Timestamp, TimeNS, Executable, Filename) VALUES(?, ?, ?, ?, ?)", -1, &pStmt, 0);
-        
-        if (rc != SQLITE_OK) {
+            if ( segmentBytes > 0 )
+            {
+                segments = new SegmentLog( root, w, segmentBytes, commitDelayMs );
+                
+                if ( !segments->open() )
+                    return;
+            }
+            else
+            {
+                log = new PartitionedLog( root, w, period, commitRows, commitDelayMs );
+                
+                if ( !log->open( time( nullptr ) ) )
+                    return;
+            }
             
-            fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+            logs.push_back( log );
+            segmentLogs.push_back( segments );
             
-            return;
+            // The writer commits the rows, or writes the buffered records, when it runs out of events, if they waited long enough
+            unsigned int queues = ( shards.size() - w + totalWriters - 1 ) / totalWriters;
+            writers.push_back( new EventWriter( WRITER_QUEUE_SIZE, [=](const EndpointSecurity::Event& event){ event_callback( log, segments, event ); }, queues,
+                                                [=](){ segments ? segments->poll() : log->poll(); } ) );
         }
         
-        
-        for ( unsigned int i = 0; i < totalClients; i++ )
+        for ( unsigned int i = 0; i < shards.size(); i++ )
         {
             EndpointSecurity * epsec = new EndpointSecurity();
                 
             if ( !monitoredPath.empty() )
                 epsec->monitorOnlyProcessPath( monitoredPath );
+            
+            epsec->setPoolSize( CLIENT_POOL_SIZE );
+            epsec->setCriticalEvents( BackpressurePolicy::criticalEvents() );
+            
+            if ( decodeWorkers > 0 )
+                epsec->setDecodeWorkers( decodeWorkers );
+            
+            EventWriter * writer = writers[ i % totalWriters ];
+            unsigned int queue = i / totalWriters;
+            
+            BackpressurePolicy * policy = new BackpressurePolicy( policyConfig );
+            
+            {
+                std::lock_guard< std::mutex > lock( clientsMutex );
+                clients.push_back( epsec );
+                policies.push_back( policy );
+            }
+            
+            // The critical events wait for room in the queue rather than being lost
+            epsec->create( [=](const EndpointSecurity::Event& event)
+            {
+                if ( policy->decide( event, client_pressure( epsec, writer, queue ) ) == BackpressurePolicy::Admit )
+                {
+                    EndpointSecurity::EventId id = event.event_id;
+                    
+                    if ( !writer->push( epsec->takeEvent(), queue, policy->priority( event ) == BackpressurePolicy::Critical ) )
+                        policy->overflowed( id );
+                }
                 
-            epsec->create( [=](const EndpointSecurity::Event& event){ return event_callback( db, pStmt, event ); });
-            epsec->subscribe( subscriptions );
+                return 0;
+            });
+            epsec->subscribe( shards[i] );
+            
+            if ( verbose && shard )
+            {
+                std::cout << "client " << i << ":";
+                
+                for ( es_event_type_t type : shards[i] )
+                    std::cout << " " << (EndpointSecurity::describeEvent( type ).is_auth ? "+" : "") << EndpointSecurity::describeEvent( type ).name;
+                
+                std::cout << "\n";
+            }
         }
             
         if ( verbose )
             std::cout << "Intercepting started\n";
 
-        pause();
+        auto started = std::chrono::steady_clock::now();
+        
+        signal( SIGUSR1, on_sigusr1 );
+        signal( SIGTERM, on_sigterm );
+        signal( SIGINT, on_sigterm );
+        
+        for ( unsigned int seconds = 1; !stopRequested; seconds++ )
+        {
+            // The signal interrupts the sleep, so the dump is not delayed. A signal coming just before the sleep
+            // waits for it, so it is short.
+            sleep( 1 );
+            
+            LatencyHistograms::merge();
+            
+            if ( dumpRequested )
+            {
+                dumpRequested = 0;
+                std::cerr << LatencyHistograms::snapshot().text();
+            }
+            
+            // The retention deletes whole partitions, so it is cheap, but there is nothing to delete more often
+            if ( retainHours > 0 && seconds % 60 == 1 )
+            {
+                unsigned int deleted = logdb_retain( root, ( (int64_t) time( nullptr ) - retainHours * 3600ll ) * 1000000000 );
+                
+                if ( verbose && deleted > 0 )
+                    std::cerr << "deleted " << deleted << " expired partitions\n";
+            }
+            
+            if ( verbose && seconds % 10 == 0 )
+            {
+                std::cerr << "shed: " << BackpressurePolicy::json( policies, clients ) << "\n";
+                
+                for ( unsigned int i = 0; i < clients.size(); i++ )
+                {
+                    EventWriter::Stats stats = writers[ i % totalWriters ]->stats( i / totalWriters );
+                    std::cerr << "queue " << i << ": " << stats.depth << " of " << stats.capacity << ", high water " << stats.high_water
+                              << ", overflows " << stats.overflows << ", written " << stats.written << "\n";
+                    
+                    EndpointSecurity::AuthStats auth = clients[i]->authStats();
+                    
+                    if ( auth.responses > 0 )
+                        std::cerr << "client " << i << ": " << auth.responses << " auth responses, " << auth.missed << " after the deadline, slack min "
+                                  << auth.min_slack_ns / 1000 << " us, mean " << auth.total_slack_ns / (int64_t) auth.responses / 1000 << " us\n";
+                }
+            }
+        }
+        
+        // Shut down: no new messages, then the clients report the messages in flight, the writers write what is queued
+        // within the drain time, and the databases are checkpointed. The alarm bounds whatever could still hang.
+        auto stopping = std::chrono::steady_clock::now();
+        alarm( SHUTDOWN_LIMIT_SECONDS );
+        
+        if ( verbose )
+            std::cout << "Shutting down\n";
+        
+        for ( unsigned int i = 0; i < clients.size(); i++ )
+        {
+            try
+            {
+                if ( !shards[i].empty() )
+                    clients[i]->unsubscribe( shards[i] );
+                
+                clients[i]->destroy();
+            }
+            catch ( EndpointSecurityException ex )
+            {
+                std::cerr << "Failed to stop client " << i << ": " << ex.errorMsg << ", code " << ex.errorCode << "\n";
+            }
+        }
+        
+        EventWriter::Stats total = {};
+        uint64_t unwritable = 0;
+        
+        // The writers drain at once, all within the same drain time
+        auto drainDeadline = std::chrono::steady_clock::now() + SHUTDOWN_DRAIN_TIME;
+        
+        for ( unsigned int w = 0; w < totalWriters; w++ )
+            writers[w]->requestStop( drainDeadline );
+        
+        for ( unsigned int w = 0; w < totalWriters; w++ )
+        {
+            writers[w]->stop();
+            
+            EventWriter::Stats stats = writers[w]->stats();
+            total.written += stats.written;
+            total.overflows += stats.overflows;
+            total.discarded += stats.discarded;
+            
+            // The writer thread is gone, so the last partition or segment is closed here
+            if ( segmentLogs[w] )
+            {
+                segmentLogs[w]->close();
+                unwritable += segmentLogs[w]->dropped();
+            }
+            else
+            {
+                logs[w]->close();
+                unwritable += logs[w]->dropped();
+            }
+        }
+        
+        auto stopped = std::chrono::steady_clock::now();
+        alarm( 0 );
+        
+        uint64_t exhausted = 0;
+        
+        for ( EndpointSecurity * epsec : clients )
+            exhausted += epsec->poolStats().exhausted;
+        
+        std::cerr << "written " << total.written << " events, "
+                  << (uint64_t) ( total.written / std::chrono::duration< double >( stopping - started ).count() ) << " events/s; dropped "
+                  << total.overflows << " on full queues, " << exhausted << " on full pools, " << total.discarded << " at shutdown, "
+                  << unwritable << " with no database\n"
+                  << "shed: " << BackpressurePolicy::json( policies, clients ) << "\n"
+                  << "shutdown took " << std::chrono::duration_cast< std::chrono::milliseconds >( stopped - stopping ).count() << " ms\n";
     }
     catch ( EndpointSecurityException ex )
     {
@@ -0,0 +1,16 @@
+#ifndef ESSTATUS_H
+#define ESSTATUS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The daemon status as JSON: {"latency":{...},"shed":{...}}, the latency histograms and the events shed under
+// backpressure. The caller frees the string.
+char * es_status( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ESSTATUS_H
@@ -24,9 +24,204 @@
 //OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 //SOFTWARE.
 
+#ifndef FLAGS_H
+#define FLAGS_H
+
+#include <stddef.h>
+
+// A flag or a value with its name, as they are listed below
+struct FlagName
+{
+    unsigned int    value;
+    const char *    name;
+};
+
+// The bitmask names indexed by the bit position, built at compile time from the FlagName list.
+// The few entries which cover several bits (such as ATTR_FORK_RESERVED) are kept aside as masks, and are matched
+// after the single bits, in ascending order - the same order std::map used to give them.
+struct BitNames
+{
+    const char *    bits[32];
+    FlagName        masks[4];
+    unsigned int    nmasks;
+};
+
+template< size_t N > constexpr BitNames makeBitNames( const FlagName (&flags)[N] )
+{
+    BitNames table = {};
+    
+    for ( size_t i = 0; i < N; i++ )
+    {
+        unsigned int value = flags[i].value;
+        
+        // zero-valued names such as MAP_FILE can never match
+        if ( value == 0 )
+            continue;
+        
+        if ( (value & (value - 1)) == 0 )
+        {
+            unsigned int bit = 0;
+            
+            while ( (value >> bit) != 1 )
+                bit++;
+            
+            table.bits[ bit ] = flags[i].name;
+        }
+        else
+        {
+            // insertion sort by value
+            unsigned int pos = table.nmasks++;
+            
+            for ( ; pos > 0 && table.masks[pos - 1].value > value; pos-- )
+                table.masks[pos] = table.masks[pos - 1];
+            
+            table.masks[pos] = flags[i];
+        }
+    }
+    
+    return table;
+}
+
+// The value names sorted by value for the binary search, built at compile time from the FlagName list
+struct ValueNames
+{
+    FlagName        values[64];
+    unsigned int    count;
+};
+
+template< size_t N > constexpr ValueNames makeValueNames( const FlagName (&flags)[N] )
+{
+    static_assert( N <= 64, "increase ValueNames::values" );
+    ValueNames table = {};
+    
+    for ( size_t i = 0; i < N; i++ )
+    {
+        unsigned int pos = table.count++;
+        
+        for ( ; pos > 0 && table.values[pos - 1].value > flags[i].value; pos-- )
+            table.values[pos] = table.values[pos - 1];
+        
+        table.values[pos] = flags[i];
+    }
+    
+    return table;
+}
+
+// Enough for the longest description, which is all the codesigning flags set
+static const size_t FLAG_DESC_MAX = 1024;
+
+// Writes the string into the buffer, truncating it to the buffer end
+static inline char * flagsAppend( char * out, char * end, const char * str )
+{
+    while ( *str && out < end )
+        *out++ = *str++;
+    
+    return out;
+}
+
+// Writes the decimal number into the buffer, truncating it to the buffer end
+static inline char * flagsAppendNumber( char * out, char * end, unsigned int value )
+{
+    char digits[ 10 ];
+    int len = 0;
+    
+    do
+    {
+        digits[ len++ ] = '0' + value % 10;
+        value /= 10;
+    }
+    while ( value );
+    
+    while ( len > 0 && out < end )
+        *out++ = digits[ --len ];
+    
+    return out;
+}
+
+// Converts bitmask to a human-readable value, i.e. 5 into "FREAD|O_NONBLOCK (5)", written into the buffer of the given size.
+// Only the set bits are visited. Returns the length of the text; the buffer is not zero-terminated.
+static inline size_t formatBitmask( char * buf, size_t size, const BitNames& table, unsigned int value )
+{
+    char * out = buf;
+    char * end = buf + size;
+    unsigned int origvalue = value;
+    unsigned int bits = value;
+    
+    while ( bits )
+    {
+        unsigned int bit = __builtin_ctz( bits );
+        bits &= bits - 1;
+        
+        if ( table.bits[ bit ] )
+        {
+            value ^= 1u << bit;
+            
+            if ( out != buf )
+                out = flagsAppend( out, end, "|" );
+            
+            out = flagsAppend( out, end, table.bits[ bit ] );
+        }
+    }
+    
+    for ( unsigned int i = 0; i < table.nmasks; i++ )
+    {
+        if ( value & table.masks[i].value )
+        {
+            value ^= table.masks[i].value;
+            
+            if ( out != buf )
+                out = flagsAppend( out, end, "|" );
+            
+            out = flagsAppend( out, end, table.masks[i].name );
+        }
+    }
+    
+    if ( value )
+    {
+        out = flagsAppend( out, end, " [" );
+        out = flagsAppendNumber( out, end, value );
+        out = flagsAppend( out, end, "?] (" );
+    }
+    else
+        out = flagsAppend( out, end, " (" );
+    
+    out = flagsAppendNumber( out, end, origvalue );
+    out = flagsAppend( out, end, ")" );
+    return out - buf;
+}
+
+// Converts value to a human-readable value, i.e. 1 into "F_DUPFD (1)", written into the buffer of the given size.
+// Returns the length of the text; the buffer is not zero-terminated.
+static inline size_t formatValue( char * buf, size_t size, const ValueNames& table, unsigned int value )
+{
+    char * out = buf;
+    char * end = buf + size;
+    unsigned int lo = 0, hi = table.count;
+    
+    while ( lo < hi )
+    {
+        unsigned int mid = (lo + hi) / 2;
+        
+        if ( table.values[mid].value < value )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    if ( lo < table.count && table.values[lo].value == value )
+        out = flagsAppend( out, end, table.values[lo].name );
+    else
+        out = flagsAppend( out, end, "[?]" );
+    
+    out = flagsAppend( out, end, " (" );
+    out = flagsAppendNumber( out, end, value );
+    out = flagsAppend( out, end, ")" );
+    return out - buf;
+}
+
 
 // Flags for open()
-static std::map< unsigned int, const char *> value_map_open = {
+static constexpr FlagName flags_open[] = {
     { 0x00000001, "FREAD" },
     { 0x00000002, "FWRITE" },
     { 0x00000004, "O_NONBLOCK" },
@@ -45,18 +240,20 @@ static std::map< unsigned int, const char *> value_map_open = {
     { 0x01000000, "O_CLOEXEC" },
     { 0x20000000, "O_NOFOLLOW_ANY"  }
 };
+static constexpr BitNames value_map_open = makeBitNames( flags_open );
 
 
 // Flags for access
-static std::map< unsigned int, const char *> value_map_access = {
+static constexpr FlagName flags_access[] = {
 
     { (1<<0), "X_OK" },
     { (1<<1), "W_OK" },
     { (1<<2), "R_OK" }
 };
+static constexpr BitNames value_map_access = makeBitNames( flags_access );
 
 // Flags for codesigning
-static std::map< unsigned int, const char *> value_map_codesign = {
+static constexpr FlagName flags_codesign[] = {
     { 0x00000001, "CS_VALID" },
     { 0x00000002, "CS_ADHOC" },
     { 0x00000004, "CS_GET_TASK_ALLOW" },
@@ -86,8 +283,9 @@ static std::map< unsigned int, const char *> value_map_codesign = {
     { 0x40000000, "CS_DEV_CODE" },
     { 0x80000000, "CS_DATAVAULT_CONTROLLER" }
 };
+static constexpr BitNames value_map_codesign = makeBitNames( flags_codesign );
 
-static std::map< unsigned int, const char *> value_map_fcntl = {
+static constexpr FlagName flags_fcntl[] = {
     { 0, "F_DUPFD" },
     { 1, "F_GETFD" },
     { 2, "F_SETFD" },
@@ -141,8 +339,9 @@ static std::map< unsigned int, const char *> value_map_fcntl = {
     { 104, "F_ADDFILESUPPL" },
     { 105, "F_GETSIGSINFO" }
 };
+static constexpr ValueNames value_map_fcntl = makeValueNames( flags_fcntl );
 
-static std::map< unsigned int, const char *> value_map_attr_common = {
+static constexpr FlagName flags_attr_common[] = {
     { 0x00000001, "ATTR_CMN_NAME" },
     { 0x00000002, "ATTR_CMN_DEVID" },
     { 0x00000004, "ATTR_CMN_FSID" },
@@ -175,9 +374,10 @@ static std::map< unsigned int, const char *> value_map_attr_common = {
     { 0x20000000, "ATTR_CMN_ERROR" },
     { 0x40000000, "ATTR_CMN_DATA_PROTECT_FLAGS" }
 };
+static constexpr BitNames value_map_attr_common = makeBitNames( flags_attr_common );
 
     
-static std::map< unsigned int, const char *> value_map_attr_volume = {
+static constexpr FlagName flags_attr_volume[] = {
     { 0x00000001, "ATTR_VOL_FSTYPE" },
     { 0x00000002, "ATTR_VOL_SIGNATURE" },
     { 0x00000004, "ATTR_VOL_SIZE" },
@@ -202,8 +402,9 @@ static std::map< unsigned int, const char *> value_map_attr_volume = {
     { 0x40000000, "ATTR_VOL_ATTRIBUTES" },
     { 0x80000000, "ATTR_VOL_INFO" }
 };
+static constexpr BitNames value_map_attr_volume = makeBitNames( flags_attr_volume );
 
-static std::map< unsigned int, const char *> value_map_attr_dir = {
+static constexpr FlagName flags_attr_dir[] = {
     { 0x00000001, "ATTR_DIR_LINKCOUNT" },
     { 0x00000002, "ATTR_DIR_ENTRYCOUNT" },
     { 0x00000004, "ATTR_DIR_MOUNTSTATUS" },
@@ -211,8 +412,9 @@ static std::map< unsigned int, const char *> value_map_attr_dir = {
     { 0x00000010, "ATTR_DIR_IOBLOCKSIZE" },
     { 0x00000020, "ATTR_DIR_DATALENGTH" },
 };
+static constexpr BitNames value_map_attr_dir = makeBitNames( flags_attr_dir );
 
-static std::map< unsigned int, const char *> value_map_attr_file = {
+static constexpr FlagName flags_attr_file[] = {
     { 0x00000001, "ATTR_FILE_LINKCOUNT" },
     { 0x00000002, "ATTR_FILE_TOTALSIZE" },
     { 0x00000004, "ATTR_FILE_ALLOCSIZE" },
@@ -229,8 +431,9 @@ static std::map< unsigned int, const char *> value_map_attr_file = {
     { 0x00000800, "ATTR_FILE_DATAEXTENTS" },
     { 0x00004000, "ATTR_FILE_RSRCEXTENTS" },
 };
+static constexpr BitNames value_map_attr_file = makeBitNames( flags_attr_file );
 
-static std::map< unsigned int, const char *> value_map_attr_cmnext = {
+static constexpr FlagName flags_attr_cmnext[] = {
     { 0x00000004, "ATTR_CMNEXT_RELPATH" },
     { 0x00000008, "ATTR_CMNEXT_PRIVATESIZE" },
     { 0x00000010, "ATTR_CMNEXT_LINKID" },
@@ -243,14 +446,16 @@ static std::map< unsigned int, const char *> value_map_attr_cmnext = {
     { 0x000007fc, "ATTR_CMNEXT_VALIDMASK" },
     { 0x00000000, "ATTR_CMNEXT_SETMASK" }
 };
+static constexpr BitNames value_map_attr_cmnext = makeBitNames( flags_attr_cmnext );
 
-static std::map< unsigned int, const char *> value_map_attr_fork = {
+static constexpr FlagName flags_attr_fork[] = {
     { 0x00000001, "ATTR_FORK_TOTALSIZE" },
     { 0x00000002, "ATTR_FORK_ALLOCSIZE" },
     { 0xffffffff, "ATTR_FORK_RESERVED" }
 };
+static constexpr BitNames value_map_attr_fork = makeBitNames( flags_attr_fork );
 
-static std::map< unsigned int, const char *> value_map_proc_check_type = {
+static constexpr FlagName flags_proc_check_type[] = {
     { 0x8, "ES_PROC_CHECK_TYPE_DIRTYCONTROL" },
     { 0x4, "ES_PROC_CHECK_TYPE_KERNMSGBUF" },
     { 0x1, "ES_PROC_CHECK_TYPE_LISTPIDS" },
@@ -262,14 +467,16 @@ static std::map< unsigned int, const char *> value_map_proc_check_type = {
     { 0x7, "ES_PROC_CHECK_TYPE_TERMINATE" },
     { 0xe, "ES_PROC_CHECK_TYPE_UDATA_INFO" }
 };
+static constexpr ValueNames value_map_proc_check_type = makeValueNames( flags_proc_check_type );
 
-static std::map< unsigned int, const char *> value_map_mmap_prot = {
+static constexpr FlagName flags_mmap_prot[] = {
     { 0x01, "PROT_READ" },
     { 0x02, "PROT_WRITE" },
     { 0x04, "PROT_EXEC" }
 };
+static constexpr BitNames value_map_mmap_prot = makeBitNames( flags_mmap_prot );
 
-static std::map< unsigned int, const char *> value_map_mmap_flags = {
+static constexpr FlagName flags_mmap_flags[] = {
     { 0x0001, "MAP_SHARED" },
     { 0x0002, "MAP_PRIVATE" },
     { 0x0010, "MAP_FIXED" },
@@ -288,4 +495,6 @@ static std::map< unsigned int, const char *> value_map_mmap_flags = {
     { 0x20000, "MAP_TRANSLATED_ALLOW_EXECUTE" },
     { 0x40000, "MAP_UNIX03" }
 };
+static constexpr BitNames value_map_mmap_flags = makeBitNames( flags_mmap_flags );
 
+#endif // FLAGS_H
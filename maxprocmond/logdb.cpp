@@ -0,0 +1,738 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <deque>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "EventBlob.h"
+#include "logdb.h"
+
+std::string logdb_path( const std::string& directory, unsigned int shard, unsigned int shards )
+{
+    if ( shards <= 1 )
+        return directory + "/database.db";
+
+    return directory + "/database-" + std::to_string( shard ) + ".db";
+}
+
+std::string logdb_partition_path( const std::string& directory, time_t time, unsigned int period, unsigned int shard )
+{
+    struct tm tm;
+    char name[32];
+    
+    gmtime_r( &time, &tm );
+    strftime( name, sizeof(name), period < LOGDB_DAILY ? "logs-%Y%m%dT%H" : "logs-%Y%m%d", &tm );
+    
+    return directory + "/" + name + "-" + std::to_string( shard ) + ".db";
+}
+
+// Opens the catalog of the partitions, creating it and the directory if needed. Several writers could update it at once.
+static sqlite3 * openCatalog( const std::string& directory )
+{
+    sqlite3 *db;
+    std::string path = directory + "/catalog.db";
+    
+    mkdir( directory.c_str(), 0755 );
+    
+    if ( sqlite3_open( path.c_str(), &db ) != SQLITE_OK
+         || sqlite3_busy_timeout( db, 5000 ) != SQLITE_OK
+         || sqlite3_exec( db, "CREATE TABLE IF NOT EXISTS Partitions(Path TEXT PRIMARY KEY, Writer INTEGER, MinTime INTEGER, MaxTime INTEGER);"
+                              "CREATE TABLE IF NOT EXISTS Segments(Writer INTEGER PRIMARY KEY, NextSequence INTEGER);", 0, 0, 0 ) != SQLITE_OK )
+    {
+        fprintf(stderr, "Cannot open the catalog %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    return db;
+}
+
+// Runs the statement with the text and the integer parameters
+static bool execCatalog( sqlite3 * db, const char * sql, const std::string& text, const std::vector< sqlite3_int64 >& values )
+{
+    sqlite3_stmt *pStmt;
+    
+    if ( sqlite3_prepare_v2( db, sql, -1, &pStmt, 0 ) != SQLITE_OK )
+    {
+        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+    
+    sqlite3_bind_text( pStmt, 1, text.data(), text.length(), SQLITE_STATIC );
+    
+    for ( size_t i = 0; i < values.size(); i++ )
+        sqlite3_bind_int64( pStmt, i + 2, values[i] );
+    
+    bool done = sqlite3_step( pStmt ) == SQLITE_DONE;
+    
+    if ( !done )
+        fprintf(stderr, "Cannot update the catalog: %s\n", sqlite3_errmsg(db));
+    
+    sqlite3_finalize( pStmt );
+    return done;
+}
+
+bool logdb_catalog_open( const std::string& directory, const std::string& path, unsigned int shard )
+{
+    sqlite3 * catalog = openCatalog( directory );
+    
+    if ( !catalog )
+        return false;
+    
+    bool done = execCatalog( catalog, "INSERT OR REPLACE INTO Partitions(Path, Writer, MinTime, MaxTime) VALUES(?, ?, NULL, NULL)", path, { shard } );
+    sqlite3_close( catalog );
+    return done;
+}
+
+bool logdb_catalog_close( const std::string& directory, const std::string& path, sqlite3 * db )
+{
+    sqlite3_stmt *pStmt;
+    sqlite3_int64 minTime = 0, maxTime = -1;
+    
+    // Both come from the time index
+    if ( sqlite3_prepare_v2( db, "SELECT min(Time), max(Time) FROM Logs", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        if ( sqlite3_step( pStmt ) == SQLITE_ROW && sqlite3_column_type( pStmt, 0 ) != SQLITE_NULL )
+        {
+            minTime = sqlite3_column_int64( pStmt, 0 );
+            maxTime = sqlite3_column_int64( pStmt, 1 );
+        }
+        
+        sqlite3_finalize( pStmt );
+    }
+    
+    sqlite3 * catalog = openCatalog( directory );
+    
+    if ( !catalog )
+        return false;
+    
+    // An empty partition gets bounds which overlap nothing
+    bool done = execCatalog( catalog, "UPDATE Partitions SET MinTime = ?2, MaxTime = ?3 WHERE Path = ?1", path, { minTime, maxTime } );
+    sqlite3_close( catalog );
+    return done;
+}
+
+bool logdb_catalog_segment( const std::string& directory, unsigned int shard, uint64_t& sequence )
+{
+    sqlite3 * catalog = openCatalog( directory );
+    sqlite3_stmt *pStmt;
+    
+    if ( !catalog )
+        return false;
+    
+    // Read and updated in one transaction, in case another process runs a writer with the same number
+    bool done = sqlite3_exec( catalog, "BEGIN IMMEDIATE;", 0, 0, 0 ) == SQLITE_OK;
+    
+    if ( done && sqlite3_prepare_v2( catalog, "SELECT NextSequence FROM Segments WHERE Writer = ?", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        sqlite3_bind_int64( pStmt, 1, shard );
+        
+        if ( sqlite3_step( pStmt ) == SQLITE_ROW )
+            sequence = std::max( sequence, (uint64_t) sqlite3_column_int64( pStmt, 0 ) );
+        
+        sqlite3_finalize( pStmt );
+    }
+    
+    if ( done && sqlite3_prepare_v2( catalog, "INSERT OR REPLACE INTO Segments(Writer, NextSequence) VALUES(?, ?)", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        sqlite3_bind_int64( pStmt, 1, shard );
+        sqlite3_bind_int64( pStmt, 2, sequence + 1 );
+        done = sqlite3_step( pStmt ) == SQLITE_DONE;
+        sqlite3_finalize( pStmt );
+    }
+    else
+        done = false;
+    
+    if ( !done || sqlite3_exec( catalog, "COMMIT;", 0, 0, 0 ) != SQLITE_OK )
+    {
+        fprintf(stderr, "Cannot update the catalog: %s\n", sqlite3_errmsg(catalog));
+        sqlite3_exec( catalog, "ROLLBACK;", 0, 0, 0 );
+        done = false;
+    }
+    
+    sqlite3_close( catalog );
+    return done;
+}
+
+std::vector< std::string > logdb_catalog_partitions( const std::string& directory, int64_t from, int64_t to )
+{
+    std::vector< std::string > paths;
+    sqlite3 * catalog = openCatalog( directory );
+    sqlite3_stmt *pStmt;
+    
+    if ( !catalog )
+        return paths;
+    
+    if ( sqlite3_prepare_v2( catalog, "SELECT Path FROM Partitions WHERE MinTime IS NULL OR (MinTime <= ?2 AND MaxTime >= ?1) "
+                                      "ORDER BY Path", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        sqlite3_bind_int64( pStmt, 1, from );
+        sqlite3_bind_int64( pStmt, 2, to );
+        
+        while ( sqlite3_step( pStmt ) == SQLITE_ROW )
+            paths.push_back( (const char *) sqlite3_column_text( pStmt, 0 ) );
+        
+        sqlite3_finalize( pStmt );
+    }
+    
+    sqlite3_close( catalog );
+    return paths;
+}
+
+unsigned int logdb_retain( const std::string& directory, int64_t before )
+{
+    sqlite3 * catalog = openCatalog( directory );
+    sqlite3_stmt *pStmt;
+    std::vector< std::string > expired;
+    
+    if ( !catalog )
+        return 0;
+    
+    if ( sqlite3_prepare_v2( catalog, "SELECT Path FROM Partitions WHERE MaxTime < ?", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        sqlite3_bind_int64( pStmt, 1, before );
+        
+        while ( sqlite3_step( pStmt ) == SQLITE_ROW )
+            expired.push_back( (const char *) sqlite3_column_text( pStmt, 0 ) );
+        
+        sqlite3_finalize( pStmt );
+    }
+    
+    // The partition leaves the catalog first, so a reader does not open a file being deleted.
+    // Only the partitions whose files are gone are counted; the journal files might not exist.
+    unsigned int deleted = 0;
+    
+    for ( const std::string& path : expired )
+    {
+        if ( !execCatalog( catalog, "DELETE FROM Partitions WHERE Path = ?", path, {} ) )
+            break;
+        
+        bool removed = true;
+        
+        for ( const std::string& file : { path, path + "-wal", path + "-shm" } )
+        {
+            if ( unlink( file.c_str() ) != 0 && errno != ENOENT )
+            {
+                fprintf(stderr, "Cannot delete the expired partition file %s: %s\n", file.c_str(), strerror(errno));
+                removed = false;
+            }
+        }
+        
+        if ( removed )
+            deleted++;
+    }
+    
+    sqlite3_close( catalog );
+    return deleted;
+}
+
+// How many strings of each dictionary are cached; when full, the cache starts over
+static const size_t INTERN_CACHE_SIZE = 65536;
+
+namespace
+{
+    // The ids of the strings in a dictionary table. The map keys point into the owned strings.
+    class Dictionary
+    {
+        public:
+            Dictionary( sqlite3 * db, const std::string& table )
+                : db( db ), select( nullptr ), insert( nullptr )
+            {
+                sqlite3_prepare_v2( db, ( "SELECT Id FROM " + table + " WHERE Path = ?" ).c_str(), -1, &select, 0 );
+                sqlite3_prepare_v2( db, ( "INSERT INTO " + table + "(Path) VALUES(?)" ).c_str(), -1, &insert, 0 );
+            }
+            
+            ~Dictionary()
+            {
+                sqlite3_finalize( select );
+                sqlite3_finalize( insert );
+            }
+            
+            bool prepared() const
+            {
+                return select && insert;
+            }
+            
+            // Returns the id of the string, adding it to the table if needed, or 0 on error
+            sqlite3_int64 id( std::string_view value )
+            {
+                auto it = ids.find( value );
+                
+                if ( it != ids.end() )
+                    return it->second;
+                
+                sqlite3_int64 id = 0;
+                sqlite3_bind_text( select, 1, value.data(), value.length(), SQLITE_STATIC );
+                
+                if ( sqlite3_step( select ) == SQLITE_ROW )
+                    id = sqlite3_column_int64( select, 0 );
+                
+                sqlite3_reset( select );
+                
+                if ( id == 0 )
+                {
+                    sqlite3_bind_text( insert, 1, value.data(), value.length(), SQLITE_STATIC );
+                    
+                    if ( sqlite3_step( insert ) == SQLITE_DONE )
+                        id = sqlite3_last_insert_rowid( db );
+                    
+                    sqlite3_reset( insert );
+                }
+                
+                if ( id == 0 )
+                    return 0;
+                
+                if ( ids.size() >= INTERN_CACHE_SIZE )
+                {
+                    ids.clear();
+                    strings.clear();
+                }
+                
+                strings.emplace_back( value );
+                ids.emplace( strings.back(), id );
+                return id;
+            }
+        
+        private:
+            sqlite3 *       db;
+            sqlite3_stmt *  select;
+            sqlite3_stmt *  insert;
+            
+            std::unordered_map< std::string_view, sqlite3_int64 > ids;
+            std::deque< std::string > strings;
+    };
+}
+
+// The Logs columns. Time is in nanoseconds since the epoch, with the LogsByTime index on it. Detail is the EventBlob
+// of the other fields, NULL for the rows of the databases from before it.
+static const char LOGS_COLUMNS[] = "EventType INTEGER, Time INTEGER NOT NULL, "
+                                   "ExecutableId INTEGER REFERENCES Executables(Id), FilenameId INTEGER REFERENCES Paths(Id), Detail BLOB";
+
+// Time from the seconds and the nanoseconds of the older databases, and the rows converted in one transaction
+static const char SPLIT_TIME[] = "CAST(Timestamp AS INTEGER) * 1000000000 + CAST(TimeNS AS INTEGER)";
+static const unsigned int CONVERT_BATCH_ROWS = 50000;
+
+struct logdb_inserter
+{
+    logdb_inserter( sqlite3 * db ) : insert( nullptr ), executables( db, "Executables" ), paths( db, "Paths" ) {}
+    
+    ~logdb_inserter()
+    {
+        sqlite3_finalize( insert );
+    }
+    
+    sqlite3_stmt *  insert;
+    Dictionary      executables;
+    Dictionary      paths;
+    std::string     detail;     // the blob of the event being inserted, keeping its capacity
+};
+
+static bool hasColumn( sqlite3 * db, const std::string& schema, const char * table, const char * column )
+{
+    sqlite3_stmt *pStmt;
+    bool found = false;
+    
+    if ( sqlite3_prepare_v2( db, ( "PRAGMA " + schema + ".table_info(" + table + ")" ).c_str(), -1, &pStmt, 0 ) != SQLITE_OK )
+        return false;
+    
+    while ( !found && sqlite3_step( pStmt ) == SQLITE_ROW )
+        found = strcmp( (const char *) sqlite3_column_text( pStmt, 1 ), column ) == 0;
+    
+    sqlite3_finalize( pStmt );
+    return found;
+}
+
+// Converts the older Logs, with the Timestamp and TimeNS columns, and possibly with the paths and the event names as text,
+// into the current one. The rows are copied into LogsConverting in the rowid order, a batch per transaction, with the paths
+// of each batch added to the dictionaries first, so the database is not locked for the whole copy, the WAL stays small,
+// and an interrupted conversion continues where it stopped. The copy then replaces Logs.
+static bool convertLogs( sqlite3 * db, bool splitTime, bool textPaths, bool textEventType )
+{
+    char *err_msg = 0;
+    std::string sql = std::string( "DROP VIEW IF EXISTS LogsView;"
+                                   "CREATE TABLE IF NOT EXISTS LogsConverting(" ) + LOGS_COLUMNS + ");";
+    
+    if ( sqlite3_exec( db, sql.c_str(), 0, 0, &err_msg ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return false;
+    }
+    
+    // The rows of the next batch
+    std::string batch = "SELECT rowid AS LogRow, * FROM Logs WHERE rowid > IFNULL((SELECT max(rowid) FROM LogsConverting), 0) ORDER BY rowid LIMIT "
+                        + std::to_string( CONVERT_BATCH_ROWS );
+    std::vector< std::string > statements;
+    
+    if ( textPaths )
+    {
+        statements.push_back( "INSERT OR IGNORE INTO Executables(Path) SELECT DISTINCT Executable FROM (" + batch + ") WHERE Executable IS NOT NULL" );
+        statements.push_back( "INSERT OR IGNORE INTO Paths(Path) SELECT DISTINCT Filename FROM (" + batch + ") WHERE Filename IS NOT NULL AND Filename <> '<missing>'" );
+        statements.push_back( std::string( "INSERT INTO LogsConverting(rowid, EventType, Time, ExecutableId, FilenameId) SELECT l.LogRow, " )
+                              + ( textEventType ? "t.Id" : "l.EventType" ) + ", " + ( splitTime ? SPLIT_TIME : "l.Time" ) + ", e.Id, p.Id FROM (" + batch + ") l"
+                              " LEFT JOIN Executables e ON e.Path = l.Executable LEFT JOIN Paths p ON p.Path = l.Filename"
+                              + ( textEventType ? " LEFT JOIN EventTypes t ON t.Name = l.EventType" : "" ) + " ORDER BY l.LogRow" );
+    }
+    else
+        statements.push_back( std::string( "INSERT INTO LogsConverting(rowid, EventType, Time, ExecutableId, FilenameId) SELECT LogRow, EventType, " )
+                              + SPLIT_TIME + ", ExecutableId, FilenameId FROM (" + batch + ")" );
+    
+    std::vector< sqlite3_stmt * > prepared;
+    
+    for ( const std::string& statement : statements )
+    {
+        sqlite3_stmt *pStmt;
+        
+        if ( sqlite3_prepare_v2( db, statement.c_str(), -1, &pStmt, 0 ) != SQLITE_OK )
+        {
+            fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+            
+            for ( sqlite3_stmt * stmt : prepared )
+                sqlite3_finalize( stmt );
+            
+            return false;
+        }
+        
+        prepared.push_back( pStmt );
+    }
+    
+    uint64_t converted = 0;
+    int copied = 0;
+    bool failed = false;
+    
+    // The copy is the last statement; once it copies nothing, all rows are there
+    do
+    {
+        sqlite3_exec( db, "BEGIN;", 0, 0, 0 );
+        
+        for ( sqlite3_stmt * stmt : prepared )
+        {
+            if ( sqlite3_step( stmt ) != SQLITE_DONE )
+                failed = true;
+            
+            copied = sqlite3_changes( db );
+            sqlite3_reset( stmt );
+            
+            if ( failed )
+                break;
+        }
+        
+        if ( failed )
+        {
+            fprintf(stderr, "Failed to convert the log: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec( db, "ROLLBACK;", 0, 0, 0 );
+            break;
+        }
+        
+        sqlite3_exec( db, "COMMIT;", 0, 0, 0 );
+        converted += copied;
+    }
+    while ( copied > 0 );
+    
+    for ( sqlite3_stmt * stmt : prepared )
+        sqlite3_finalize( stmt );
+    
+    if ( failed )
+        return false;
+    
+    if ( sqlite3_exec( db, "BEGIN;"
+                           "DROP TABLE Logs;"
+                           "ALTER TABLE LogsConverting RENAME TO Logs;"
+                           "COMMIT;", 0, 0, &err_msg ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec( db, "ROLLBACK;", 0, 0, 0 );
+        return false;
+    }
+    
+    fprintf(stderr, "Converted %llu rows of the log\n", (unsigned long long) converted);
+    return true;
+}
+
+bool logdb_create_schema( sqlite3 * db )
+{
+    bool textEventType = false, textPaths = false, splitTime = false;
+    sqlite3_stmt *pStmt;
+    
+    if ( sqlite3_prepare_v2( db, "PRAGMA table_info(Logs)", -1, &pStmt, 0 ) == SQLITE_OK )
+    {
+        while ( sqlite3_step( pStmt ) == SQLITE_ROW )
+        {
+            if ( strcmp( (const char *) sqlite3_column_text( pStmt, 1 ), "EventType" ) == 0
+                 && strcasecmp( (const char *) sqlite3_column_text( pStmt, 2 ), "TEXT" ) == 0 )
+                textEventType = true;
+            
+            if ( strcmp( (const char *) sqlite3_column_text( pStmt, 1 ), "Executable" ) == 0 )
+                textPaths = true;
+            
+            if ( strcmp( (const char *) sqlite3_column_text( pStmt, 1 ), "Timestamp" ) == 0 )
+                splitTime = true;
+        }
+        
+        sqlite3_finalize( pStmt );
+    }
+    
+    // The dictionaries and the event names come first, as the conversion of the text paths and names looks them up
+    std::string sql = "BEGIN;"
+        "CREATE TABLE IF NOT EXISTS EventTypes(Id INTEGER PRIMARY KEY, Name TEXT NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS Executables(Id INTEGER PRIMARY KEY, Path TEXT NOT NULL UNIQUE);"
+        "CREATE TABLE IF NOT EXISTS Paths(Id INTEGER PRIMARY KEY, Path TEXT NOT NULL UNIQUE);";
+    
+    // The names come from the static event table, so they could be put into SQL as is
+    for ( unsigned int id = 0; id < (unsigned int) EndpointSecurity::EventId::Count; id++ )
+    {
+        const char * name = EndpointSecurity::eventName( (EndpointSecurity::EventId) id );
+        
+        if ( name )
+            sql += "INSERT OR REPLACE INTO EventTypes(Id, Name) VALUES(" + std::to_string( id ) + ", '" + name + "');";
+    }
+    
+    sql += "COMMIT;";
+    
+    char *err_msg = 0;
+    
+    if ( sqlite3_exec( db, sql.c_str(), 0, 0, &err_msg ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec( db, "ROLLBACK;", 0, 0, 0 );
+        return false;
+    }
+    
+    if ( ( splitTime || textPaths ) && !convertLogs( db, splitTime, textPaths, textEventType ) )
+        return false;
+    
+    // The converted table without the details gets the column, the older rows have none
+    bool addDetail = hasColumn( db, "main", "Logs", "Time" ) && !hasColumn( db, "main", "Logs", "Detail" );
+    
+    sql = std::string( "BEGIN;"
+                       "CREATE TABLE IF NOT EXISTS Logs(" ) + LOGS_COLUMNS + ");";
+    
+    if ( addDetail )
+        sql += "DROP VIEW IF EXISTS LogsView;"
+               "ALTER TABLE Logs ADD COLUMN Detail BLOB;";
+    
+    // The view has the seconds and the nanoseconds as well, as Logs had them before
+    sql += "CREATE INDEX IF NOT EXISTS LogsByTime ON Logs(Time);"
+           "CREATE VIEW IF NOT EXISTS LogsView AS SELECT EventTypes.Name AS EventType, Time, Time / 1000000000 AS Timestamp, Time % 1000000000 AS TimeNS, "
+           "Executables.Path AS Executable, IFNULL(Paths.Path, '<missing>') AS Filename, Detail FROM Logs "
+           "LEFT JOIN EventTypes ON EventTypes.Id = Logs.EventType "
+           "LEFT JOIN Executables ON Executables.Id = Logs.ExecutableId "
+           "LEFT JOIN Paths ON Paths.Id = Logs.FilenameId;"
+           "COMMIT;";
+    
+    if ( sqlite3_exec( db, sql.c_str(), 0, 0, &err_msg ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec( db, "ROLLBACK;", 0, 0, 0 );
+        return false;
+    }
+    
+    return true;
+}
+
+sqlite3 * logdb_open( const std::string& path, logdb_inserter ** insert )
+{
+    sqlite3 *db;
+    
+    if ( sqlite3_open( path.c_str(), &db ) != SQLITE_OK
+         || sqlite3_exec( db, "PRAGMA journal_mode = WAL;", 0, 0, 0 ) != SQLITE_OK )
+    {
+        fprintf(stderr, "Cannot open database %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    if ( !logdb_create_schema( db ) )
+    {
+        fprintf(stderr, "Failed to create the tables in %s\n", path.c_str());
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    *insert = new logdb_inserter( db );
+    
+    if ( sqlite3_prepare_v2( db, "INSERT INTO Logs(EventType, Time, ExecutableId, FilenameId, Detail) VALUES(?, ?, ?, ?, ?)", -1, &(*insert)->insert, 0 ) != SQLITE_OK
+         || !(*insert)->executables.prepared() || !(*insert)->paths.prepared() )
+    {
+        fprintf(stderr, "Cannot prepare statement: %s\n", sqlite3_errmsg(db));
+        delete *insert;
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    return db;
+}
+
+// Binds the id of the path, or NULL if there is no path
+static void bindPath( sqlite3_stmt * stmt, int index, Dictionary& dictionary, std::string_view path )
+{
+    sqlite3_int64 id = path.length() > 0 ? dictionary.id( path ) : 0;
+    
+    if ( id )
+        sqlite3_bind_int64( stmt, index, id );
+    else
+        sqlite3_bind_null( stmt, index );
+}
+
+int logdb_insert( logdb_inserter * insert, const EndpointSecurity::Event& event )
+{
+    EventBlob::encode( event, insert->detail );
+    
+    return logdb_insert_record( insert, event.event_id, (int64_t) event.time_s * 1000000000 + event.time_ns, event.process_executable,
+                                event.filename, insert->detail );
+}
+
+int logdb_insert_record( logdb_inserter * insert, EndpointSecurity::EventId event_id, int64_t time, std::string_view executable,
+                         std::string_view filename, std::string_view detail )
+{
+    sqlite3_stmt * stmt = insert->insert;
+    
+    sqlite3_bind_int( stmt, 1, (int) event_id );
+    sqlite3_bind_int64( stmt, 2, time );
+    bindPath( stmt, 3, insert->executables, executable );
+    bindPath( stmt, 4, insert->paths, filename );
+    sqlite3_bind_blob( stmt, 5, detail.data(), detail.length(), SQLITE_STATIC );
+    
+    int rc = sqlite3_step( stmt );
+    sqlite3_reset( stmt );
+    return rc;
+}
+
+bool logdb_close( sqlite3 * db, logdb_inserter * insert )
+{
+    delete insert;
+    
+    bool checkpointed = sqlite3_wal_checkpoint_v2( db, nullptr, SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr ) == SQLITE_OK;
+    
+    if ( !checkpointed )
+        fprintf(stderr, "Cannot checkpoint the database: %s\n", sqlite3_errmsg(db));
+    
+    sqlite3_close( db );
+    return checkpointed;
+}
+
+// The unpartitioned single writer database, and the ones of several writers, whichever are there
+static std::vector< std::string > legacyPaths( const std::string& directory )
+{
+    std::vector< std::string > paths;
+    
+    if ( access( logdb_path( directory, 0, 1 ).c_str(), R_OK ) == 0 )
+        paths.push_back( logdb_path( directory, 0, 1 ) );
+    
+    for ( unsigned int k = 0; paths.size() < LOGDB_MAX_SHARDS && access( logdb_path( directory, k, 2 ).c_str(), R_OK ) == 0; k++ )
+        paths.push_back( logdb_path( directory, k, 2 ) );
+    
+    return paths;
+}
+
+bool logdb_upgrade_legacy( const std::string& directory )
+{
+    bool upgraded = true;
+    
+    for ( const std::string& path : legacyPaths( directory ) )
+    {
+        logdb_inserter * insert;
+        sqlite3 * db = logdb_open( path, &insert );
+        
+        if ( db )
+            logdb_close( db, insert );
+        else
+            upgraded = false;
+    }
+    
+    return upgraded;
+}
+
+sqlite3 * logdb_open_merged( const std::string& directory, int64_t from, int64_t to )
+{
+    // The unpartitioned single writer database, and the ones of several writers, whichever are there
+    std::vector< std::string > paths = legacyPaths( directory );
+    
+    // The partitions, if there is a catalog
+    if ( access( ( directory + "/catalog.db" ).c_str(), R_OK ) == 0 )
+    {
+        for ( const std::string& path : logdb_catalog_partitions( directory, from, to ) )
+            paths.push_back( path );
+    }
+    
+    if ( paths.empty() )
+    {
+        fprintf(stderr, "No databases in %s\n", directory.c_str());
+        return nullptr;
+    }
+    
+    sqlite3 *db;
+    
+    if ( sqlite3_open( ":memory:", &db ) != SQLITE_OK )
+    {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    // The details are read with event_field() and event_detail()
+    if ( !EventBlob::registerFunctions( db ) )
+    {
+        fprintf(stderr, "Cannot register the functions: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    if ( (int) paths.size() > sqlite3_limit( db, SQLITE_LIMIT_ATTACHED, -1 ) )
+    {
+        fprintf(stderr, "The time range covers %zu databases, but only %d could be read at once\n", paths.size(), sqlite3_limit( db, SQLITE_LIMIT_ATTACHED, -1 ));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    std::string logs;
+    char *err_msg = 0;
+    
+    for ( unsigned int i = 0; i < paths.size(); i++ )
+    {
+        std::string schema = "shard" + std::to_string( i );
+        char * attach = sqlite3_mprintf( "ATTACH DATABASE %Q AS %s;", paths[i].c_str(), schema.c_str() );
+        int rc = sqlite3_exec( db, attach, 0, 0, &err_msg );
+        sqlite3_free( attach );
+        
+        if ( rc != SQLITE_OK )
+        {
+            fprintf(stderr, "SQL error: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_close(db);
+            return nullptr;
+        }
+        
+        // The databases no writer opened since the details were added have no Detail column yet
+        const char * detail = hasColumn( db, schema, "Logs", "Detail" ) ? "l.Detail" : "NULL AS Detail";
+        
+        logs += ( i > 0 ? " UNION ALL " : "" );
+        logs += "SELECT l.EventType, l.Time, l.Time / 1000000000 AS Timestamp, l.Time % 1000000000 AS TimeNS, e.Path AS Executable, IFNULL(p.Path, '<missing>') AS Filename, "
+                + std::string( detail ) + " FROM " + schema + ".Logs l"
+                " LEFT JOIN " + schema + ".Executables e ON e.Id = l.ExecutableId LEFT JOIN " + schema + ".Paths p ON p.Id = l.FilenameId";
+    }
+    
+    // The event names are the same in every database
+    std::string sql = "CREATE TEMP VIEW Logs AS " + logs + " ORDER BY Time;"
+                      "CREATE TEMP VIEW LogsView AS SELECT EventTypes.Name AS EventType, Time, Timestamp, TimeNS, Executable, Filename, Detail "
+                      "FROM Logs LEFT JOIN shard0.EventTypes ON EventTypes.Id = Logs.EventType;";
+    
+    if ( sqlite3_exec( db, sql.c_str(), 0, 0, &err_msg ) != SQLITE_OK )
+    {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_close(db);
+        return nullptr;
+    }
+    
+    return db;
+}
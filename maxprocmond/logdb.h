@@ -0,0 +1,96 @@
+#ifndef LOGDB_H
+#define LOGDB_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "EndpointSecurity.h"
+#include "sqlite3.h"
+
+// Where the daemon keeps the databases by default
+#define LOGDB_DIRECTORY "/Library/Application Support/maxprocmon"
+
+// The most writers. The merged view attaches the files of all writers for every period it reads, and SQLite allows
+// SQLITE_MAX_ATTACHED databases, which the project sets to 125.
+#define LOGDB_MAX_SHARDS 10
+
+// The partition periods, in seconds
+#define LOGDB_HOURLY 3600
+#define LOGDB_DAILY 86400
+
+// The unpartitioned database of the given writer: database.db if there is a single writer, database-<k>.db otherwise.
+// The daemon writes into the partitions; the merged view still reads these.
+std::string logdb_path( const std::string& directory, unsigned int shard, unsigned int shards );
+
+// Converts the unpartitioned databases in the directory to the current schema, see logdb_create_schema(). No writer
+// opens them any more, so this is run before they are read. Returns false if one could not be converted.
+bool logdb_upgrade_legacy( const std::string& directory );
+
+// The partition of the given writer for the period which contains the time, in UTC: logs-YYYYMMDD-<k>.db for the days,
+// logs-YYYYMMDDTHH-<k>.db for the hours
+std::string logdb_partition_path( const std::string& directory, time_t time, unsigned int period, unsigned int shard );
+
+// The catalog.db in the directory lists the partitions with their time bounds, in nanoseconds since the epoch.
+// The bounds are those of the rows, recorded when the partition is closed; a partition being written, or one which was
+// not closed, has no bounds and overlaps any time range. The catalog is opened for each call, so it could be used from
+// any thread; the partitions are only opened and closed once per period.
+
+// Adds the partition being written to the catalog, or marks it as written again
+bool logdb_catalog_open( const std::string& directory, const std::string& path, unsigned int shard );
+
+// Records the bounds of the closed partition, from its rows
+bool logdb_catalog_close( const std::string& directory, const std::string& path, sqlite3 * db );
+
+// Reserves the sequence number of the next segment of the writer, see SegmentLog: at least the given one, and above
+// all those reserved before, so a segment name is never used twice even after the import deleted the segments
+bool logdb_catalog_segment( const std::string& directory, unsigned int shard, uint64_t& sequence );
+
+// The partitions which could have rows between the times, ordered by their start
+std::vector< std::string > logdb_catalog_partitions( const std::string& directory, int64_t from, int64_t to );
+
+// Deletes the closed partitions which only have rows older than the time, and returns how many were deleted; the
+// files which could not be deleted are reported. Each one is a file deletion, so it takes the same time however many
+// rows there are, and the other partitions are not touched.
+unsigned int logdb_retain( const std::string& directory, int64_t before );
+
+// Creates the log tables. Logs stores the event type as EndpointSecurity::EventId, the time in nanoseconds since
+// the epoch, indexed, and the executable and the file as the ids of their paths in the Executables and Paths tables;
+// a missing file is NULL. Detail has the other process and payload fields as an EventBlob. The EventTypes table has
+// the event names, and the LogsView view shows the log with the names, the paths, and the time split into seconds
+// and nanoseconds as well. The older databases which store the names, the paths or the split time in Logs are
+// converted.
+bool logdb_create_schema( sqlite3 * db );
+
+// The insert statement of a write connection, and the ids of the recently used executables and paths, so most inserts
+// do not look them up. Used by one thread at a time.
+struct logdb_inserter;
+
+// Opens the database for writing, creates the tables and prepares the inserts. Returns nullptr on error.
+sqlite3 * logdb_open( const std::string& path, logdb_inserter ** insert );
+
+// Inserts the event, adding its paths to the dictionaries if they are not there yet, and encoding its details
+int logdb_insert( logdb_inserter * insert, const EndpointSecurity::Event& event );
+
+// Inserts a row from its parts, as logdb_insert() does for an event: the time in nanoseconds since the epoch, the paths,
+// empty if there are none, and the EventBlob of the details
+int logdb_insert_record( logdb_inserter * insert, EndpointSecurity::EventId event_id, int64_t time, std::string_view executable,
+                         std::string_view filename, std::string_view detail );
+
+// Frees the inserter, moves the WAL into the database and truncates it, so the next start does not replay it,
+// and closes the database. Returns false if the checkpoint failed; the database is closed anyway.
+bool logdb_close( sqlite3 * db, logdb_inserter * insert );
+
+// Opens the read connection presenting the databases of all writers in the directory as one time-ordered Logs view,
+// and LogsView with the event names. Logs has the paths as text and the split time, as it had before the dictionaries
+// and the nanosecond time were introduced, as well as the Time column. Only the partitions which could have rows
+// between the times are attached, with the unpartitioned databases; the query still has to select the rows by Time.
+// The details are read with the event_field() and event_detail() functions, see EventBlob; they are given the Filename
+// column for the fields which are the event filename.
+// The views are temporary, so nothing is written to the databases.
+// Returns nullptr if there are no databases or on error.
+sqlite3 * logdb_open_merged( const std::string& directory, int64_t from = 0, int64_t to = INT64_MAX );
+
+#endif // LOGDB_H
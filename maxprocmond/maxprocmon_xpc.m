@@ -6,11 +6,14 @@
 //
 
 #import "maxprocmon_xpc.h"
+#include "esstatus.h"
 
 @implementation maxprocmon_xpc
 
 - (void)status:(void (^)(NSString *))reply {
-    reply(@"HELLO");
+    char * json = es_status();
+    reply([NSString stringWithUTF8String:json]);
+    free(json);
 }
 
 - (void)install:(void (^)(bool))reply {